@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "canonical_form.hpp"
+
+// Automorphism group of the unlabeled shape of a plan node. Two label vectors of
+// the same node are isomorphic exactly when one is the other permuted by one of
+// these automorphisms, so per-record canonicalization is plain array work.
+//
+// With edge labels an automorphism also permutes the edges: record position
+// num_vertices + e, the label of shape.edges[e], maps to the position of the
+// image edge.
+struct NodeAutomorphisms {
+  unsigned num_vertices;
+  // number of record positions permuted, num_vertices plus the edges with edge labels
+  unsigned width;
+  // images[a * width + v] is the image of position v under automorphism a
+  std::vector<unsigned> images;
+  // false when the group was too large to enumerate and only the identity is
+  // kept: canonical labels are then the labels as they are, and only canonical
+  // forms tell the classes of the node apart
+  bool complete = true;
+
+  std::size_t size() const {
+    return this->width == 0 ? 0 : this->images.size() / this->width;
+  }
+};
+
+// Calls f(image) for every isomorphism of the unlabeled shape from onto to,
+// until f returns false. image[v] is the image of record position v as in
+// NodeAutomorphisms: the vertices, then with edge_labels the edges. Vertices
+// only map onto vertices of the same structure color, which subsumes their
+// degrees.
+template <typename F>
+inline void for_each_isomorphism(const PatternShape& from, const PatternShape& to, bool edge_labels, F&& f) {
+  const unsigned n = from.num_vertices;
+  if (to.num_vertices != n || to.edges.size() != from.edges.size()) {
+    return;
+  }
+
+  std::vector<unsigned> image(n);
+  std::vector<char> used(n, 0);
+  bool done = false;
+  // backtracking over images of 0, 1, ..., n - 1, keeping edges among the
+  // assigned vertices consistent
+  auto extend = [&](unsigned v, auto& self) -> void {
+    if (v == n) {
+      std::vector<unsigned> positions(image);
+      if (edge_labels) {
+        // shape edges are sorted, so the image edge is found by binary search
+        for (auto& e: from.edges) {
+          auto mapped = std::make_pair(image[e.first], image[e.second]);
+          positions.push_back(n + (std::lower_bound(to.edges.begin(), to.edges.end(), mapped) - to.edges.begin()));
+        }
+      }
+      done = !f(positions);
+      return;
+    }
+    for (unsigned w = 0; w < n && !done; w++) {
+      if (used[w] || from.structure_colors[v] != to.structure_colors[w]) {
+        continue;
+      }
+      bool consistent = from.has_edge(v, v) == to.has_edge(w, w);
+      for (unsigned u = 0; u < v && consistent; u++) {
+        consistent = from.has_edge(u, v) == to.has_edge(image[u], w) &&
+                     from.has_edge(v, u) == to.has_edge(w, image[u]);
+      }
+      if (!consistent) {
+        continue;
+      }
+      image[v] = w;
+      used[w] = 1;
+      self(v + 1, self);
+      used[w] = 0;
+    }
+  };
+  extend(0, extend);
+}
+
+// Groups of shapes beyond max_bitmask_vertices are enumerated up to this many
+// automorphisms; a star on 12 vertices alone has 11! of them.
+const std::size_t max_enumerated_automorphisms = 1 << 12;
+
+// The first automorphism found is the identity, as canonical_labels() expects.
+inline NodeAutomorphisms get_automorphisms(const PatternShape& shape, bool edge_labels = false) {
+  NodeAutomorphisms ret;
+  ret.num_vertices = shape.num_vertices;
+  ret.width = shape.num_vertices + (edge_labels ? shape.edges.size() : 0);
+  const bool bounded = !shape.bitmask();
+  for_each_isomorphism(shape, shape, edge_labels, [&](const std::vector<unsigned>& image) {
+    if (bounded && ret.size() == max_enumerated_automorphisms) {
+      ret.images.resize(ret.width);
+      ret.complete = false;
+      return false;
+    }
+    ret.images.insert(ret.images.end(), image.begin(), image.end());
+    return true;
+  });
+  return ret;
+}
+
+inline std::vector<NodeAutomorphisms> get_automorphisms(const std::vector<PatternShape>& shapes, bool edge_labels = false) {
+  std::vector<NodeAutomorphisms> ret;
+  for (auto& shape: shapes) {
+    ret.push_back(get_automorphisms(shape, edge_labels));
+  }
+  return ret;
+}
+
+// Plan nodes grouped by isomorphism of their unlabeled shapes. The
+// representative of a group is its first node, and to_representative[m][v] is
+// the position in a representative's key of position v of a key of m, so that
+// keys of all nodes of a group compare in one layout.
+struct NodeGroups {
+  std::vector<unsigned> representative;
+  std::vector<std::vector<unsigned>> to_representative;
+};
+
+inline NodeGroups get_node_groups(const std::vector<PatternShape>& shapes, bool edge_labels = false) {
+  NodeGroups ret;
+  for (unsigned m = 0; m < shapes.size(); m++) {
+    std::vector<unsigned> mapping;
+    unsigned r = 0;
+    for (; r < m && mapping.empty(); r++) {
+      if (ret.representative[r] == r) {
+        for_each_isomorphism(shapes[m], shapes[r], edge_labels, [&](const std::vector<unsigned>& image) {
+          mapping = image;
+          return false;
+        });
+      }
+    }
+    if (mapping.empty()) {
+      r = m + 1;
+      for (unsigned v = 0; v < shapes[m].num_vertices + (edge_labels ? shapes[m].edges.size() : 0); v++) {
+        mapping.push_back(v);
+      }
+    }
+    ret.representative.push_back(r - 1);
+    ret.to_representative.push_back(std::move(mapping));
+  }
+  return ret;
+}
+
+// The automorphisms of a representative as permutations of the keys of a node
+// of its group: canonical_labels() with them reads a key of the node and writes
+// canonical labels in the representative's layout.
+inline NodeAutomorphisms onto_representative(const NodeAutomorphisms& aut, const std::vector<unsigned>& to_representative) {
+  std::vector<unsigned> from_representative(to_representative.size());
+  for (unsigned v = 0; v < to_representative.size(); v++) {
+    from_representative[to_representative[v]] = v;
+  }
+  NodeAutomorphisms ret = aut;
+  for (auto& position: ret.images) {
+    position = from_representative[position];
+  }
+  return ret;
+}
+
+// Writes the lexicographically smallest label vector in the automorphism orbit of labels.
+// K is the pattern width when known at compile time, 0 for the runtime-width fallback.
+// The first permutation is the identity only for a node's own automorphisms, see
+// onto_representative().
+template <unsigned K = 0>
+inline void canonical_labels(const NodeAutomorphisms& aut, const unsigned* labels, unsigned* out) {
+  const unsigned n = K ? K : aut.width;
+  const unsigned* perm = aut.images.data();
+  const unsigned* perm_end = perm + aut.images.size();
+  for (unsigned i = 0; i < n; i++) {
+    out[i] = labels[perm[i]];
+  }
+  for (perm += n; perm < perm_end; perm += n) {
+    unsigned i = 0;
+    while (i < n && labels[perm[i]] == out[i]) {
+      i++;
+    }
+    if (i < n && labels[perm[i]] < out[i]) {
+      for (; i < n; i++) {
+        out[i] = labels[perm[i]];
+      }
+    }
+  }
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "automorphism.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CLQ_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// canonical_labels() over many records of one plan node at once. Records are
+// transposed into lanes, label i of lane j at i * L + j, so each automorphism
+// is applied to L records by loading columns in permuted order, and the
+// running minimum is kept with vector compares and blends. On x86 the kernels
+// are built for AVX2 (8 lanes) and SSE4.1 (4 lanes) and picked at run time;
+// elsewhere, and for what is left of a batch, records go through
+// canonical_labels() one at a time. Labels are stored with the sign bit
+// flipped so that the signed compares order them as unsigned.
+
+const std::uint32_t lane_bias = 0x80000000u;
+
+// K is the record width when known at compile time, 0 otherwise, as for
+// canonical_labels()
+template <unsigned L, unsigned K>
+inline void to_lanes(const unsigned* rows, unsigned runtime_width, std::uint32_t* lanes) {
+  const unsigned width = K ? K : runtime_width;
+  for (unsigned j = 0; j < L; j++) {
+    for (unsigned i = 0; i < width; i++) {
+      lanes[i * L + j] = rows[j * width + i] ^ lane_bias;
+    }
+  }
+}
+
+template <unsigned L, unsigned K>
+inline void from_lanes(const std::uint32_t* lanes, unsigned runtime_width, unsigned* rows) {
+  const unsigned width = K ? K : runtime_width;
+  for (unsigned j = 0; j < L; j++) {
+    for (unsigned i = 0; i < width; i++) {
+      rows[j * width + i] = lanes[i * L + j] ^ lane_bias;
+    }
+  }
+}
+
+#ifdef CLQ_X86_KERNELS
+// best receives the canonical labels of the 8 records in lanes
+__attribute__((target("avx2")))
+inline void canonical_lanes_avx2(const NodeAutomorphisms& aut, const std::uint32_t* lanes, std::uint32_t* best) {
+  const unsigned n = aut.width;
+  const unsigned* perm = aut.images.data();
+  const unsigned* perm_end = perm + aut.images.size();
+  for (unsigned i = 0; i < n; i++) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(best + i * 8),
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes + perm[i] * 8)));
+  }
+  for (perm += n; perm < perm_end; perm += n) {
+    // lanes still equal to their minimum so far, and lanes found smaller
+    __m256i undecided = _mm256_set1_epi32(-1);
+    __m256i smaller = _mm256_setzero_si256();
+    for (unsigned i = 0; i < n; i++) {
+      __m256i label = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes + perm[i] * 8));
+      __m256i least = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(best + i * 8));
+      smaller = _mm256_or_si256(smaller, _mm256_and_si256(undecided, _mm256_cmpgt_epi32(least, label)));
+      undecided = _mm256_and_si256(undecided, _mm256_cmpeq_epi32(least, label));
+      if (_mm256_testz_si256(undecided, undecided)) {
+        break;
+      }
+    }
+    if (_mm256_testz_si256(smaller, smaller)) {
+      continue;
+    }
+    for (unsigned i = 0; i < n; i++) {
+      __m256i label = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes + perm[i] * 8));
+      __m256i least = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(best + i * 8));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(best + i * 8), _mm256_blendv_epi8(least, label, smaller));
+    }
+  }
+}
+
+// as canonical_lanes_avx2() for 4 records
+__attribute__((target("sse4.1")))
+inline void canonical_lanes_sse41(const NodeAutomorphisms& aut, const std::uint32_t* lanes, std::uint32_t* best) {
+  const unsigned n = aut.width;
+  const unsigned* perm = aut.images.data();
+  const unsigned* perm_end = perm + aut.images.size();
+  for (unsigned i = 0; i < n; i++) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(best + i * 4),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes + perm[i] * 4)));
+  }
+  for (perm += n; perm < perm_end; perm += n) {
+    __m128i undecided = _mm_set1_epi32(-1);
+    __m128i smaller = _mm_setzero_si128();
+    for (unsigned i = 0; i < n; i++) {
+      __m128i label = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes + perm[i] * 4));
+      __m128i least = _mm_loadu_si128(reinterpret_cast<const __m128i*>(best + i * 4));
+      smaller = _mm_or_si128(smaller, _mm_and_si128(undecided, _mm_cmpgt_epi32(least, label)));
+      undecided = _mm_and_si128(undecided, _mm_cmpeq_epi32(least, label));
+      if (_mm_testz_si128(undecided, undecided)) {
+        break;
+      }
+    }
+    if (_mm_testz_si128(smaller, smaller)) {
+      continue;
+    }
+    for (unsigned i = 0; i < n; i++) {
+      __m128i label = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes + perm[i] * 4));
+      __m128i least = _mm_loadu_si128(reinterpret_cast<const __m128i*>(best + i * 4));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(best + i * 4), _mm_blendv_epi8(least, label, smaller));
+    }
+  }
+}
+#endif
+
+// lanes of the widest kernel the processor runs, 1 for the scalar loop only
+inline unsigned canonical_batch_lanes() {
+#ifdef CLQ_X86_KERNELS
+  static const unsigned lanes = []() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? 8u : __builtin_cpu_supports("sse4.1") ? 4u : 1u;
+  }();
+  return lanes;
+#else
+  return 1;
+#endif
+}
+
+// Writes the canonical labels of count records, rows of aut.width labels, to
+// out, with kernels of at most max_lanes lanes; records as canonical_labels()
+// would. Nodes with a single automorphism only have their labels permuted.
+template <unsigned K = 0>
+inline void canonical_labels_batch(const NodeAutomorphisms& aut, const unsigned* labels, std::size_t count,
+                                   unsigned* out, unsigned max_lanes = canonical_batch_lanes()) {
+  const unsigned width = aut.width;
+  std::size_t r = 0;
+#ifdef CLQ_X86_KERNELS
+  const unsigned lanes = aut.size() > 1 ? std::min(max_lanes, canonical_batch_lanes()) : 1;
+  if (lanes > 1) {
+    std::vector<std::uint32_t> columns(width * lanes), best(width * lanes);
+    for (; r + lanes <= count; r += lanes) {
+      if (lanes == 8) {
+        to_lanes<8, K>(labels + r * width, width, columns.data());
+        canonical_lanes_avx2(aut, columns.data(), best.data());
+        from_lanes<8, K>(best.data(), width, out + r * width);
+      } else {
+        to_lanes<4, K>(labels + r * width, width, columns.data());
+        canonical_lanes_sse41(aut, columns.data(), best.data());
+        from_lanes<4, K>(best.data(), width, out + r * width);
+      }
+    }
+  }
+#else
+  (void) max_lanes;
+#endif
+  for (; r < count; r++) {
+    canonical_labels<K>(aut, labels + r * width, out + r * width);
+  }
+}
+
+// Gathers the records of one plan node and hands them to f(canonical labels,
+// count) batch_size at a time, canonicalized by canonical_labels_batch().
+template <unsigned K = 0>
+class CanonicalBatch {
+public:
+  static const std::size_t batch_size = 256;
+
+  CanonicalBatch(const NodeAutomorphisms& aut)
+      : aut(aut), labels(batch_size * aut.width), canonical(batch_size * aut.width) {
+    this->counts.reserve(batch_size);
+  }
+
+  template <typename F>
+  void add(const unsigned* labels, std::uint64_t count, F&& f) {
+    std::copy(labels, labels + this->aut.width, this->labels.begin() + this->counts.size() * this->aut.width);
+    this->counts.push_back(count);
+    if (this->counts.size() == batch_size) {
+      flush(f);
+    }
+  }
+
+  // hands out the records gathered so far
+  template <typename F>
+  void flush(F&& f) {
+    canonical_labels_batch<K>(this->aut, this->labels.data(), this->counts.size(), this->canonical.data());
+    for (std::size_t r = 0; r < this->counts.size(); r++) {
+      f(this->canonical.data() + r * this->aut.width, this->counts[r]);
+    }
+    this->counts.clear();
+  }
+
+private:
+  const NodeAutomorphisms& aut;
+  std::vector<unsigned> labels;
+  std::vector<unsigned> canonical;
+  std::vector<std::uint64_t> counts;
+};
@@ -0,0 +1,381 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <tuple>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "plan.hpp"
+
+// Unlabeled shape of a plan node as used per record. Edges are sorted by
+// (source, target), the order in which edge-labeled records list edge labels.
+// Shapes of up to max_bitmask_vertices vertices keep their adjacency as one
+// word, bit src * max_bitmask_vertices + dst.
+struct PatternShape {
+  unsigned num_vertices;
+  std::vector<std::pair<unsigned, unsigned>> edges;
+  std::uint64_t adjacency;
+  // indices into edges of the out- and in-edges of each vertex
+  std::vector<std::vector<unsigned>> out_edges, in_edges;
+  // the coarsest equitable partition of the unlabeled shape, see refine_colors()
+  std::vector<unsigned> structure_colors;
+
+  bool bitmask() const {
+    return this->num_vertices <= max_bitmask_vertices;
+  }
+
+  bool has_edge(unsigned src, unsigned dst) const {
+    if (bitmask()) {
+      return (this->adjacency >> (src * max_bitmask_vertices + dst)) & 1;
+    }
+    return std::binary_search(this->edges.begin(), this->edges.end(), std::make_pair(src, dst));
+  }
+};
+
+// Refines a partition of the vertices of shape until it is equitable: the
+// vertices of a cell then have as many out- and in-edges of each edge label
+// into each cell. color[v] is the first position of the cell of v in an order
+// of the vertices by cell. Cells split in place, ordered by the colors and
+// edge labels around their vertices, so isomorphic labeled patterns get
+// corresponding colors. edge_labels may be nullptr, for unlabeled edges.
+inline void refine_colors(const PatternShape& shape, const unsigned* edge_labels, std::vector<unsigned>& color) {
+  const unsigned n = shape.num_vertices;
+  auto edge_label = [&](unsigned e) {
+    return edge_labels != nullptr ? edge_labels[e] : 0;
+  };
+  std::vector<std::vector<unsigned>> signature(n);
+  std::vector<std::pair<unsigned, unsigned>> around;
+  // the (color, edge label) of the far ends of edges, sorted, after their number
+  auto append_around = [&](std::vector<unsigned>& sig, const std::vector<unsigned>& edges, bool out) {
+    around.clear();
+    for (auto e: edges) {
+      around.emplace_back(color[out ? shape.edges[e].second : shape.edges[e].first], edge_label(e));
+    }
+    std::sort(around.begin(), around.end());
+    sig.push_back(around.size());
+    for (auto& a: around) {
+      sig.push_back(a.first);
+      sig.push_back(a.second);
+    }
+  };
+  std::vector<unsigned> order(n);
+  std::vector<char> seen(n, 0);
+  unsigned cells = 0;
+  for (unsigned v = 0; v < n; v++) {
+    cells += !seen[color[v]];
+    seen[color[v]] = 1;
+  }
+  while (cells < n) {
+    for (unsigned v = 0; v < n; v++) {
+      signature[v].assign(1, color[v]);
+      append_around(signature[v], shape.out_edges[v], true);
+      append_around(signature[v], shape.in_edges[v], false);
+    }
+    for (unsigned i = 0; i < n; i++) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+      return signature[a] < signature[b];
+    });
+    unsigned refined = 0;
+    for (unsigned i = 0; i < n; i++) {
+      if (i == 0 || signature[order[i]] != signature[order[i - 1]]) {
+        refined++;
+        color[order[i]] = i;
+      } else {
+        color[order[i]] = color[order[i - 1]];
+      }
+    }
+    if (refined == cells) {
+      break;
+    }
+    cells = refined;
+  }
+}
+
+inline PatternShape make_pattern_shape(const PlanPattern& pattern) {
+  PatternShape ret;
+  ret.num_vertices = pattern.num_vertices;
+  ret.edges = pattern.edges;
+  std::sort(ret.edges.begin(), ret.edges.end());
+  ret.adjacency = pattern.adjacency;
+  ret.out_edges.assign(pattern.num_vertices, std::vector<unsigned>());
+  ret.in_edges.assign(pattern.num_vertices, std::vector<unsigned>());
+  for (unsigned e = 0; e < ret.edges.size(); e++) {
+    ret.out_edges[ret.edges[e].first].push_back(e);
+    ret.in_edges[ret.edges[e].second].push_back(e);
+  }
+  ret.structure_colors.assign(pattern.num_vertices, 0);
+  refine_colors(ret, nullptr, ret.structure_colors);
+  return ret;
+}
+
+inline std::vector<PatternShape> get_pattern_shapes(const Plan& plan) {
+  std::vector<PatternShape> ret;
+  for (auto& pattern: plan.patterns) {
+    ret.push_back(make_pattern_shape(pattern));
+  }
+  return ret;
+}
+
+// number of labels in a record of each plan node: its vertex labels, followed by
+// one label per edge with edge_labels
+inline std::vector<unsigned> get_key_widths(const std::vector<PatternShape>& shapes, bool edge_labels) {
+  std::vector<unsigned> ret;
+  for (auto& shape: shapes) {
+    ret.push_back(shape.num_vertices + (edge_labels ? shape.edges.size() : 0));
+  }
+  return ret;
+}
+
+// The smallest adjacency bit string, followed with edge labels by the edge
+// labels in bit order, over the leaves of an individualization-refinement
+// search: the cells of an equitable partition are split by individualizing one
+// vertex of the first cell of several vertices at a time, until every vertex
+// has a cell of its own and so a position. Branches are only taken for real
+// ties, cells refinement cannot split, and not for vertices an automorphism
+// found between two leaves maps onto a branch already taken. The first
+// partition orders vertices by label, so every leaf lists the labels in the
+// same order, stored in labels_in_order.
+inline std::string refined_adjacency(const PatternShape& shape, const unsigned* labels, const unsigned* edge_labels,
+                                     std::vector<unsigned>& labels_in_order) {
+  const unsigned n = shape.num_vertices;
+  std::vector<unsigned> color(n), order(n);
+  for (unsigned i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  auto invariant = [&](unsigned v) {
+    return std::make_pair(labels[v], shape.structure_colors[v]);
+  };
+  std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    return invariant(a) < invariant(b);
+  });
+  for (unsigned i = 0; i < n; i++) {
+    color[order[i]] = i > 0 && invariant(order[i]) == invariant(order[i - 1]) ? color[order[i - 1]] : i;
+  }
+  refine_colors(shape, edge_labels, color);
+
+  const std::size_t adjacency_size = (n * n + 7) / 8;
+  std::string best, leaf;
+  // best_vertex[i] is the vertex at position i of a leaf giving best
+  std::vector<unsigned> best_vertex(n);
+  std::vector<std::vector<unsigned>> automorphisms;
+  std::vector<std::pair<unsigned, unsigned>> labeled_edges;
+  std::vector<unsigned> fixed;
+  auto visit_leaf = [&](const std::vector<unsigned>& position) {
+    leaf.assign(adjacency_size, 0);
+    labeled_edges.clear();
+    for (unsigned e = 0; e < shape.edges.size(); e++) {
+      unsigned bit = position[shape.edges[e].first] * n + position[shape.edges[e].second];
+      leaf[bit / 8] |= static_cast<char>(1u << (bit % 8));
+      if (edge_labels != nullptr) {
+        labeled_edges.emplace_back(bit, edge_labels[e]);
+      }
+    }
+    std::sort(labeled_edges.begin(), labeled_edges.end());
+    for (auto& e: labeled_edges) {
+      leaf.append(reinterpret_cast<const char*>(&e.second), sizeof(e.second));
+    }
+    if (best.empty() || leaf < best) {
+      best.swap(leaf);
+      for (unsigned v = 0; v < n; v++) {
+        best_vertex[position[v]] = v;
+      }
+    } else if (leaf == best) {
+      std::vector<unsigned> image(n);
+      for (unsigned v = 0; v < n; v++) {
+        image[v] = best_vertex[position[v]];
+      }
+      automorphisms.push_back(std::move(image));
+    }
+  };
+  // orbits of the automorphisms found so far that fix every individualized vertex
+  std::vector<unsigned> orbit(n);
+  auto find_orbit = [&](unsigned v) {
+    while (orbit[v] != v) {
+      v = orbit[v] = orbit[orbit[v]];
+    }
+    return v;
+  };
+  auto update_orbits = [&]() {
+    for (unsigned v = 0; v < n; v++) {
+      orbit[v] = v;
+    }
+    for (auto& image: automorphisms) {
+      bool fixes = true;
+      for (auto v: fixed) {
+        fixes = fixes && image[v] == v;
+      }
+      for (unsigned v = 0; v < n && fixes; v++) {
+        unsigned a = find_orbit(v), b = find_orbit(image[v]);
+        orbit[std::max(a, b)] = std::min(a, b);
+      }
+    }
+  };
+  auto search = [&](const std::vector<unsigned>& color, auto& self) -> void {
+    std::vector<unsigned> size(n, 0);
+    for (auto c: color) {
+      size[c]++;
+    }
+    unsigned cell = 0;
+    while (cell < n && size[cell] < 2) {
+      cell += std::max(size[cell], 1u);
+    }
+    if (cell == n) {
+      visit_leaf(color);
+      return;
+    }
+    std::vector<unsigned> taken;
+    for (unsigned v = 0; v < n; v++) {
+      if (color[v] != cell) {
+        continue;
+      }
+      update_orbits();
+      if (std::any_of(taken.begin(), taken.end(), [&](unsigned t) { return find_orbit(t) == find_orbit(v); })) {
+        continue;
+      }
+      taken.push_back(v);
+      std::vector<unsigned> child(color);
+      for (unsigned w = 0; w < n; w++) {
+        if (color[w] == cell && w != v) {
+          child[w] = cell + 1;
+        }
+      }
+      refine_colors(shape, edge_labels, child);
+      fixed.push_back(v);
+      self(child, self);
+      fixed.pop_back();
+    }
+  };
+  search(color, search);
+
+  labels_in_order.resize(n);
+  for (unsigned i = 0; i < n; i++) {
+    labels_in_order[i] = labels[best_vertex[i]];
+  }
+  return best;
+}
+
+// Canonical byte string of a vertex-labeled pattern: two labeled patterns get the
+// same string exactly when they are isomorphic. The string is the vertex count,
+// the labels in a canonical order of the vertices and the adjacency matrix in
+// that order; with edge_labels (edge_labels[e] labelling shape.edges[e]) the
+// matrix is followed by the edge labels in matrix order.
+//
+// For bitmask shapes vertices are first ordered by the invariant (label,
+// out-degree, in-degree) and every ordering inside a cell of equal invariants
+// is enumerated for the lexicographically smallest matrix, one word, and edge
+// labels. Larger shapes, where those orderings get too many, take the smallest
+// matrix, a bit string, over the leaves of refined_adjacency().
+inline std::string canonical_form(const PatternShape& shape, const unsigned* labels,
+                                  const unsigned* edge_labels = nullptr) {
+  const unsigned n = shape.num_vertices;
+  std::string ret;
+  ret.push_back(static_cast<char>(n));
+  if (!shape.bitmask()) {
+    std::vector<unsigned> labels_in_order;
+    std::string adjacency = refined_adjacency(shape, labels, edge_labels, labels_in_order);
+    for (auto label: labels_in_order) {
+      ret.append(reinterpret_cast<const char*>(&label), sizeof(label));
+    }
+    ret.append(adjacency);
+    return ret;
+  }
+
+  std::vector<unsigned> out_degree(n, 0), in_degree(n, 0);
+  for (auto& e: shape.edges) {
+    out_degree[e.first]++;
+    in_degree[e.second]++;
+  }
+  auto invariant = [&](unsigned v) {
+    return std::make_tuple(labels[v], out_degree[v], in_degree[v]);
+  };
+
+  std::vector<unsigned> order(n);
+  for (unsigned i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    return invariant(a) < invariant(b) || (invariant(a) == invariant(b) && a < b);
+  });
+  std::vector<std::pair<unsigned, unsigned>> cells;
+  for (unsigned i = 0; i < n;) {
+    unsigned j = i + 1;
+    while (j < n && invariant(order[j]) == invariant(order[i])) {
+      j++;
+    }
+    if (j - i > 1) {
+      cells.emplace_back(i, j);
+    }
+    i = j;
+  }
+
+  for (unsigned i = 0; i < n; i++) {
+    unsigned label = labels[order[i]];
+    ret.append(reinterpret_cast<const char*>(&label), sizeof(label));
+  }
+
+  std::vector<unsigned> position(n);
+  std::vector<std::pair<unsigned, unsigned>> labeled_edges;
+  std::uint64_t word = 0, best_word = 0;
+  std::string edge_part, best_edge_part;
+  bool first = true;
+  while (true) {
+    for (unsigned i = 0; i < n; i++) {
+      position[order[i]] = i;
+    }
+    word = 0;
+    for (auto& e: shape.edges) {
+      word |= std::uint64_t(1) << (position[e.first] * n + position[e.second]);
+    }
+    if (edge_labels != nullptr) {
+      labeled_edges.clear();
+      for (unsigned e = 0; e < shape.edges.size(); e++) {
+        labeled_edges.emplace_back(position[shape.edges[e].first] * n + position[shape.edges[e].second], edge_labels[e]);
+      }
+      std::sort(labeled_edges.begin(), labeled_edges.end());
+      edge_part.clear();
+      for (auto& e: labeled_edges) {
+        edge_part.append(reinterpret_cast<const char*>(&e.second), sizeof(e.second));
+      }
+    }
+    if (first || word < best_word || (word == best_word && edge_part < best_edge_part)) {
+      best_word = word;
+      best_edge_part.swap(edge_part);
+      first = false;
+    }
+    // advance the orderings cell by cell, like an odometer
+    unsigned c = 0;
+    for (; c < cells.size(); c++) {
+      if (std::next_permutation(order.begin() + cells[c].first, order.begin() + cells[c].second)) {
+        break;
+      }
+    }
+    if (c == cells.size()) {
+      break;
+    }
+  }
+  ret.append(reinterpret_cast<const char*>(&best_word), sizeof(best_word));
+  ret.append(best_edge_part);
+  return ret;
+}
+
+// a form as lowercase hex, the form column of csv output
+inline std::string form_hex(const std::string& form) {
+  static const char digits[] = "0123456789abcdef";
+  std::string ret;
+  ret.reserve(2 * form.size());
+  for (unsigned char c: form) {
+    ret.push_back(digits[c >> 4]);
+    ret.push_back(digits[c & 15]);
+  }
+  return ret;
+}
+
+// form_hex() of the canonical_form() of a key of shape, the edge labels
+// following the vertex labels with edge_labels
+inline std::string canonical_form_hex(const PatternShape& shape, const unsigned* labels, bool edge_labels) {
+  return form_hex(canonical_form(shape, labels, edge_labels ? labels + shape.num_vertices : nullptr));
+}
@@ -0,0 +1,595 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "count_format.hpp"
+#include "count_reader.hpp"
+#include "flat_count_table.hpp"
+
+// On-disk cache of canonical forms across runs of one plan: (node_id, labels)
+// -> class id -> Canonicalizer::class_form(). Entries never go stale since a
+// form depends only on the plan, the key and the form layout, which the
+// version names.
+//
+// The cache is a sorted index, mapped and searched in place, and a log of the
+// keys added since the index was written. A run reads only the log into memory,
+// computes forms for keys found in neither, and appends those to the log as
+// they are found. Once the log holds more than a quarter of the index's keys,
+// compact() folds it into a new index, so startup costs O(log) and the index
+// costs only the pages a run's keys touch.
+//
+// Log, the .classes file:
+//   header:  CountFileHeader with magic "CLQCLASS", flags as for partials,
+//            reserved the generation of the index it extends
+//   records: u32 node_id, u32 labels[width of node_id], u32 class_id
+//            or u32 ~0, u32 form_size, char form[form_size]
+//
+// Log class ids go on from the index's, counting the form records in file
+// order, each written before its first use. A record cut short by an
+// interrupted run is dropped on open.
+//
+// Index, the .classes.index file:
+//   header:  CountFileHeader with magic "CLQCLIDX", flags as for partials,
+//            reserved the number of plan nodes
+//   sizes:   u64 generation, u64 num_forms, u64 forms_size,
+//            u64 num_keys[number of plan nodes]
+//   keys:    for each node, u32 labels[width of node], u32 class_id per key,
+//            increasing by labels, padded to 8 bytes
+//   classes: CacheForm[num_forms], increasing by form, class id the position
+//   forms:   char[forms_size]
+
+const char class_cache_magic[8] = {'C', 'L', 'Q', 'C', 'L', 'A', 'S', 'S'};
+const char class_cache_index_magic[8] = {'C', 'L', 'Q', 'C', 'L', 'I', 'D', 'X'};
+// 2: forms of shapes beyond max_bitmask_vertices from refined_adjacency()
+// 3: sorted index beside the log
+const std::uint32_t class_cache_version = 3;
+
+const std::uint32_t class_cache_flag_edge_labels = 1;
+
+struct CacheForm {
+  std::uint64_t offset;
+  std::uint64_t size;
+};
+
+// the cache file of a plan in dir, one per plan hash and key layout
+inline std::string class_cache_path(const std::string& dir, std::uint64_t plan_hash, bool edge_labels) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx%s.classes", static_cast<unsigned long long>(plan_hash),
+                edge_labels ? "-edge" : "");
+  return dir + "/" + name;
+}
+
+class ClassCache {
+public:
+  // opens or creates filename, waiting for other runs using it to finish
+  ClassCache(const std::string& filename, const std::vector<unsigned>& widths, std::uint64_t plan_hash,
+             bool edge_labels)
+      : filename(filename), index_filename(filename + ".index"), widths(widths), plan_hash(plan_hash),
+        edge_labels(edge_labels), keys(widths), appended(widths) {
+    this->fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (this->fd < 0) {
+      throw std::runtime_error("couldn't open " + filename);
+    }
+    if (::flock(this->fd, LOCK_EX) != 0) {
+      ::close(this->fd);
+      throw std::runtime_error("couldn't lock " + filename);
+    }
+    try {
+      load_index();
+      reset_log(load_log());
+      this->num_opened = this->index_keys + this->keys.size();
+    } catch (...) {
+      ::close(this->fd);
+      throw;
+    }
+  }
+
+  ~ClassCache() {
+    try {
+      flush();
+    } catch (const std::exception&) {
+    }
+    ::close(this->fd);
+  }
+
+  ClassCache(const ClassCache&) = delete;
+  ClassCache& operator=(const ClassCache&) = delete;
+
+  // the cached form of the key, or compute() appended as its form; safe to call
+  // from several threads
+  template <typename F>
+  std::string form(unsigned node_id, const unsigned* labels, F&& compute) {
+    const std::uint64_t* id = this->keys.find(node_id, labels);
+    if (id != nullptr) {
+      return class_form(*id);
+    }
+    const unsigned* indexed = find_indexed(node_id, labels);
+    if (indexed != nullptr && *indexed < this->index_forms) {
+      return index_form(*indexed);
+    }
+    std::string ret = compute();
+    std::lock_guard<std::mutex> guard(this->lock);
+    // another shard may have met the key already
+    auto& seen = this->appended(node_id, labels);
+    if (seen != 0) {
+      return ret;
+    }
+    seen = 1;
+    std::uint32_t class_id = find_index_form(ret);
+    if (class_id == this->index_forms) {
+      auto found = this->form_ids.find(ret);
+      if (found == this->form_ids.end()) {
+        std::uint32_t next = static_cast<std::uint32_t>(this->index_forms + this->form_ids.size());
+        found = this->form_ids.emplace(ret, next).first;
+        put(~std::uint32_t(0));
+        put(static_cast<std::uint32_t>(ret.size()));
+        this->pending.append(ret);
+      }
+      class_id = found->second;
+    }
+    put(static_cast<std::uint32_t>(node_id));
+    this->pending.append(reinterpret_cast<const char*>(labels), this->widths[node_id] * sizeof(unsigned));
+    put(class_id);
+    this->num_appended++;
+    if (this->pending.size() >= flush_size) {
+      flush_locked();
+    }
+    return ret;
+  }
+
+  // writes the appended entries out
+  void flush() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    flush_locked();
+  }
+
+  // Writes the appended entries out and, once the log holds more than a
+  // quarter of the index's keys, folds it into a new index. That reads the
+  // whole cache, so it amortizes to O(1) per key added. No form() may run
+  // meanwhile.
+  void compact() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    flush_locked();
+    std::uint64_t log_keys = this->keys.size() + this->num_appended - this->num_folded;
+    if (log_keys == 0 || log_keys * 4 <= this->index_keys) {
+      return;
+    }
+    write_index();
+    // the log names the new generation only once the index is in place, so a
+    // run interrupted here finds the log folded already
+    this->generation++;
+    reset_log(0);
+    this->num_folded = this->num_appended;
+    load_index();
+    this->keys = FlatCountTable(this->widths);
+    this->appended = FlatCountTable(this->widths);
+    this->forms.clear();
+    this->form_ids.clear();
+  }
+
+  // keys found on open, in the index and the log
+  std::size_t num_loaded() const {
+    return this->num_opened;
+  }
+
+  // keys of the log, read into memory on open
+  std::size_t num_logged() const {
+    return this->keys.size();
+  }
+
+  // keys appended by this run
+  std::uint64_t num_added() const {
+    return this->num_appended;
+  }
+
+private:
+  static const std::size_t flush_size = 1 << 20;
+
+  std::string filename;
+  std::string index_filename;
+  std::vector<unsigned> widths;
+  std::uint64_t plan_hash;
+  bool edge_labels;
+  int fd;
+  // the index, read-only and searched in place
+  std::unique_ptr<MappedFile> index;
+  std::uint64_t generation = 0;
+  std::uint64_t index_keys = 0;
+  std::uint32_t index_forms = 0;
+  std::vector<const unsigned*> index_sections;
+  std::vector<std::uint64_t> index_section_keys;
+  const CacheForm* index_classes = nullptr;
+  const char* index_form_data = nullptr;
+  // keys of the log -> class id and the forms of the log, read-only once loaded
+  FlatCountTable keys;
+  std::vector<std::string> forms;
+  // guarded by lock: every form of the log, loaded or appended, and the keys
+  // appended
+  std::unordered_map<std::string, std::uint32_t> form_ids;
+  std::mutex lock;
+  FlatCountTable appended;
+  std::string pending;
+  std::uint64_t num_appended = 0;
+  std::size_t num_opened = 0;
+  // keys appended before the last compact(), in the index since
+  std::uint64_t num_folded = 0;
+
+  template <typename T>
+  void put(T value) {
+    this->pending.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void flush_locked() {
+    const char* p = this->pending.data();
+    const char* end = p + this->pending.size();
+    while (p < end) {
+      ssize_t n = ::write(this->fd, p, end - p);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        throw std::runtime_error("couldn't write " + this->filename);
+      }
+      p += n;
+    }
+    this->pending.clear();
+  }
+
+  std::string class_form(std::uint64_t id) const {
+    return id < this->index_forms ? index_form(static_cast<std::uint32_t>(id)) : this->forms[id - this->index_forms];
+  }
+
+  std::string index_form(std::uint32_t id) const {
+    auto& cls = this->index_classes[id];
+    return std::string(this->index_form_data + cls.offset, cls.size);
+  }
+
+  // the class id of a key in the index, nullptr if absent
+  const unsigned* find_indexed(unsigned node_id, const unsigned* labels) const {
+    if (this->index_sections.empty()) {
+      return nullptr;
+    }
+    const unsigned width = this->widths[node_id];
+    const unsigned* records = this->index_sections[node_id];
+    std::size_t lo = 0, hi = this->index_section_keys[node_id];
+    while (lo < hi) {
+      std::size_t mid = lo + (hi - lo) / 2;
+      const unsigned* record = records + mid * (width + 1);
+      int order = compare_labels(record, labels, width);
+      if (order == 0) {
+        return record + width;
+      } else if (order < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return nullptr;
+  }
+
+  // the class id of a form in the index, index_forms if there is none
+  std::uint32_t find_index_form(const std::string& form) const {
+    std::uint32_t lo = 0, hi = this->index_forms;
+    while (lo < hi) {
+      std::uint32_t mid = lo + (hi - lo) / 2;
+      if (compare_form(mid, form) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo < this->index_forms && compare_form(lo, form) == 0 ? lo : this->index_forms;
+  }
+
+  int compare_form(std::uint32_t id, const std::string& form) const {
+    auto& cls = this->index_classes[id];
+    int ret = std::memcmp(this->index_form_data + cls.offset, form.data(), std::min<std::size_t>(cls.size, form.size()));
+    if (ret != 0) {
+      return ret;
+    }
+    return cls.size < form.size() ? -1 : cls.size > form.size() ? 1 : 0;
+  }
+
+  static int compare_labels(const unsigned* a, const unsigned* b, unsigned width) {
+    for (unsigned i = 0; i < width; i++) {
+      if (a[i] != b[i]) {
+        return a[i] < b[i] ? -1 : 1;
+      }
+    }
+    return 0;
+  }
+
+  void check_header(const CountFileHeader& header, const char* magic, const std::string& name) const {
+    if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0) {
+      throw std::runtime_error(name + ": not a class cache");
+    }
+    if (header.version != class_cache_version) {
+      throw std::runtime_error(name + ": unsupported class cache version " + std::to_string(header.version));
+    }
+    if (header.plan_hash != this->plan_hash ||
+        ((header.flags & class_cache_flag_edge_labels) != 0) != this->edge_labels) {
+      throw std::runtime_error(name + ": class cache was built for a different plan");
+    }
+  }
+
+  // Maps the index, if any, checking its layout and classes but not its keys,
+  // which are not touched before a lookup. A corrupt key can't name a class past the index, and
+  // one that is out of order is only missed.
+  void load_index() {
+    this->index.reset();
+    this->index_sections.clear();
+    this->index_section_keys.clear();
+    this->index_keys = 0;
+    this->index_forms = 0;
+    int index_fd = ::open(this->index_filename.c_str(), O_RDONLY);
+    if (index_fd < 0) {
+      if (errno == ENOENT) {
+        return;
+      }
+      throw std::runtime_error("couldn't open " + this->index_filename);
+    }
+    try {
+      this->index.reset(new MappedFile(index_fd));
+    } catch (...) {
+      ::close(index_fd);
+      throw;
+    }
+    ::close(index_fd);
+    auto corrupt = [&]() {
+      return std::runtime_error(this->index_filename + ": corrupt class cache");
+    };
+    const char* p = this->index->begin();
+    const char* end = this->index->end();
+    const unsigned num_nodes = this->widths.size();
+    CountFileHeader header;
+    if (!this->index->mapped() || static_cast<std::size_t>(end - p) < sizeof(header)) {
+      throw corrupt();
+    }
+    std::memcpy(&header, p, sizeof(header));
+    check_header(header, class_cache_index_magic, this->index_filename);
+    std::vector<std::uint64_t> sizes(3 + num_nodes);
+    if (header.reserved != num_nodes ||
+        static_cast<std::size_t>(end - p) < sizeof(header) + sizes.size() * sizeof(std::uint64_t)) {
+      throw corrupt();
+    }
+    std::memcpy(sizes.data(), p + sizeof(header), sizes.size() * sizeof(std::uint64_t));
+    p += sizeof(header) + sizes.size() * sizeof(std::uint64_t);
+    std::uint64_t num_forms = sizes[1];
+    std::uint64_t forms_size = sizes[2];
+    for (unsigned node_id = 0; node_id < num_nodes; node_id++) {
+      std::uint64_t num_keys = sizes[3 + node_id];
+      std::uint64_t length = (num_keys * (this->widths[node_id] + 1) * sizeof(unsigned) + 7) / 8 * 8;
+      if (num_keys > static_cast<std::uint64_t>(end - p) || length > static_cast<std::uint64_t>(end - p)) {
+        throw corrupt();
+      }
+      this->index_sections.push_back(reinterpret_cast<const unsigned*>(p));
+      this->index_section_keys.push_back(num_keys);
+      this->index_keys += num_keys;
+      p += length;
+    }
+    if (num_forms >= ~std::uint32_t(0) ||
+        static_cast<std::uint64_t>(end - p) != num_forms * sizeof(CacheForm) + forms_size) {
+      throw corrupt();
+    }
+    this->index_classes = reinterpret_cast<const CacheForm*>(p);
+    this->index_form_data = p + num_forms * sizeof(CacheForm);
+    for (std::size_t i = 0; i < num_forms; i++) {
+      if (this->index_classes[i].offset > forms_size || this->index_classes[i].size > forms_size - this->index_classes[i].offset) {
+        throw corrupt();
+      }
+    }
+    this->generation = sizes[0];
+    this->index_forms = static_cast<std::uint32_t>(num_forms);
+  }
+
+  // Calls on_form(form, size) and on_key(node_id, labels, class_id) for the
+  // records of a log over index_forms classes, returning the end of its last
+  // whole record.
+  template <typename F, typename G>
+  const char* scan_log(const char* p, const char* end, F&& on_form, G&& on_key) const {
+    std::vector<unsigned> labels;
+    std::uint64_t num_forms = this->index_forms;
+    const char* last = p;
+    while (true) {
+      std::uint32_t node_id;
+      if (!take(p, end, &node_id, sizeof(node_id))) {
+        break;
+      }
+      if (node_id == ~std::uint32_t(0)) {
+        std::uint32_t form_size;
+        if (!take(p, end, &form_size, sizeof(form_size)) || static_cast<std::size_t>(end - p) < form_size) {
+          break;
+        }
+        on_form(p, form_size);
+        num_forms++;
+        p += form_size;
+      } else {
+        if (node_id >= this->widths.size()) {
+          throw std::runtime_error(this->filename + ": corrupt class cache");
+        }
+        std::uint32_t id;
+        labels.resize(this->widths[node_id]);
+        if (!take(p, end, labels.data(), labels.size() * sizeof(unsigned)) || !take(p, end, &id, sizeof(id))) {
+          break;
+        }
+        if (id >= num_forms) {
+          throw std::runtime_error(this->filename + ": corrupt class cache");
+        }
+        on_key(node_id, labels.data(), id);
+      }
+      last = p;
+    }
+    return last;
+  }
+
+  // reads the log into memory, returning the end of its last whole record, 0
+  // for a log to start again
+  off_t load_log() {
+    MappedFile file(this->filename);
+    if (!file.mapped()) {
+      return 0;
+    }
+    const char* p = file.begin();
+    CountFileHeader header;
+    if (file.end() - p < static_cast<std::ptrdiff_t>(sizeof(header))) {
+      return 0;
+    }
+    std::memcpy(&header, p, sizeof(header));
+    check_header(header, class_cache_magic, this->filename);
+    if (header.reserved != static_cast<std::uint32_t>(this->generation)) {
+      // folded into the index by a run interrupted before it started the log again
+      if (header.reserved + 1 == static_cast<std::uint32_t>(this->generation)) {
+        return 0;
+      }
+      throw std::runtime_error(this->filename + ": class cache log doesn't match its index");
+    }
+    const char* end = scan_log(p + sizeof(header), file.end(), [&](const char* form, std::uint32_t size) {
+      std::uint32_t id = static_cast<std::uint32_t>(this->index_forms + this->forms.size());
+      this->form_ids.emplace(std::string(form, size), id);
+      this->forms.emplace_back(form, size);
+    }, [&](unsigned node_id, const unsigned* labels, std::uint32_t id) {
+      this->keys(node_id, labels) = id;
+    });
+    return end - file.begin();
+  }
+
+  // truncates the log to end, writing a new header at 0
+  void reset_log(off_t end) {
+    if (::ftruncate(this->fd, end) != 0 || ::lseek(this->fd, end, SEEK_SET) != end) {
+      throw std::runtime_error("couldn't truncate " + this->filename);
+    }
+    if (end == 0) {
+      CountFileHeader header;
+      std::memcpy(header.magic, class_cache_magic, sizeof(header.magic));
+      header.version = class_cache_version;
+      header.max_width = *std::max_element(this->widths.begin(), this->widths.end());
+      header.plan_hash = this->plan_hash;
+      header.flags = this->edge_labels ? class_cache_flag_edge_labels : 0;
+      header.reserved = static_cast<std::uint32_t>(this->generation);
+      this->pending.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      flush_locked();
+    }
+  }
+
+  // writes the index and the log, flushed, as the index of the next generation
+  void write_index() {
+    // every form by class id, then renumbered in form order
+    std::vector<std::string> all_forms;
+    all_forms.reserve(this->index_forms + this->form_ids.size());
+    for (std::uint32_t id = 0; id < this->index_forms; id++) {
+      all_forms.push_back(index_form(id));
+    }
+    std::vector<std::vector<unsigned>> records(this->widths.size());
+    for (unsigned node_id = 0; node_id < this->index_sections.size(); node_id++) {
+      const unsigned* section = this->index_sections[node_id];
+      records[node_id].assign(section, section + this->index_section_keys[node_id] * (this->widths[node_id] + 1));
+    }
+    {
+      MappedFile log(this->fd);
+      scan_log(log.begin() + sizeof(CountFileHeader), log.end(), [&](const char* form, std::uint32_t size) {
+        all_forms.emplace_back(form, size);
+      }, [&](unsigned node_id, const unsigned* labels, std::uint32_t id) {
+        auto& node_records = records[node_id];
+        node_records.insert(node_records.end(), labels, labels + this->widths[node_id]);
+        node_records.push_back(id);
+      });
+    }
+    std::vector<std::uint32_t> order(all_forms.size());
+    for (std::uint32_t id = 0; id < order.size(); id++) {
+      order[id] = id;
+    }
+    std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+      return all_forms[a] < all_forms[b];
+    });
+    std::vector<std::uint32_t> renumbered(order.size());
+    std::uint64_t forms_size = 0;
+    for (std::uint32_t i = 0; i < order.size(); i++) {
+      renumbered[order[i]] = i;
+      forms_size += all_forms[order[i]].size();
+    }
+
+    std::string temporary = this->index_filename + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    auto put_to = [&](const void* data, std::size_t size) {
+      out.write(static_cast<const char*>(data), size);
+    };
+    CountFileHeader header;
+    std::memcpy(header.magic, class_cache_index_magic, sizeof(header.magic));
+    header.version = class_cache_version;
+    header.max_width = *std::max_element(this->widths.begin(), this->widths.end());
+    header.plan_hash = this->plan_hash;
+    header.flags = this->edge_labels ? class_cache_flag_edge_labels : 0;
+    header.reserved = static_cast<std::uint32_t>(this->widths.size());
+    put_to(&header, sizeof(header));
+    std::vector<std::uint64_t> sizes = {this->generation + 1, order.size(), forms_size};
+    std::vector<std::vector<std::size_t>> sorted(this->widths.size());
+    for (unsigned node_id = 0; node_id < this->widths.size(); node_id++) {
+      const unsigned stride = this->widths[node_id] + 1;
+      auto& node_records = records[node_id];
+      auto& node_sorted = sorted[node_id];
+      for (std::size_t i = 0; i * stride < node_records.size(); i++) {
+        node_sorted.push_back(i);
+      }
+      auto labels_of = [&](std::size_t i) {
+        return node_records.data() + i * stride;
+      };
+      std::sort(node_sorted.begin(), node_sorted.end(), [&](std::size_t a, std::size_t b) {
+        return compare_labels(labels_of(a), labels_of(b), stride - 1) < 0;
+      });
+      node_sorted.erase(std::unique(node_sorted.begin(), node_sorted.end(), [&](std::size_t a, std::size_t b) {
+        return compare_labels(labels_of(a), labels_of(b), stride - 1) == 0;
+      }), node_sorted.end());
+      sizes.push_back(node_sorted.size());
+    }
+    put_to(sizes.data(), sizes.size() * sizeof(std::uint64_t));
+    static const char zeros[8] = {0};
+    for (unsigned node_id = 0; node_id < this->widths.size(); node_id++) {
+      const unsigned stride = this->widths[node_id] + 1;
+      for (std::size_t i: sorted[node_id]) {
+        const unsigned* record = records[node_id].data() + i * stride;
+        put_to(record, (stride - 1) * sizeof(unsigned));
+        put_to(&renumbered[record[stride - 1]], sizeof(std::uint32_t));
+      }
+      std::size_t length = sorted[node_id].size() * stride * sizeof(unsigned);
+      put_to(zeros, (8 - length % 8) % 8);
+    }
+    std::uint64_t offset = 0;
+    for (std::uint32_t id: order) {
+      CacheForm cls = {offset, all_forms[id].size()};
+      put_to(&cls, sizeof(cls));
+      offset += cls.size;
+    }
+    for (std::uint32_t id: order) {
+      put_to(all_forms[id].data(), all_forms[id].size());
+    }
+    out.close();
+    if (!out || std::rename(temporary.c_str(), this->index_filename.c_str()) != 0) {
+      std::remove(temporary.c_str());
+      throw std::runtime_error("couldn't write " + this->index_filename);
+    }
+  }
+
+  static bool take(const char*& p, const char* end, void* into, std::size_t size) {
+    if (static_cast<std::size_t>(end - p) < size) {
+      return false;
+    }
+    std::memcpy(into, p, size);
+    p += size;
+    return true;
+  }
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "labeled_graph.hpp"
+#include "canonical_form.hpp"
+#include "automorphism.hpp"
+#include "canonical_batch.hpp"
+#include "class_cache.hpp"
+#include "flat_count_table.hpp"
+
+// (node_id, labels) -> count, last record of a key wins
+using RawCountMap = FlatCountTable;
+
+// labeled class found by canonical form, printed through its first raw key
+struct CanonicalClass {
+  unsigned node_id;
+  std::vector<unsigned> labels;
+  std::uint64_t count;
+};
+
+using ClassMap = std::unordered_map<std::string, CanonicalClass>;
+
+// merges classes across plan nodes by canonical form
+inline void add_canonical_class(ClassMap& canonical_count, std::string form, unsigned node_id,
+                                const unsigned* labels, unsigned width, std::uint64_t count) {
+  auto found = canonical_count.find(form);
+  if (found == canonical_count.end()) {
+    std::vector<unsigned> representative(labels, labels + width);
+    canonical_count.emplace(std::move(form), CanonicalClass{node_id, std::move(representative), count});
+  } else {
+    found->second.count += count;
+  }
+}
+
+// Prints a class as "Count:N" and its labeled pattern. With edge_labels the class
+// labels are followed by one label per edge, printed after the edge's endpoints.
+inline void write_class(std::ostream& out, const CanonicalClass& cls, const std::vector<Graph>& id_graph_map,
+                        bool edge_labels) {
+  auto& pattern = id_graph_map[cls.node_id];
+  const unsigned* labels = cls.labels.data();
+  out << "Count:" << cls.count << "\n";
+  if (edge_labels) {
+    write_edge_labeled_graph(out, make_labeled_graph(pattern, labels, labels + boost::num_vertices(pattern)));
+    out << "\n";
+  } else {
+    out << make_labeled_graph(pattern, labels) << "\n";
+  }
+}
+
+inline void merge_classes(ClassMap& into, const ClassMap& from) {
+  for (auto iter = from.begin(); iter != from.end(); iter++) {
+    auto found = into.find(iter->first);
+    if (found == into.end()) {
+      into.emplace(iter->first, iter->second);
+    } else {
+      found->second.count += iter->second.count;
+    }
+  }
+}
+
+// --min-count and --top-k, applied to consolidated classes. Raw keys are not
+// pruned ahead of consolidation: a class total is the sum of many raw keys,
+// none of which need reach the threshold on its own.
+struct ClassFilter {
+  std::uint64_t min_count = 0;
+  // 0 keeps every class
+  std::size_t top_k = 0;
+
+  bool keeps(const CanonicalClass& cls) const {
+    return cls.count >= this->min_count;
+  }
+
+  // the classes with count >= min_count; with top_k only the top_k heaviest of
+  // them, heaviest first
+  std::vector<const CanonicalClass*> select(std::vector<const CanonicalClass*> classes) const {
+    classes.erase(std::remove_if(classes.begin(), classes.end(), [&](const CanonicalClass* cls) {
+      return !keeps(*cls);
+    }), classes.end());
+    if (this->top_k == 0) {
+      return classes;
+    }
+    auto heavier = [](const CanonicalClass* a, const CanonicalClass* b) {
+      return a->count > b->count || (a->count == b->count &&
+             (a->node_id < b->node_id || (a->node_id == b->node_id && a->labels < b->labels)));
+    };
+    std::size_t k = std::min(this->top_k, classes.size());
+    std::partial_sort(classes.begin(), classes.begin() + k, classes.end(), heavier);
+    classes.resize(k);
+    return classes;
+  }
+
+  std::vector<const CanonicalClass*> select(const ClassMap& classes) const {
+    std::vector<const CanonicalClass*> all;
+    all.reserve(classes.size());
+    for (auto iter = classes.begin(); iter != classes.end(); iter++) {
+      all.push_back(&iter->second);
+    }
+    return select(std::move(all));
+  }
+};
+
+// Folds raw counts into isomorphism classes, either with the per-node
+// automorphism groups or with one canonical form per raw key. With edge_labels
+// a key holds the vertex labels followed by the edge labels in PatternShape
+// edge order, and both are canonicalized together.
+//
+// With automorphisms, plan nodes of isomorphic shapes share their classes:
+// automorphisms[node_id] writes canonical labels in the layout of
+// representative[node_id], so keys of the whole group meet in one table before
+// any canonical form is computed.
+struct Canonicalizer {
+  std::vector<PatternShape> shapes;
+  std::vector<NodeAutomorphisms> automorphisms;
+  // the node of each node's group, the node itself without automorphisms
+  std::vector<unsigned> representative;
+  bool use_automorphisms;
+  bool edge_labels;
+  // --class-cache: forms of keys seen by earlier runs
+  ClassCache* cache = nullptr;
+
+  Canonicalizer(std::vector<PatternShape> shapes, bool use_automorphisms, bool edge_labels = false)
+      : shapes(std::move(shapes)), use_automorphisms(use_automorphisms), edge_labels(edge_labels) {
+    for (unsigned node_id = 0; node_id < this->shapes.size(); node_id++) {
+      this->representative.push_back(node_id);
+    }
+    if (use_automorphisms) {
+      this->automorphisms = get_automorphisms(this->shapes, edge_labels);
+      NodeGroups groups = get_node_groups(this->shapes, edge_labels);
+      this->representative = groups.representative;
+      for (unsigned node_id = 0; node_id < this->shapes.size(); node_id++) {
+        unsigned r = this->representative[node_id];
+        if (r != node_id) {
+          this->automorphisms[node_id] = onto_representative(this->automorphisms[r], groups.to_representative[node_id]);
+        }
+      }
+    }
+  }
+
+  // whether some group holds more than one node
+  bool groups_nodes() const {
+    for (unsigned node_id = 0; node_id < this->representative.size(); node_id++) {
+      if (this->representative[node_id] != node_id) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<unsigned> key_widths() const {
+    return get_key_widths(this->shapes, this->edge_labels);
+  }
+
+  std::string class_form(unsigned node_id, const unsigned* labels) const {
+    auto& shape = this->shapes[node_id];
+    auto compute = [&]() {
+      return canonical_form(shape, labels, this->edge_labels ? labels + shape.num_vertices : nullptr);
+    };
+    return this->cache != nullptr ? this->cache->form(node_id, labels, compute) : compute();
+  }
+
+  void consolidate(const RawCountMap& raw_count, ClassMap& canonical_count) const {
+    auto& widths = raw_count.node_widths();
+    if (!this->use_automorphisms) {
+      raw_count.for_each([&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+        add_canonical_class(canonical_count, class_form(node_id, labels), node_id, labels, widths[node_id], count);
+      });
+      return;
+    }
+    // canonical labels within each plan node, summed per group when groups
+    // hold several nodes, then one canonical form per node class
+    RawCountMap group_count(widths);
+    const bool grouped = groups_nodes();
+    raw_count.for_each_node([&](unsigned node_id, const auto& table) {
+      const unsigned K = decltype(table.empty_like())::fixed_width;
+      const unsigned r = this->representative[node_id];
+      auto node_count = table.empty_like();
+      CanonicalBatch<K> batch(this->automorphisms[node_id]);
+      auto add = [&](const unsigned* labels, std::uint64_t count) {
+        node_count(labels) += count;
+      };
+      table.for_each([&](const unsigned* labels, std::uint64_t count) {
+        batch.add(labels, count, add);
+      });
+      batch.flush(add);
+      node_count.for_each([&](const unsigned* labels, std::uint64_t count) {
+        if (grouped) {
+          group_count(r, labels) += count;
+        } else {
+          add_canonical_class(canonical_count, class_form(r, labels), r, labels, table.width(), count);
+        }
+      });
+    });
+    group_count.for_each([&](unsigned r, const unsigned* labels, std::uint64_t count) {
+      add_canonical_class(canonical_count, class_form(r, labels), r, labels, widths[r], count);
+    });
+  }
+};
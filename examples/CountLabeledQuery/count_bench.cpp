@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "plan.hpp"
+#include "plan_graph.hpp"
+#include "consolidate.hpp"
+#include "parallel_count.hpp"
+#include "sort_engine.hpp"
+
+// Times the phases of CountLabeledQuery separately on one plan and count file:
+//
+//   plan         Plan load and pattern graphs
+//   labels       label dictionary pass, with --labels scan only
+//   parse        count records parsed, nothing stored
+//   dedup        parse plus last-write-wins raw tables, minus parse
+//   consolidate  raw tables folded into isomorphism classes
+//
+// --engine picks the hash tables or the sort engine for dedup and consolidate;
+// "both" times the two side by side as dedup.hash, dedup.sort and so on.
+//   output       classes formatted into memory
+//
+// Every phase is run --repeat times; the minimum and median wall time are
+// reported in milliseconds.
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+struct PhaseTimes {
+  std::string name;
+  std::vector<double> ms;
+
+  double min() const {
+    return *std::min_element(this->ms.begin(), this->ms.end());
+  }
+
+  double median() const {
+    std::vector<double> sorted = this->ms;
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[sorted.size() / 2];
+  }
+};
+
+// records in the count file, parsed with num_threads workers
+std::uint64_t parse_only(const std::string& filename, const std::vector<unsigned>& widths, std::uint64_t plan_hash,
+                         const std::vector<bool>& query_nodes, unsigned num_threads) {
+  MappedFile file(filename);
+  if (!file.mapped()) {
+    throw std::runtime_error("benchmarks need a regular count file");
+  }
+  auto chunks = split_count_data(file.begin(), file.end(), num_threads);
+  std::vector<std::uint64_t> records(chunks.size(), 0);
+  run_workers(chunks.size(), [&](unsigned c) {
+    CountRecordParser parser(widths, plan_hash, query_nodes);
+    if (c > 0 && *file.begin() == count_file_magic[0]) {
+      parser.expect_binary(file.begin());
+    }
+    auto on_record = [&](unsigned, const unsigned*, std::uint64_t) {};
+    parser.feed(chunks[c].first, chunks[c].second, on_record);
+    parser.finish(on_record);
+    records[c] = parser.records();
+  });
+  std::uint64_t ret = 0;
+  for (auto n: records) {
+    ret += n;
+  }
+  return ret;
+}
+
+void usage(const char* program) {
+  std::cerr << "usage: " << program << " [--iso automorphism|canonical] [--threads N] [--repeat R] [--edge-labels]"
+            << " [--labels scan] [--engine hash|sort|both]"
+            << " plan_file count_file" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  std::string iso_mode = "automorphism";
+  unsigned num_threads = 1;
+  unsigned repeat = 3;
+  bool edge_labels = false;
+  bool scan_labels = false;
+  std::string engine = "hash";
+  int arg = 1;
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (std::strcmp(argv[arg], "--iso") == 0 && arg + 1 < argc) {
+      iso_mode = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+      num_threads = std::strtoul(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--repeat") == 0 && arg + 1 < argc) {
+      repeat = std::strtoul(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--edge-labels") == 0) {
+      edge_labels = true;
+    } else if (std::strcmp(argv[arg], "--labels") == 0 && arg + 1 < argc && std::strcmp(argv[arg + 1], "scan") == 0) {
+      scan_labels = true;
+      arg++;
+    } else if (std::strcmp(argv[arg], "--engine") == 0 && arg + 1 < argc) {
+      engine = argv[++arg];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - arg != 2 || (iso_mode != "automorphism" && iso_mode != "canonical") || num_threads == 0 ||
+      repeat == 0 || (engine != "hash" && engine != "sort" && engine != "both")) {
+    usage(argv[0]);
+    return 1;
+  }
+  std::vector<std::string> engines = {engine};
+  if (engine == "both") {
+    engines = {"hash", "sort"};
+  }
+  // the sort engine packs keys
+  scan_labels = scan_labels || engine != "hash";
+  const std::string plan_file = argv[arg];
+  const std::string count_file = argv[arg + 1];
+
+  PhaseTimes plan_times{"plan", {}}, label_times{"labels", {}}, parse_times{"parse", {}}, output_times{"output", {}};
+  std::vector<PhaseTimes> dedup_times, consolidate_times;
+  for (auto& e: engines) {
+    std::string suffix = engines.size() > 1 ? "." + e : "";
+    dedup_times.push_back(PhaseTimes{"dedup" + suffix, {}});
+    consolidate_times.push_back(PhaseTimes{"consolidate" + suffix, {}});
+  }
+  std::uint64_t num_records = 0;
+  std::size_t num_raw = 0, num_classes = 0, output_bytes = 0;
+  try {
+    for (unsigned r = 0; r < repeat; r++) {
+      auto start = Clock::now();
+      Plan plan(plan_file);
+      std::vector<Graph> id_graph_map = get_id_graph_map_from_plan(plan);
+      std::vector<unsigned> widths = plan.get_id_vertex_num();
+      if (edge_labels) {
+        widths = get_key_widths(get_pattern_shapes(plan), true);
+      }
+      std::uint64_t plan_hash = plan_file_hash(plan_file);
+      std::vector<bool> query_nodes = plan.get_query_nodes();
+      plan_times.ms.push_back(elapsed_ms(start));
+
+      std::unique_ptr<LabelDictionary> dictionary;
+      if (scan_labels) {
+        start = Clock::now();
+        dictionary.reset(new LabelDictionary(scan_label_dictionary(count_file, widths, plan_hash, query_nodes, num_threads)));
+        label_times.ms.push_back(elapsed_ms(start));
+      }
+
+      start = Clock::now();
+      num_records = parse_only(count_file, widths, plan_hash, query_nodes, num_threads);
+      parse_times.ms.push_back(elapsed_ms(start));
+
+      Canonicalizer canonicalizer(get_pattern_shapes(plan), iso_mode == "automorphism", edge_labels);
+      ClassMap canonical_count;
+      for (unsigned e = 0; e < engines.size(); e++) {
+        canonical_count.clear();
+        if (engines[e] == "sort") {
+          if (!sort_engine_packs(widths, *dictionary)) {
+            throw std::runtime_error("keys don't fit 64 bits, the sort engine can't run");
+          }
+          start = Clock::now();
+          SortedRawCounts sorted = sort_raw_count(count_file, widths, plan_hash, query_nodes, num_threads,
+                                                  *dictionary);
+          dedup_times[e].ms.push_back(std::max(0.0, elapsed_ms(start) - parse_times.ms.back()));
+          num_raw = sorted.size();
+
+          start = Clock::now();
+          canonical_count = consolidate_sorted(sorted, canonicalizer, num_threads);
+          consolidate_times[e].ms.push_back(elapsed_ms(start));
+        } else {
+          start = Clock::now();
+          std::vector<RawCountMap> raw_count = parallel_raw_count(count_file, widths, plan_hash, query_nodes,
+                                                                  num_threads, nullptr, dictionary.get());
+          dedup_times[e].ms.push_back(std::max(0.0, elapsed_ms(start) - parse_times.ms.back()));
+          num_raw = 0;
+          for (auto& shard: raw_count) {
+            num_raw += shard.size();
+          }
+
+          start = Clock::now();
+          canonical_count = parallel_consolidate(raw_count, canonicalizer);
+          consolidate_times[e].ms.push_back(elapsed_ms(start));
+        }
+      }
+      num_classes = canonical_count.size();
+
+      start = Clock::now();
+      std::ostringstream out;
+      for (auto iter = canonical_count.begin(); iter != canonical_count.end(); iter++) {
+        write_class(out, iter->second, id_graph_map, edge_labels);
+      }
+      output_bytes = out.tellp();
+      output_times.ms.push_back(elapsed_ms(start));
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cout << "records " << num_records << ", raw keys " << num_raw << ", classes " << num_classes
+            << ", output bytes " << output_bytes << ", threads " << num_threads << std::endl;
+  std::cout << "phase\tmin_ms\tmedian_ms" << std::endl;
+  std::vector<const PhaseTimes*> phases = {&plan_times, &label_times, &parse_times};
+  for (auto& times: dedup_times) {
+    phases.push_back(&times);
+  }
+  for (auto& times: consolidate_times) {
+    phases.push_back(&times);
+  }
+  phases.push_back(&output_times);
+  for (auto* phase: phases) {
+    if (phase->ms.empty()) {
+      continue;
+    }
+    std::cout << phase->name << "\t" << phase->min() << "\t" << phase->median() << std::endl;
+  }
+  double parse_s = parse_times.min() / 1000;
+  if (parse_s > 0) {
+    std::cout << "parse rate " << static_cast<std::uint64_t>(num_records / parse_s) << " records/s" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Versioned binary count-record format, shared with the Rust producer in
+// src/wings_plan/count_record.rs. All fields are little-endian.
+//
+//   header:  char magic[8] = "CLQCOUNT", u32 version, u32 max_width,
+//            u64 plan_hash, u32 flags, u32 reserved
+//   records: u32 node_id, u32 labels[max_width], u64 count
+//
+// Labels past the width of the record's plan node are written as zero.
+// plan_hash is plan_file_hash() of the plan the records were produced with.
+
+const char count_file_magic[8] = {'C', 'L', 'Q', 'C', 'O', 'U', 'N', 'T'};
+const std::uint32_t count_file_version = 1;
+
+// header flag: records are consolidated classes, one per isomorphism class, rather than raw counts
+const std::uint32_t count_file_flag_classes = 1;
+// header flag: records are signed increments for --delta, count being an i64
+const std::uint32_t count_file_flag_delta = 2;
+
+struct CountFileHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t max_width;
+  std::uint64_t plan_hash;
+  std::uint32_t flags;
+  std::uint32_t reserved;
+};
+static_assert(sizeof(CountFileHeader) == 32, "CountFileHeader must not be padded");
+
+inline std::size_t count_record_size(unsigned max_width) {
+  return 3 * sizeof(std::uint32_t) + max_width * sizeof(std::uint32_t);
+}
+
+// FNV-1a over the plan file bytes
+inline std::uint64_t plan_file_hash(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("couldn't open " + filename);
+  }
+  std::uint64_t hash = 14695981039346656037ull;
+  for (std::istreambuf_iterator<char> it(file), end; it != end; ++it) {
+    hash ^= static_cast<unsigned char>(*it);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+class CountRecordWriter {
+public:
+  CountRecordWriter(std::ostream& out, std::uint64_t plan_hash, unsigned max_width, std::uint32_t flags = 0)
+      : out(out), max_width(max_width), record(count_record_size(max_width)) {
+    CountFileHeader header;
+    std::memcpy(header.magic, count_file_magic, sizeof(header.magic));
+    header.version = count_file_version;
+    header.max_width = max_width;
+    header.plan_hash = plan_hash;
+    header.flags = flags;
+    header.reserved = 0;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+
+  void write(unsigned node_id, const unsigned* labels, unsigned width, std::uint64_t count) {
+    std::fill(this->record.begin(), this->record.end(), 0);
+    std::uint32_t id = node_id;
+    std::memcpy(&this->record[0], &id, sizeof(id));
+    std::memcpy(&this->record[sizeof(id)], labels, width * sizeof(std::uint32_t));
+    std::memcpy(&this->record[this->record.size() - sizeof(count)], &count, sizeof(count));
+    this->out.write(this->record.data(), this->record.size());
+  }
+
+private:
+  std::ostream& out;
+  unsigned max_width;
+  std::vector<char> record;
+};
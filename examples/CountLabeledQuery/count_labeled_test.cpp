@@ -0,0 +1,700 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef CLQ_ZSTD
+#include <zstd.h>
+#endif
+
+#include "plan.hpp"
+#include "plan_graph.hpp"
+#include "labeled_graph.hpp"
+#include "canonical_form.hpp"
+#include "automorphism.hpp"
+#include "canonical_batch.hpp"
+#include "consolidate.hpp"
+#include "count_format.hpp"
+#include "count_reader.hpp"
+#include "partial.hpp"
+#include "delta.hpp"
+
+// Behavior tests, one CTest test per entry of tests below, each run as
+// CountLabeledQueryTest NAME. A failed check prints its line and the test
+// goes on, so one run lists every failure.
+
+int failures = 0;
+
+#define CHECK(condition)                                                                   \
+  do {                                                                                     \
+    if (!(condition)) {                                                                    \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+      failures++;                                                                          \
+    }                                                                                      \
+  } while (false)
+
+template <typename F>
+bool throws(F&& f) {
+  try {
+    f();
+  } catch (const std::runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+// scratch files under TMPDIR, removed with the directory
+class ScratchDir {
+public:
+  ScratchDir() {
+    const char* tmpdir = std::getenv("TMPDIR");
+    this->path = std::string(tmpdir != nullptr && *tmpdir != 0 ? tmpdir : "/tmp") + "/clq-test-XXXXXX";
+    if (::mkdtemp(&this->path[0]) == nullptr) {
+      throw std::runtime_error("couldn't create " + this->path);
+    }
+  }
+
+  ~ScratchDir() {
+    for (auto& file: this->files) {
+      std::remove(file.c_str());
+    }
+    ::rmdir(this->path.c_str());
+  }
+
+  ScratchDir(const ScratchDir&) = delete;
+  ScratchDir& operator=(const ScratchDir&) = delete;
+
+  std::string file(const std::string& name) {
+    this->files.push_back(this->path + "/" + name);
+    return this->files.back();
+  }
+
+private:
+  std::string path;
+  std::vector<std::string> files;
+};
+
+// a connected pattern on n vertices: a random tree, edges in random
+// directions, and up to extra_edges more
+PlanPattern random_pattern(std::mt19937& rng, unsigned n, unsigned extra_edges) {
+  PlanPattern pattern;
+  pattern.num_vertices = n;
+  for (unsigned v = 1; v < n; v++) {
+    unsigned u = rng() % v;
+    if (rng() % 2) {
+      pattern.add_edge(u, v);
+    } else {
+      pattern.add_edge(v, u);
+    }
+  }
+  for (unsigned i = 0; i < extra_edges; i++) {
+    unsigned u = rng() % n, v = rng() % n;
+    if (u != v) {
+      pattern.add_edge(u, v);
+    }
+  }
+  return pattern;
+}
+
+// shapes with large automorphism groups: a directed cycle, an out-star and a
+// cycle with edges both ways
+std::vector<PlanPattern> symmetric_patterns(unsigned n) {
+  std::vector<PlanPattern> ret(3);
+  for (auto& pattern: ret) {
+    pattern.num_vertices = n;
+  }
+  for (unsigned v = 0; v < n; v++) {
+    ret[0].add_edge(v, (v + 1) % n);
+    if (v > 0) {
+      ret[1].add_edge(0, v);
+    }
+    ret[2].add_edge(v, (v + 1) % n);
+    ret[2].add_edge((v + 1) % n, v);
+  }
+  return ret;
+}
+
+// pattern with vertex v renumbered perm[v]
+PlanPattern permuted_pattern(const PlanPattern& pattern, const std::vector<unsigned>& perm) {
+  PlanPattern ret;
+  ret.num_vertices = pattern.num_vertices;
+  for (auto& e: pattern.edges) {
+    ret.add_edge(perm[e.first], perm[e.second]);
+  }
+  return ret;
+}
+
+Graph pattern_graph(const PlanPattern& pattern) {
+  Graph ret(pattern.num_vertices);
+  for (auto& e: pattern.edges) {
+    boost::add_edge(e.first, e.second, ret);
+  }
+  return ret;
+}
+
+std::vector<unsigned> random_labels(std::mt19937& rng, unsigned n, unsigned num_labels) {
+  std::vector<unsigned> ret(n);
+  for (auto& label: ret) {
+    label = rng() % num_labels;
+  }
+  return ret;
+}
+
+// One plan node's shape seen the three ways the tool tells labeled patterns
+// apart. Keys hold the vertex labels, then with edge_labels one label per edge
+// of shape.edges.
+struct IsoOracles {
+  PatternShape shape;
+  Graph graph;
+  NodeAutomorphisms automorphisms;
+  bool edge_labels;
+
+  IsoOracles(const PlanPattern& pattern, bool edge_labels)
+      : shape(make_pattern_shape(pattern)), graph(pattern_graph(pattern)), edge_labels(edge_labels) {
+    this->automorphisms = get_automorphisms(this->shape, edge_labels);
+  }
+
+  std::string form(const std::vector<unsigned>& key) const {
+    return canonical_form(this->shape, key.data(), this->edge_labels ? key.data() + this->shape.num_vertices : nullptr);
+  }
+
+  Graph labeled(const std::vector<unsigned>& key) const {
+    return make_labeled_graph(this->graph, key.data(), this->edge_labels ? key.data() + this->shape.num_vertices : nullptr);
+  }
+
+  std::vector<unsigned> canonical(const std::vector<unsigned>& key) const {
+    std::vector<unsigned> ret(key.size());
+    canonical_labels(this->automorphisms, key.data(), ret.data());
+    return ret;
+  }
+
+  unsigned width() const {
+    return this->shape.num_vertices + (this->edge_labels ? this->shape.edges.size() : 0);
+  }
+};
+
+// canonical_form(), the automorphism group and VF2 agree on whether pairs of
+// keys are isomorphic, on shapes with and without bitmask adjacency, and
+// canonical_form() is the same for a key carried over to a renumbered shape
+int test_canonical_form() {
+  std::mt19937 rng(12345);
+  unsigned isomorphic = 0, distinct = 0, renumbered = 0;
+  for (bool edge_labels: {false, true}) {
+    for (unsigned n = 3; n <= 10; n++) {
+      std::vector<PlanPattern> patterns = symmetric_patterns(n);
+      for (unsigned i = 0; i < 12; i++) {
+        patterns.push_back(random_pattern(rng, n, rng() % (n + 1)));
+      }
+      for (auto& pattern: patterns) {
+        IsoOracles oracles(pattern, edge_labels);
+        const unsigned width = oracles.width();
+        for (unsigned pair = 0; pair < 12; pair++) {
+          auto a = random_labels(rng, width, 3);
+          std::vector<unsigned> b(width);
+          if (pair % 2 == 0) {
+            // a's image under a random automorphism
+            auto& aut = oracles.automorphisms;
+            const unsigned* perm = aut.images.data() + (rng() % aut.size()) * width;
+            for (unsigned v = 0; v < width; v++) {
+              b[v] = a[perm[v]];
+            }
+          } else {
+            b = random_labels(rng, width, 2);
+          }
+          bool vf2 = check_iso(oracles.labeled(a), oracles.labeled(b));
+          if (pair % 2 == 0) {
+            CHECK(vf2);
+          }
+          CHECK((oracles.form(a) == oracles.form(b)) == vf2);
+          if (oracles.automorphisms.complete) {
+            CHECK((oracles.canonical(a) == oracles.canonical(b)) == vf2);
+          }
+          (vf2 ? isomorphic : distinct)++;
+        }
+
+        // the same labeled pattern on a renumbered shape
+        std::vector<unsigned> perm(n);
+        for (unsigned v = 0; v < n; v++) {
+          perm[v] = v;
+        }
+        std::shuffle(perm.begin(), perm.end(), rng);
+        IsoOracles permuted(permuted_pattern(pattern, perm), edge_labels);
+        auto key = random_labels(rng, width, 3);
+        std::vector<unsigned> moved(width);
+        for (unsigned v = 0; v < n; v++) {
+          moved[perm[v]] = key[v];
+        }
+        for (unsigned e = 0; edge_labels && e < oracles.shape.edges.size(); e++) {
+          auto edge = oracles.shape.edges[e];
+          auto image = std::make_pair(perm[edge.first], perm[edge.second]);
+          auto& edges = permuted.shape.edges;
+          moved[n + (std::lower_bound(edges.begin(), edges.end(), image) - edges.begin())] = key[n + e];
+        }
+        CHECK(check_iso(oracles.labeled(key), permuted.labeled(moved)));
+        CHECK(oracles.form(key) == permuted.form(moved));
+        renumbered++;
+      }
+    }
+  }
+  // both answers were met often enough to mean something
+  CHECK(isomorphic > 500 && distinct > 500 && renumbered > 200);
+  return 0;
+}
+
+// canonical_labels_batch() writes what canonical_labels() does at every lane
+// count, with the width known at compile time or not, for labels on both
+// sides of the kernels' sign bias
+template <unsigned K>
+void check_batch(const NodeAutomorphisms& aut, const std::vector<unsigned>& labels) {
+  const std::size_t count = labels.size() / aut.width;
+  std::vector<unsigned> expected(labels.size()), out(labels.size());
+  for (std::size_t r = 0; r < count; r++) {
+    canonical_labels(aut, labels.data() + r * aut.width, expected.data() + r * aut.width);
+  }
+  for (unsigned lanes: {1u, 4u, 8u}) {
+    std::fill(out.begin(), out.end(), 0);
+    canonical_labels_batch<K>(aut, labels.data(), count, out.data(), lanes);
+    CHECK(out == expected);
+  }
+}
+
+int test_canonical_labels_batch() {
+  std::mt19937 rng(777);
+  if (canonical_batch_lanes() < 8) {
+    std::cerr << "note: this processor runs " << canonical_batch_lanes() << " lanes, wider kernels are not tested"
+              << std::endl;
+  }
+  const unsigned large_labels[] = {0, 1, 0x7fffffffu, 0x80000000u, 0x80000001u, 0xffffffffu};
+  for (bool edge_labels: {false, true}) {
+    for (unsigned n = 3; n <= 6; n++) {
+      std::vector<PlanPattern> patterns = symmetric_patterns(n);
+      for (unsigned i = 0; i < 4; i++) {
+        patterns.push_back(random_pattern(rng, n, rng() % 3));
+      }
+      for (auto& pattern: patterns) {
+        NodeAutomorphisms aut = get_automorphisms(make_pattern_shape(pattern), edge_labels);
+        // whole batches of every lane count and a tail
+        std::vector<unsigned> labels((8 * 25 + 5) * aut.width);
+        for (std::size_t i = 0; i < labels.size(); i++) {
+          labels[i] = i % 3 == 0 ? large_labels[rng() % 6] : rng() % 3;
+        }
+        check_batch<0>(aut, labels);
+        if (aut.width == 4) {
+          check_batch<4>(aut, labels);
+        } else if (aut.width == 6) {
+          check_batch<6>(aut, labels);
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// plan nodes for the class tests: two isomorphic shapes, which share classes,
+// and one of their own
+std::vector<PatternShape> class_test_shapes() {
+  PlanPattern path, reversed, triangle;
+  path.num_vertices = reversed.num_vertices = 3;
+  triangle.num_vertices = 3;
+  path.add_edge(0, 1);
+  path.add_edge(1, 2);
+  reversed.add_edge(2, 1);
+  reversed.add_edge(1, 0);
+  triangle.add_edge(0, 1);
+  triangle.add_edge(1, 2);
+  triangle.add_edge(2, 0);
+  return {make_pattern_shape(path), make_pattern_shape(reversed), make_pattern_shape(triangle)};
+}
+
+const std::uint64_t test_plan_hash = 0x5eed;
+
+std::map<std::string, std::uint64_t> class_counts(const ClassMap& classes) {
+  std::map<std::string, std::uint64_t> ret;
+  for (auto& cls: classes) {
+    ret[cls.first] = cls.second.count;
+  }
+  return ret;
+}
+
+void write_partial_file(const std::string& filename, const ClassMap& classes, unsigned max_width) {
+  std::ofstream out(filename, std::ios::binary);
+  PartialWriter writer(out, test_plan_hash, max_width, false);
+  write_partial(writer, classes);
+}
+
+// (node_id, key) -> count of random keys over a few labels, so classes collect
+// several keys
+std::map<std::pair<unsigned, std::vector<unsigned>>, std::uint64_t> random_raw_counts(std::mt19937& rng,
+                                                                                      unsigned num_nodes,
+                                                                                      std::size_t num_keys) {
+  std::map<std::pair<unsigned, std::vector<unsigned>>, std::uint64_t> ret;
+  while (ret.size() < num_keys) {
+    ret[std::make_pair(static_cast<unsigned>(rng() % num_nodes), random_labels(rng, 3, 6))] = 1 + rng() % 1000;
+  }
+  return ret;
+}
+
+ClassMap consolidate_counts(const Canonicalizer& canonicalizer,
+                            const std::map<std::pair<unsigned, std::vector<unsigned>>, std::uint64_t>& counts) {
+  RawCountMap raw_count(canonicalizer.key_widths());
+  for (auto& key: counts) {
+    raw_count(key.first.first, key.first.second.data()) = key.second;
+  }
+  ClassMap ret;
+  canonicalizer.consolidate(raw_count, ret);
+  return ret;
+}
+
+// partials of disjoint parts of the keys merge into the classes of all of
+// them, in form order, whichever way the classes were consolidated
+int test_partial_merge() {
+  std::mt19937 rng(99);
+  ScratchDir dir;
+  std::vector<std::map<std::string, std::uint64_t>> totals;
+  for (bool use_automorphisms: {false, true}) {
+    Canonicalizer canonicalizer(class_test_shapes(), use_automorphisms);
+    auto counts = random_raw_counts(rng, 3, 400);
+    std::vector<std::map<std::pair<unsigned, std::vector<unsigned>>, std::uint64_t>> parts(3);
+    for (auto& key: counts) {
+      parts[rng() % parts.size()].insert(key);
+    }
+    std::vector<std::string> filenames;
+    for (unsigned p = 0; p < parts.size(); p++) {
+      filenames.push_back(dir.file("part" + std::to_string(use_automorphisms) + std::to_string(p)));
+      write_partial_file(filenames.back(), consolidate_counts(canonicalizer, parts[p]), 3);
+    }
+    std::map<std::string, std::uint64_t> merged;
+    std::string last;
+    bool ordered = true;
+    merge_partials(filenames, test_plan_hash, false, [&](const std::string& form, const CanonicalClass& cls) {
+      ordered = ordered && (merged.empty() || last < form);
+      last = form;
+      merged[form] = cls.count;
+    });
+    CHECK(ordered);
+    CHECK(merged == class_counts(consolidate_counts(canonicalizer, counts)));
+    totals.push_back(merged);
+    CHECK(throws([&]() {
+      merge_partials(filenames, test_plan_hash + 1, false, [](const std::string&, const CanonicalClass&) {});
+    }));
+  }
+  // automorphism groups and canonical forms find the same classes; the keys
+  // differ between the two runs, so compare class counts of one run
+  Canonicalizer by_form(class_test_shapes(), false), by_group(class_test_shapes(), true);
+  auto counts = random_raw_counts(rng, 3, 400);
+  CHECK(class_counts(consolidate_counts(by_form, counts)) == class_counts(consolidate_counts(by_group, counts)));
+  return 0;
+}
+
+// a snapshot of old counts plus a signed delta file of the changes has the
+// classes of the new counts, and written out as a snapshot again reads back
+// the same; a delta taking a class below zero is refused
+int test_delta_apply() {
+  std::mt19937 rng(4242);
+  ScratchDir dir;
+  Canonicalizer canonicalizer(class_test_shapes(), true);
+  auto widths = canonicalizer.key_widths();
+  auto old_counts = random_raw_counts(rng, 3, 300);
+  auto new_counts = old_counts;
+  for (auto iter = new_counts.begin(); iter != new_counts.end();) {
+    switch (rng() % 4) {
+      case 0: iter = new_counts.erase(iter); continue;
+      case 1: iter->second += rng() % 50; break;
+      case 2: iter->second -= rng() % iter->second; break;
+      default: break;
+    }
+    ++iter;
+  }
+  for (auto& key: random_raw_counts(rng, 3, 60)) {
+    new_counts.insert(key);
+  }
+  std::string snapshot = dir.file("snapshot");
+  write_partial_file(snapshot, consolidate_counts(canonicalizer, old_counts), 3);
+
+  // the signed difference of every key, split over two records for some
+  std::string delta = dir.file("delta");
+  {
+    std::ofstream out(delta);
+    auto write_record = [&](unsigned node_id, const std::vector<unsigned>& labels, std::int64_t change) {
+      out << node_id;
+      for (auto label: labels) {
+        out << " " << label;
+      }
+      out << " " << change << "\n";
+    };
+    std::map<std::pair<unsigned, std::vector<unsigned>>, std::int64_t> changes;
+    for (auto& key: old_counts) {
+      changes[key.first] -= key.second;
+    }
+    for (auto& key: new_counts) {
+      changes[key.first] += key.second;
+    }
+    for (auto& change: changes) {
+      if (change.second == 0) {
+        continue;
+      }
+      if (rng() % 3 == 0) {
+        write_record(change.first.first, change.first.second, change.second + 7);
+        write_record(change.first.first, change.first.second, -7);
+      } else {
+        write_record(change.first.first, change.first.second, change.second);
+      }
+    }
+    out << "#epoch 1\n";
+  }
+
+  std::uint64_t num_records;
+  ClassMap deltas = read_class_deltas(delta, widths, test_plan_hash, std::vector<bool>(widths.size(), true),
+                                      canonicalizer, &num_records);
+  CHECK(num_records > 0);
+  std::string next = dir.file("next");
+  std::map<std::string, std::uint64_t> applied;
+  {
+    std::ofstream out(next, std::ios::binary);
+    PartialWriter writer(out, test_plan_hash, 3, false);
+    DeltaStats stats = apply_class_deltas(snapshot, deltas, delta, test_plan_hash, false,
+                                          [&](const std::string& form, const CanonicalClass& cls) {
+      applied[form] = cls.count;
+      writer.write(form, cls);
+    });
+    CHECK(stats.added + stats.changed + stats.removed > 0);
+  }
+  CHECK(applied == class_counts(consolidate_counts(canonicalizer, new_counts)));
+  std::map<std::string, std::uint64_t> reread;
+  PartialReader reader(next, test_plan_hash, false);
+  while (reader.next()) {
+    reread[reader.current_form()] = reader.current().count;
+  }
+  CHECK(reread == applied);
+
+  // taking the largest class below zero
+  std::string overdrawn = dir.file("overdrawn");
+  {
+    auto& key = *old_counts.begin();
+    std::ofstream out(overdrawn);
+    out << key.first.first;
+    for (auto label: key.first.second) {
+      out << " " << label;
+    }
+    out << " -" << (1ull << 40) << "\n";
+  }
+  deltas = read_class_deltas(overdrawn, widths, test_plan_hash, std::vector<bool>(widths.size(), true),
+                             canonicalizer, &num_records);
+  CHECK(throws([&]() {
+    apply_class_deltas(snapshot, deltas, overdrawn, test_plan_hash, false,
+                       [](const std::string&, const CanonicalClass&) {});
+  }));
+  return 0;
+}
+
+using Records = std::vector<std::uint64_t>;
+
+// records of a count file as node_id, labels and count in a row each
+Records read_records(const std::string& filename, const std::vector<unsigned>& widths) {
+  Records ret;
+  CountRecordParser parser(widths);
+  read_count_file(filename, parser, [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    ret.push_back(node_id);
+    ret.insert(ret.end(), labels, labels + widths[node_id]);
+    ret.push_back(count);
+  });
+  return ret;
+}
+
+// as read_records(), through the block reader used for pipes
+Records read_descriptor_records(const std::string& filename, const std::vector<unsigned>& widths) {
+  Records ret;
+  CountRecordParser parser(widths);
+  auto on_record = [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    ret.push_back(node_id);
+    ret.insert(ret.end(), labels, labels + widths[node_id]);
+    ret.push_back(count);
+  };
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("couldn't open " + filename);
+  }
+  read_count_descriptor(fd, filename, [&](const char* begin, const char* end) {
+    parser.feed(begin, end, on_record);
+  });
+  ::close(fd);
+  parser.finish(on_record);
+  return ret;
+}
+
+// gzip and zstd count files, larger than a read block, read as the plain
+// file does, mapped or through a descriptor
+int test_compressed_input() {
+  std::mt19937 rng(5);
+  ScratchDir dir;
+  const std::vector<unsigned> widths = {2, 3};
+  std::string text;
+  for (unsigned i = 0; i < 300000; i++) {
+    unsigned node_id = rng() % 2;
+    text += std::to_string(node_id);
+    for (unsigned l = 0; l < widths[node_id]; l++) {
+      text += " " + std::to_string(rng() % 100000);
+    }
+    text += " " + std::to_string(rng()) + (i % 1000 == 0 ? "\r\n" : "\n");
+  }
+  CHECK(text.size() > (3u << 20));
+  std::string plain = dir.file("counts.txt");
+  std::ofstream(plain, std::ios::binary) << text;
+  Records expected = read_records(plain, widths);
+  CHECK(expected.size() > 300000 * 4);
+
+  std::string gzip = dir.file("counts.txt.gz");
+  gzFile gz = gzopen(gzip.c_str(), "wb");
+  CHECK(gz != nullptr && gzwrite(gz, text.data(), text.size()) == static_cast<int>(text.size()));
+  gzclose(gz);
+  CHECK(read_records(gzip, widths) == expected);
+  CHECK(read_descriptor_records(gzip, widths) == expected);
+
+#ifdef CLQ_ZSTD
+  std::string zstd = dir.file("counts.txt.zst");
+  std::vector<char> compressed(ZSTD_compressBound(text.size()));
+  std::size_t size = ZSTD_compress(compressed.data(), compressed.size(), text.data(), text.size(), 3);
+  CHECK(!ZSTD_isError(size));
+  std::ofstream(zstd, std::ios::binary).write(compressed.data(), size);
+  CHECK(read_records(zstd, widths) == expected);
+  CHECK(read_descriptor_records(zstd, widths) == expected);
+#else
+  std::cerr << "note: built without CLQ_ZSTD, zstd input is not tested" << std::endl;
+#endif
+
+  // a gzip stream cut short is an error, not a shorter input
+  std::string cut = dir.file("cut.gz");
+  {
+    std::ifstream in(gzip, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::ofstream(cut, std::ios::binary).write(data.data(), data.size() / 2);
+  }
+  CHECK(throws([&]() {
+    read_records(cut, widths);
+  }));
+  return 0;
+}
+
+// records of data fed in pieces of piece bytes, 0 for all at once
+Records parse(const std::string& data, const std::vector<unsigned>& widths, bool signed_counts = false,
+              std::size_t piece = 0, std::uint64_t plan_hash = 0) {
+  Records ret;
+  CountRecordParser parser(widths, plan_hash);
+  if (signed_counts) {
+    parser.accept_signed_counts();
+  }
+  auto on_record = [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    ret.push_back(node_id);
+    ret.insert(ret.end(), labels, labels + widths[node_id]);
+    ret.push_back(count);
+  };
+  if (piece == 0) {
+    piece = data.size();
+  }
+  for (std::size_t i = 0; i < data.size(); i += piece) {
+    parser.feed(data.data() + i, data.data() + std::min(data.size(), i + piece), on_record);
+  }
+  parser.finish(on_record);
+  return ret;
+}
+
+std::string binary_counts(std::uint64_t plan_hash, std::uint32_t flags, const std::vector<std::uint64_t>& counts) {
+  std::ostringstream out;
+  CountRecordWriter writer(out, plan_hash, 2, flags);
+  const unsigned labels[2] = {7, 8};
+  for (auto count: counts) {
+    writer.write(0, labels, 2, count);
+  }
+  return out.str();
+}
+
+// the parser takes well-formed records whole or a byte at a time, and rejects
+// truncated, overflowing and mis-signed ones
+int test_count_reader_rejects() {
+  const std::vector<unsigned> widths = {2, 1};
+  for (std::size_t piece: {std::size_t(0), std::size_t(1)}) {
+    CHECK(parse("0 1 2 3\n1 4 5\n", widths, false, piece) == (Records{0, 1, 2, 3, 1, 4, 5}));
+    CHECK(parse("0 1 2 3\r\n#epoch 0\n1 4 5", widths, false, piece) == (Records{0, 1, 2, 3, 1, 4, 5}));
+    CHECK(parse("0 1 2 18446744073709551615\n", widths, false, piece) == (Records{0, 1, 2, 18446744073709551615ull}));
+    CHECK(parse("0 1 2 -3\n", widths, true, piece) == (Records{0, 1, 2, 0 - 3ull}));
+
+    // truncated
+    CHECK(throws([&]() { parse("0 1 2", widths, false, piece); }));
+    CHECK(throws([&]() { parse("0 1 2 3\n1 4", widths, false, piece); }));
+    CHECK(throws([&]() { parse("0 1\n2 3\n", widths, false, piece); }));
+    // overflowing
+    CHECK(throws([&]() { parse("0 1 2 18446744073709551616\n", widths, false, piece); }));
+    CHECK(throws([&]() { parse("0 1 2 99999999999999999999\n", widths, false, piece); }));
+    CHECK(throws([&]() { parse("99999999999999999999 1 2 3\n", widths, false, piece); }));
+    CHECK(throws([&]() { parse("0 4294967296 2 3\n", widths, false, piece); }));
+    CHECK(throws([&]() { parse("2 1 2 3\n", widths, false, piece); }));
+    // mis-signed
+    CHECK(throws([&]() { parse("0 1 2 -3\n", widths, false, piece); }));
+    CHECK(throws([&]() { parse("0 1 -2 3\n", widths, true, piece); }));
+    CHECK(throws([&]() { parse("-0 1 2 3\n", widths, true, piece); }));
+    CHECK(throws([&]() { parse("0 1 2 - 3\n", widths, true, piece); }));
+    CHECK(throws([&]() { parse("0 1 2 --3\n", widths, true, piece); }));
+    CHECK(throws([&]() { parse("0 1 x 3\n", widths, false, piece); }));
+
+    // binary
+    std::string counts = binary_counts(test_plan_hash, 0, {5, 6});
+    CHECK(parse(counts, widths, false, piece, test_plan_hash) == (Records{0, 7, 8, 5, 0, 7, 8, 6}));
+    CHECK(throws([&]() { parse(counts.substr(0, counts.size() - 3), widths, false, piece); }));
+    CHECK(throws([&]() { parse(counts.substr(0, 20), widths, false, piece); }));
+    CHECK(throws([&]() { parse(counts, widths, false, piece, test_plan_hash + 1); }));
+    std::string deltas = binary_counts(test_plan_hash, count_file_flag_delta, {0 - 5ull});
+    CHECK(throws([&]() { parse(deltas, widths, false, piece); }));
+    CHECK(parse(deltas, widths, true, piece) == (Records{0, 7, 8, 0 - 5ull}));
+  }
+  return 0;
+}
+
+struct Test {
+  const char* name;
+  int (*run)();
+};
+
+const Test tests[] = {
+    {"canonical_form", test_canonical_form},
+    {"canonical_labels_batch", test_canonical_labels_batch},
+    {"partial_merge", test_partial_merge},
+    {"delta_apply", test_delta_apply},
+    {"compressed_input", test_compressed_input},
+    {"count_reader_rejects", test_count_reader_rejects},
+};
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    std::cerr << "usage: " << argv[0] << " test" << std::endl;
+    return 1;
+  }
+  for (auto& test: tests) {
+    if (std::strcmp(argv[1], test.name) == 0) {
+      try {
+        test.run();
+      } catch (const std::exception& e) {
+        std::cerr << test.name << ": " << e.what() << std::endl;
+        return 1;
+      }
+      if (failures != 0) {
+        std::cerr << test.name << ": " << failures << " checks failed" << std::endl;
+        return 1;
+      }
+      return 0;
+    }
+  }
+  std::cerr << "no test " << argv[1] << std::endl;
+  return 1;
+}
@@ -0,0 +1,522 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "count_format.hpp"
+#include "decompress.hpp"
+
+// Push parser for count records, either text records
+// "node_id label_0 ... label_{k-1} count", one per line, or the binary format
+// of count_format.hpp, told apart by the first byte. A text record split across
+// lines is an error, so that a file can be split for parallel parsing at any
+// newline (see split_count_data()). The record width k of every plan node comes from
+// Plan::get_id_vertex_num(). Input may be fed in arbitrary blocks: a number or
+// binary record split across two blocks is carried over in the parser state.
+//
+// In text input a line starting with '#' is a marker, e.g. an epoch boundary of
+// a live producer. Markers are skipped unless the caller passes on_marker.
+//
+// Records of a node with counted[node_id] false, such as an intermediate plan
+// node, are checked and dropped before they reach on_record; an empty counted
+// keeps every node.
+//
+// Delta files carry signed counts, "-12" in text and an i64 in binary records;
+// with accept_signed_counts() a negative count is handed on as its two's
+// complement, which additive sums undo.
+class CountRecordParser {
+public:
+  // plan_hash is checked against binary headers, 0 skips the check
+  CountRecordParser(std::vector<unsigned> widths, std::uint64_t plan_hash = 0, std::vector<bool> counted = {})
+      : widths(std::move(widths)), plan_hash(plan_hash), counted(std::move(counted)) {
+    if (this->counted.empty()) {
+      this->counted.assign(this->widths.size(), true);
+    }
+    unsigned max_width = 0;
+    for (auto w: this->widths) {
+      max_width = std::max(max_width, w);
+    }
+    this->fields.resize(max_width + 1);
+  }
+
+  // on_record(node_id, labels, count) is called for every complete record
+  template <typename F>
+  void feed(const char* begin, const char* end, F&& on_record) {
+    feed(begin, end, on_record, [](const std::string&) {});
+  }
+
+  // as above, with on_marker(text) called for every marker line, text excluding the newline
+  template <typename F, typename M>
+  void feed(const char* begin, const char* end, F&& on_record, M&& on_marker) {
+    if (this->format == Format::unknown && begin != end) {
+      this->format = *begin == count_file_magic[0] ? Format::binary : Format::text;
+    }
+    if (this->format == Format::binary) {
+      feed_binary(begin, end, on_record);
+      return;
+    }
+    for (const char* p = begin; p != end; p++) {
+      if (this->in_marker) {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        this->marker.append(p, eol == nullptr ? end : eol);
+        if (eol == nullptr) {
+          break;
+        }
+        p = eol;
+        this->in_marker = false;
+        on_marker(this->marker);
+        continue;
+      }
+      unsigned digit = static_cast<unsigned char>(*p) - '0';
+      if (digit < 10) {
+        // one compare per digit; only values near 2^64 take the exact check
+        if (this->value >= max_value / 10 && (this->value > max_value / 10 || digit > max_value % 10)) {
+          number_too_large();
+        }
+        this->value = this->value * 10 + digit;
+        this->in_number = true;
+        continue;
+      }
+      bool after_number = this->in_number;
+      if (this->in_number) {
+        end_number(on_record);
+      } else if (this->negative) {
+        // the sign belongs to the digits right after it
+        throw std::runtime_error("'-' not followed by a digit in count file");
+      }
+      if (*p == '-' && this->signed_counts && !after_number && !this->negative && this->field > 0 &&
+          this->field + 1 == this->record_fields) {
+        this->negative = true;
+      } else if (*p == '\n' && this->field != 0) {
+        throw std::runtime_error("count record split across lines");
+      } else if (*p == '#' && this->field == 0) {
+        this->in_marker = true;
+        this->marker.clear();
+        this->marker.push_back('#');
+      } else if (*p != ' ' && *p != '\n' && *p != '\t' && *p != '\r') {
+        throw std::runtime_error(std::string("unexpected character '") + *p + "' in count file");
+      }
+    }
+  }
+
+  // flushes a trailing number or marker that is not followed by a separator
+  template <typename F>
+  void finish(F&& on_record) {
+    finish(on_record, [](const std::string&) {});
+  }
+
+  template <typename F, typename M>
+  void finish(F&& on_record, M&& on_marker) {
+    if (this->in_number) {
+      end_number(on_record);
+    }
+    if (this->in_marker) {
+      this->in_marker = false;
+      on_marker(this->marker);
+    }
+    if (this->field != 0 || !this->pending.empty()) {
+      throw std::runtime_error("truncated record at end of count file");
+    }
+  }
+
+  // counts may be negative, see above
+  void accept_signed_counts() {
+    this->signed_counts = true;
+  }
+
+  // the data fed next is a body of binary records under this header
+  void expect_binary(const char* header) {
+    read_header(header);
+    this->format = Format::binary;
+  }
+
+  // records read, dropped ones included
+  std::uint64_t records() const {
+    return this->num_records;
+  }
+
+  std::uint64_t dropped() const {
+    return this->num_dropped;
+  }
+
+private:
+  enum class Format { unknown, text, binary };
+
+  std::vector<unsigned> widths;
+  std::uint64_t plan_hash;
+  std::vector<bool> counted;
+  Format format = Format::unknown;
+  // node id and labels of the record being parsed
+  std::vector<unsigned> fields;
+  unsigned field = 0;
+  unsigned record_fields = 0;
+  std::uint64_t value = 0;
+  bool in_number = false;
+  bool in_marker = false;
+  bool signed_counts = false;
+  // a '-' was read before the count of the record
+  bool negative = false;
+  std::string marker;
+  std::uint64_t num_records = 0;
+  std::uint64_t num_dropped = 0;
+  // binary header or record split across feeds
+  std::vector<char> pending;
+  bool has_header = false;
+  unsigned max_width = 0;
+  std::size_t record_size = 0;
+
+  inline void start_record(std::uint64_t node_id) {
+    if (node_id >= this->widths.size()) {
+      throw std::runtime_error("count record for unknown plan node " + std::to_string(node_id));
+    }
+  }
+
+  static const std::uint64_t max_value = std::numeric_limits<std::uint64_t>::max();
+
+  // kept out of the parse loop, as label_too_wide()
+  [[noreturn]] static void number_too_large() {
+    throw std::runtime_error("number in count file does not fit 64 bits");
+  }
+
+  // kept out of end_number() so the error message is not built in the parse loop
+  [[noreturn]] static void label_too_wide(std::uint64_t label) {
+    throw std::runtime_error("count record label " + std::to_string(label) + " does not fit 32 bits");
+  }
+
+  template <typename F>
+  inline void end_number(F&& on_record) {
+    if (this->field == 0) {
+      start_record(this->value);
+      this->record_fields = this->widths[this->value] + 2;
+    }
+    if (this->field + 1 == this->record_fields) {
+      if (this->counted[this->fields[0]]) {
+        on_record(this->fields[0], &this->fields[1], this->negative ? 0 - this->value : this->value);
+      } else {
+        this->num_dropped++;
+      }
+      this->negative = false;
+      this->field = 0;
+      this->num_records++;
+    } else {
+      if (this->value > std::numeric_limits<std::uint32_t>::max()) {
+        label_too_wide(this->value);
+      }
+      this->fields[this->field++] = static_cast<unsigned>(this->value);
+    }
+    this->value = 0;
+    this->in_number = false;
+  }
+
+  void read_header(const char* data) {
+    CountFileHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, count_file_magic, sizeof(header.magic)) != 0) {
+      throw std::runtime_error("bad magic in binary count file");
+    }
+    if (header.version != count_file_version) {
+      throw std::runtime_error("unsupported binary count file version " + std::to_string(header.version));
+    }
+    if (this->plan_hash != 0 && header.plan_hash != this->plan_hash) {
+      throw std::runtime_error("binary count file was produced for a different plan");
+    }
+    if ((header.flags & count_file_flag_delta) != 0 && !this->signed_counts) {
+      throw std::runtime_error("binary count file holds signed deltas");
+    }
+    this->max_width = header.max_width;
+    this->record_size = count_record_size(header.max_width);
+    this->has_header = true;
+  }
+
+  template <typename F>
+  inline void read_record(const char* data, F&& on_record) {
+    std::uint32_t node_id;
+    std::memcpy(&node_id, data, sizeof(node_id));
+    start_record(node_id);
+    if (this->widths[node_id] > this->max_width) {
+      throw std::runtime_error("binary count record wider than the header's max_width");
+    }
+    this->num_records++;
+    if (!this->counted[node_id]) {
+      this->num_dropped++;
+      return;
+    }
+    const char* label_data = data + sizeof(node_id);
+    const unsigned* labels = reinterpret_cast<const unsigned*>(label_data);
+    if (reinterpret_cast<std::uintptr_t>(label_data) % alignof(unsigned) != 0) {
+      std::memcpy(this->fields.data(), label_data, this->widths[node_id] * sizeof(unsigned));
+      labels = this->fields.data();
+    }
+    std::uint64_t count;
+    std::memcpy(&count, data + this->record_size - sizeof(count), sizeof(count));
+    on_record(node_id, labels, count);
+  }
+
+  // records are decoded in place, only a record split across feeds is copied
+  template <typename F>
+  void feed_binary(const char* p, const char* end, F&& on_record) {
+    while (p != end) {
+      if (this->has_header && this->pending.empty()) {
+        for (; static_cast<std::size_t>(end - p) >= this->record_size; p += this->record_size) {
+          read_record(p, on_record);
+        }
+        if (p == end) {
+          break;
+        }
+      }
+      std::size_t need = this->has_header ? this->record_size : sizeof(CountFileHeader);
+      std::size_t take = std::min(need - this->pending.size(), static_cast<std::size_t>(end - p));
+      this->pending.insert(this->pending.end(), p, p + take);
+      p += take;
+      if (this->pending.size() == need) {
+        if (this->has_header) {
+          read_record(this->pending.data(), on_record);
+        } else {
+          read_header(this->pending.data());
+        }
+        this->pending.clear();
+      }
+    }
+  }
+};
+
+// Read-only mapping of a regular file. Pipes, devices and empty files are not
+// mapped; mapped() is false and the caller falls back to reading blocks.
+class MappedFile {
+public:
+  MappedFile(const std::string& filename) {
+    this->fd = filename == "-" ? 0 : ::open(filename.c_str(), O_RDONLY);
+    if (this->fd < 0) {
+      throw std::runtime_error("couldn't open " + filename);
+    }
+    map();
+  }
+
+  // maps an open file, such as an unlinked run, through a duplicate of fd
+  explicit MappedFile(int fd) {
+    this->fd = ::dup(fd);
+    if (this->fd < 0) {
+      throw std::runtime_error("couldn't duplicate a file descriptor");
+    }
+    map();
+  }
+
+  ~MappedFile() {
+    if (this->data != nullptr) {
+      ::munmap(const_cast<char*>(this->data), this->size);
+    }
+    if (this->fd > 0) {
+      ::close(this->fd);
+    }
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool mapped() const {
+    return this->data != nullptr;
+  }
+
+  const char* begin() const {
+    return this->data;
+  }
+
+  const char* end() const {
+    return this->data + this->size;
+  }
+
+  // drops the pages wholly before up_to from memory; they are read again if touched
+  void release(const char* up_to) const {
+    static const std::size_t page_size = ::sysconf(_SC_PAGESIZE);
+    std::size_t size = (up_to - this->data) / page_size * page_size;
+    if (this->data != nullptr && size > 0) {
+      ::madvise(const_cast<char*>(this->data), size, MADV_DONTNEED);
+    }
+  }
+
+  int descriptor() const {
+    return this->fd;
+  }
+
+  // asks the kernel to start reading the whole mapping ahead of use
+  void will_need() const {
+    if (this->data != nullptr) {
+      ::madvise(const_cast<char*>(this->data), this->size, MADV_WILLNEED);
+    }
+  }
+
+private:
+  int fd = -1;
+  const char* data = nullptr;
+  std::size_t size = 0;
+
+  void map() {
+    struct stat st;
+    if (::fstat(this->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+      if (data != MAP_FAILED) {
+        ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+        this->data = static_cast<const char*>(data);
+        this->size = st.st_size;
+      }
+    }
+  }
+};
+
+// Count files named by input, in the order their records are taken: the regular
+// files of a directory sorted by path, like DirReader on the Rust side, the
+// regular files matching a glob pattern in glob order, or else input itself.
+inline std::vector<std::string> list_count_files(const std::string& input) {
+  auto is_regular = [](const std::string& path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+  };
+  std::vector<std::string> ret;
+  struct stat st;
+  if (input != "-" && ::stat(input.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+    DIR* dir = ::opendir(input.c_str());
+    if (dir == nullptr) {
+      throw std::runtime_error("couldn't open " + input);
+    }
+    while (struct dirent* entry = ::readdir(dir)) {
+      std::string path = input + "/" + entry->d_name;
+      if (is_regular(path)) {
+        ret.push_back(path);
+      }
+    }
+    ::closedir(dir);
+    std::sort(ret.begin(), ret.end());
+  } else if (input.find_first_of("*?[") != std::string::npos && ::stat(input.c_str(), &st) != 0) {
+    glob_t matches;
+    if (::glob(input.c_str(), 0, nullptr, &matches) == 0) {
+      for (std::size_t i = 0; i < matches.gl_pathc; i++) {
+        if (is_regular(matches.gl_pathv[i])) {
+          ret.push_back(matches.gl_pathv[i]);
+        }
+      }
+    }
+    ::globfree(&matches);
+  } else {
+    return {input};
+  }
+  if (ret.empty()) {
+    throw std::runtime_error("no count files in " + input);
+  }
+  return ret;
+}
+
+// Passes the count data read from fd to on_block(begin, end) in large blocks,
+// decompressed if it is compressed, see decompress.hpp
+template <typename F>
+void read_count_descriptor(int fd, const std::string& filename, F&& on_block) {
+  std::vector<char> block(1 << 20);
+  auto read_block = [&](std::size_t offset) {
+    ssize_t n;
+    while ((n = ::read(fd, block.data() + offset, block.size() - offset)) < 0 && errno == EINTR) {
+    }
+    if (n < 0) {
+      throw std::runtime_error("couldn't read " + filename);
+    }
+    return static_cast<std::size_t>(n);
+  };
+  // enough of the start to tell compressed data apart, even from a pipe
+  std::size_t size = 0, n;
+  while (size < 4 && (n = read_block(size)) > 0) {
+    size += n;
+  }
+  Compression compression = compression_of(block.data(), block.data() + size);
+  if (compression == Compression::none) {
+    while (size > 0) {
+      on_block(block.data(), block.data() + size);
+      size = read_block(0);
+    }
+    return;
+  }
+  // zlib and zstd take in all of a block before asking for the next one
+  bool first = true;
+  read_compressed(compression, [&](const char*& begin, const char*& end) {
+    if (!first) {
+      size = read_block(0);
+    }
+    first = false;
+    begin = block.data();
+    end = begin + size;
+    return size > 0;
+  }, on_block);
+}
+
+// Feeds a whole count file to the parser: regular files are memory-mapped,
+// anything else is read in large blocks. Compressed files are decompressed on
+// the way.
+template <typename F>
+void read_count_file(const std::string& filename, CountRecordParser& parser, F&& on_record) {
+  MappedFile file(filename);
+  auto feed = [&](const char* begin, const char* end) {
+    parser.feed(begin, end, on_record);
+  };
+  if (!file.mapped()) {
+    read_count_descriptor(file.descriptor(), filename, feed);
+  } else {
+    Compression compression = compression_of(file.begin(), file.end());
+    if (compression == Compression::none) {
+      feed(file.begin(), file.end());
+    } else {
+      read_mapped_compressed(compression, file.begin(), file.end(), feed);
+    }
+  }
+  parser.finish(on_record);
+}
+
+// Splits mapped count data into at most num_chunks ranges that each start at a
+// record boundary: after a newline for text records, on the record grid for
+// binary ones. A binary header stays in front of the first range; parsers of
+// the other ranges are given it with CountRecordParser::expect_binary.
+inline std::vector<std::pair<const char*, const char*>> split_count_data(const char* begin, const char* end, unsigned num_chunks) {
+  std::vector<std::pair<const char*, const char*>> ret;
+  std::size_t size = end - begin;
+  bool binary = size >= sizeof(CountFileHeader) && std::memcmp(begin, count_file_magic, sizeof(count_file_magic)) == 0;
+  std::size_t record_size = 1;
+  const char* body = begin;
+  if (binary) {
+    CountFileHeader header;
+    std::memcpy(&header, begin, sizeof(header));
+    record_size = count_record_size(header.max_width);
+    body = begin + sizeof(header);
+  }
+  std::size_t num_records = (end - body) / record_size;
+  const char* chunk_begin = begin;
+  for (unsigned i = 1; i <= num_chunks && chunk_begin != end; i++) {
+    const char* chunk_end = i == num_chunks ? end : body + (num_records * i / num_chunks) * record_size;
+    if (!binary) {
+      chunk_end = std::max(chunk_end, chunk_begin);
+      while (chunk_end != end && *chunk_end != '\n') {
+        chunk_end++;
+      }
+      if (chunk_end != end) {
+        chunk_end++;
+      }
+    }
+    if (chunk_end > chunk_begin) {
+      ret.emplace_back(chunk_begin, chunk_end);
+      chunk_begin = chunk_end;
+    }
+  }
+  if (ret.empty()) {
+    ret.emplace_back(begin, end);
+  }
+  return ret;
+}
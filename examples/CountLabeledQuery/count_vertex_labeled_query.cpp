@@ -1,8 +1,29 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
 #include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <queue>
 
 #include "plan.hpp"
+#include "plan_graph.hpp"
+#include "labeled_graph.hpp"
+#include "consolidate.hpp"
+#include "parallel_count.hpp"
+#include "streaming.hpp"
+#include "metrics.hpp"
+#include "output.hpp"
+#include "partial.hpp"
+#include "spill.hpp"
+#include "sort_engine.hpp"
+#include "delta.hpp"
+#include "heavy_hitters.hpp"
+#include "results_index.hpp"
 
 #include "boost/algorithm/string.hpp"
 #include "boost/functional/hash.hpp"
@@ -10,171 +31,664 @@
 #include "boost/graph/connected_components.hpp"
 #include "boost/graph/copy.hpp"
 #include <boost/graph/mcgregor_common_subgraphs.hpp>
-#include "boost/graph/vf2_sub_graph_iso.hpp"
-#include "boost/property_map/property_map.hpp"
-
-using EdgeProperty = boost::property<boost::edge_name_t, unsigned int>;
-using VertexProperty = boost::property<boost::vertex_name_t, unsigned int, boost::property<boost::vertex_index_t, int> >;
-using Graph = boost::adjacency_list<boost::vecS, boost::vecS, boost::bidirectionalS, VertexProperty, EdgeProperty>;
-
-std::ostream& operator<<(std::ostream& out, const Graph& g) {
-    //out<<"---Print Graph Start ----"<< std::endl;
-    auto labelling_vertex = boost::get(boost::vertex_name, g);
-    out << boost::num_vertices(g)<< " " << boost::num_edges(g) << std::endl;
-    for (unsigned i = 0; i < boost::num_vertices(g); i++) {
-      out << labelling_vertex[i] << " ";
-    }
-    out << std::endl;
-    for (auto ep = boost::edges(g); ep.first != ep.second; ++ep.first) {
-      unsigned int source_ = boost::source(*ep.first, g);
-      unsigned int target_ = boost::target(*ep.first, g);
-      out << source_ << " " << target_ << std::endl;
-    }
-    //out<<"---Print Graph End----"<< std::endl;
-    return out;
-}
 
-struct GraphHash {
-  std::size_t operator()(Graph const &Graph) const;
-};
+// VF2 fallback path: isomorphism as hash map equality
+template <typename Hash>
+void consolidate_vf2(const std::vector<RawCountMap>& shards, const std::vector<Graph>& id_graph_map,
+                     const ClassFilter& filter, ClassWriter& writer, RunMetrics& metrics) {
+  auto start = RunMetrics::Clock::now();
+  // views point at the labels stored in the raw tables, which outlive the map
+  const PatternMatchOrders orders(id_graph_map);
+  std::unordered_map<LabeledPatternView, std::uint64_t, Hash, CmpPatternView> labeled_query_count(
+      0, Hash(), CmpPatternView{&orders});
+  for (auto& raw_count: shards) {
+    raw_count.for_each([&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+      labeled_query_count[LabeledPatternView{&id_graph_map[node_id], labels}] += count;
+    });
+  }
+  metrics.add_phase("combine", start);
+  start = RunMetrics::Clock::now();
+  std::vector<CanonicalClass> classes;
+  std::vector<const CanonicalClass*> selected;
+  for (auto iter = labeled_query_count.begin(); iter != labeled_query_count.end(); iter++) {
+    auto& pattern = *iter->first.pattern;
+    std::vector<unsigned> labels(iter->first.labels, iter->first.labels + boost::num_vertices(pattern));
+    classes.push_back(CanonicalClass{static_cast<unsigned>(&pattern - id_graph_map.data()), std::move(labels), iter->second});
+  }
+  for (auto& cls: classes) {
+    selected.push_back(&cls);
+  }
+  for (auto cls: filter.select(std::move(selected))) {
+    writer.write(*cls);
+  }
+  metrics.add_phase("output", start);
+  metrics.add("classes", static_cast<std::uint64_t>(labeled_query_count.size()));
+  metrics.add("class_map_load_factor", static_cast<double>(labeled_query_count.load_factor()));
+}
 
-std::size_t GraphHash::operator()(Graph const &Graph) const {
-  std::size_t res = 0;
-  auto labelling_vertex = boost::get(boost::vertex_name, Graph);
-  auto labelling_edge = boost::get(boost::edge_name, Graph);
-  unsigned int edge_xor = 1;
-  unsigned int vertex_xor = 1;
-  for (auto ep = boost::edges(Graph); ep.first != ep.second; ++ep.first) {
-    unsigned int source = boost::source(*ep.first, Graph);
-    unsigned int target = boost::target(*ep.first, Graph);
-    edge_xor = edge_xor ^ labelling_edge[*ep.first];
-    vertex_xor = vertex_xor ^ labelling_vertex[source] ^ labelling_vertex[target];
-  }
-  unsigned int multi = edge_xor + vertex_xor;
-  boost::hash_combine(res, multi);
-  boost::hash_combine(res, boost::num_vertices(Graph));
-  boost::hash_combine(res, boost::num_edges(Graph));
-  return res;
+// Prints that option can't be used with the first of others that is set,
+// returning whether there is one.
+bool conflicts(const char* option, std::initializer_list<std::pair<bool, const char*>> others) {
+  for (auto& other: others) {
+    if (other.first) {
+      std::cerr << option << " can't be used with " << other.second << std::endl;
+      return true;
+    }
+  }
+  return false;
 }
 
-bool check_iso(const Graph& small_graph, const Graph& large_graph) {
-  // fast check at beginning
-  if (boost::num_vertices(small_graph) != boost::num_vertices(large_graph) || boost::num_edges(small_graph) != boost::num_edges(large_graph)) {
-    return false;
-  }
-
-  auto vertex_name_map1 = boost::get(boost::vertex_name, small_graph);
-  auto vertex_name_map2 = boost::get(boost::vertex_name, large_graph);
-  auto edge_name_map1 = boost::get(boost::edge_name, small_graph);
-  auto edge_name_map2 = boost::get(boost::edge_name, large_graph);
-
-  auto vertex_comp = boost::make_property_map_equivalent(vertex_name_map1, vertex_name_map2);
-  auto edge_comp = boost::make_property_map_equivalent(edge_name_map1, edge_name_map2);
-  // callback that do nothing
-  auto cb = [&](auto &&f, auto &&) {
-    // do nothing
-    return true;
-  };
-  // boost::vf2_print_callback <Graph, Graph> callback(small_graph, large_graph);
-  return boost::vf2_subgraph_iso(small_graph, large_graph, cb, boost::vertex_order_by_mult(small_graph),
-                                 boost::edges_equivalent(edge_comp).vertices_equivalent(vertex_comp));
+void usage(const char* program) {
+  std::cerr << "usage: " << program << " [--iso automorphism|canonical|vf2] [--graph-hash wl|xor] [--threads N]"
+            << " [--follow] [--edge-labels] [--metrics out.json] [--output-format text|csv|binary|index] [--output path]"
+            << " [--min-count C] [--top-k K] [--emit-partial] [--labels vertex_label_file|scan]"
+            << " [--mem-limit BYTES[K|M|G]] [--spill-dir DIR] [--engine hash|sort] [--class-cache DIR]"
+            << " plan_file count_file" << std::endl;
+  std::cerr << "       " << program << " --delta snapshot [--iso automorphism|canonical] [--edge-labels]"
+            << " [--output-format text|csv|binary|index] [--output path] [--min-count C] [--top-k K] [--emit-partial]"
+            << " [--class-cache DIR] plan_file delta_file" << std::endl;
+  std::cerr << "       " << program << " --approx K [--approx-counters M] [--sketch-width W] [--sketch-depth D] [--approx-dedup]"
+            << " [--iso automorphism|canonical] [--threads N] [--edge-labels] [--output-format text|csv]"
+            << " [--output path] plan_file count_file" << std::endl;
+  std::cerr << "       " << program << " --merge [--edge-labels] [--output-format text|csv|binary|index] [--output path]"
+            << " [--min-count C] [--top-k K] [--emit-partial] plan_file partial..." << std::endl;
 }
 
-struct CmpGraph {
-  inline bool operator()(const Graph &a, const Graph &b) const {
-    return check_iso(a, b);
+// Output of classes that arrive one at a time in form order, as from
+// merge_partials: written to a partial, or filtered and written; with --top-k
+// the classes passing min_count are held until finish()
+class MergedClassOutput {
+public:
+  MergedClassOutput(PartialWriter* partial_writer, ClassWriter* writer, const ClassFilter& filter)
+      : partial_writer(partial_writer), writer(writer), filter(filter) {}
+
+  void add(const std::string& form, const CanonicalClass& cls) {
+    this->num_classes++;
+    if (this->partial_writer != nullptr) {
+      this->partial_writer->write(form, cls);
+    } else if (this->filter.keeps(cls)) {
+      if (this->filter.top_k != 0) {
+        this->kept.push_back(cls);
+      } else {
+        this->writer->write(cls);
+      }
+    }
   }
-};
 
-struct CountKeyHash{
-  std::size_t operator()(std::pair<unsigned, std::vector<unsigned>> const &pair) const {
-      auto node_id = pair.first;
-      auto& labels = pair.second;
-      std::size_t res = 0;
-      boost::hash_combine(res, boost::hash_range(labels.begin(), labels.end()));
-      boost::hash_combine(res, node_id);
-      return res;
+  void finish() {
+    std::vector<const CanonicalClass*> selected;
+    for (auto& cls: this->kept) {
+      selected.push_back(&cls);
+    }
+    for (auto cls: this->filter.select(std::move(selected))) {
+      this->writer->write(*cls);
+    }
   }
+
+  std::uint64_t num_classes = 0;
+
+private:
+  PartialWriter* partial_writer;
+  ClassWriter* writer;
+  const ClassFilter& filter;
+  std::vector<CanonicalClass> kept;
 };
 
-std::vector<Graph> get_id_graph_map_from_plan(Plan plan);
+// --delta: applies the signed delta input to the snapshot's class totals and
+// writes the classes left in form order
+int apply_delta(const std::string& snapshot, const std::string& input, const Plan& plan,
+                const std::vector<unsigned>& widths, std::uint64_t plan_hash, const std::vector<bool>& query_nodes,
+                bool use_automorphisms, bool edge_labels, ClassCache* cache, MergedClassOutput& merged,
+                RunMetrics& metrics) {
+  auto start = RunMetrics::Clock::now();
+  Canonicalizer canonicalizer(get_pattern_shapes(plan), use_automorphisms, edge_labels);
+  canonicalizer.cache = cache;
+  ClassMap deltas;
+  std::uint64_t num_records = 0;
+  try {
+    deltas = read_class_deltas(input, widths, plan_hash, query_nodes, canonicalizer, &num_records);
+  } catch (const std::exception& e) {
+    std::cerr << input << ": " << e.what() << std::endl;
+    return 1;
+  }
+  metrics.add_phase("combine", start);
+  start = RunMetrics::Clock::now();
+  DeltaStats stats;
+  try {
+    stats = apply_class_deltas(snapshot, deltas, input, plan_hash, edge_labels,
+                               [&](const std::string& form, const CanonicalClass& cls) {
+      merged.add(form, cls);
+    });
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  merged.finish();
+  metrics.add_phase("apply", start);
+  metrics.add("records_read", num_records);
+  metrics.add("delta_classes", static_cast<std::uint64_t>(deltas.size()));
+  metrics.add("classes_added", stats.added);
+  metrics.add("classes_changed", stats.changed);
+  metrics.add("classes_removed", stats.removed);
+  metrics.add("classes", merged.num_classes);
+  return 0;
+}
+
+// --approx: the top classes by sketch estimate, with their bounds
+int approximate(const std::string& input, const Plan& plan, const std::vector<Graph>& id_graph_map,
+                const std::vector<unsigned>& widths, std::uint64_t plan_hash, const std::vector<bool>& query_nodes,
+                unsigned num_threads, bool use_automorphisms, bool edge_labels, const HeavyHitterOptions& options,
+                const std::string& output_format, OutputFile& output, RunMetrics& metrics) {
+  auto start = RunMetrics::Clock::now();
+  Canonicalizer canonicalizer(get_pattern_shapes(plan), use_automorphisms, edge_labels);
+  HeavyHitterResult result;
+  std::uint64_t num_records = 0;
+  try {
+    result = approximate_heavy_hitters(input, widths, plan_hash, query_nodes, num_threads, canonicalizer, options,
+                                       &num_records);
+  } catch (const std::exception& e) {
+    std::cerr << input << ": " << e.what() << std::endl;
+    return 1;
+  }
+  metrics.add_phase("sketch", start);
+  start = RunMetrics::Clock::now();
+  write_heavy_hitters(output.stream(), output_format, result, id_graph_map, canonicalizer.shapes, edge_labels);
+  metrics.add_phase("output", start);
+  metrics.add("records_read", num_records);
+  metrics.add("classes", static_cast<std::uint64_t>(result.classes.size()));
+  metrics.add("approx_total", result.total);
+  metrics.add("approx_sketch_error", result.sketch_error);
+  metrics.add("approx_sketch_confidence", result.confidence);
+  metrics.add("approx_sketch_bytes", static_cast<std::uint64_t>(result.sketch_bytes));
+  metrics.add("approx_summary_bytes", static_cast<std::uint64_t>(result.summary_bytes));
+  metrics.add("approx_raw_bytes", static_cast<std::uint64_t>(result.raw_bytes));
+  metrics.add("approx_memory_bytes",
+              static_cast<std::uint64_t>(result.sketch_bytes + result.summary_bytes + result.raw_bytes));
+  return 0;
+}
+
+// "512M" and the like, 0 if malformed
+std::uint64_t parse_bytes(const char* text) {
+  char* end;
+  std::uint64_t value = std::strtoull(text, &end, 10);
+  switch (*end) {
+    case 'G': value <<= 10; // fall through
+    case 'M': value <<= 10; // fall through
+    case 'K': value <<= 10; end++; break;
+    default: break;
+  }
+  return *end == 0 ? value : 0;
+}
+
+// --follow: count_file is a live stream ("-", a FIFO or tcp:HOST:PORT); at every
+// "#..." marker line the marker is echoed followed by the classes that changed
+// and pass filter
+int follow(const std::string& stream, const Plan& plan, const std::vector<unsigned>& widths, std::uint64_t plan_hash,
+           bool use_automorphisms, bool edge_labels,
+           const std::vector<bool>& query_nodes,
+           const LabelDictionary* dictionary, const ClassFilter& filter, ClassWriter& writer, OutputFile& output,
+           RunMetrics& metrics) {
+  auto start = RunMetrics::Clock::now();
+  Canonicalizer canonicalizer(get_pattern_shapes(plan), use_automorphisms, edge_labels);
+  IncrementalClassCounts classes(canonicalizer, widths, dictionary);
+  CountRecordParser parser(widths, plan_hash, query_nodes);
+  try {
+    follow_count_stream(stream, parser, classes, [&](const std::string& marker) {
+      if (!marker.empty()) {
+        writer.marker(marker);
+      }
+      classes.for_each_changed([&](const CanonicalClass& cls, std::uint64_t class_id) {
+        if (filter.keeps(cls)) {
+          writer.write_numbered(cls, class_id);
+        }
+      });
+      output.flush();
+    });
+  } catch (const std::exception& e) {
+    output.stream().flush();
+    std::cerr << stream << ": " << e.what() << std::endl;
+    return 1;
+  }
+  metrics.add_phase("stream", start);
+  metrics.add("records_read", parser.records());
+  metrics.add("raw_keys", static_cast<std::uint64_t>(classes.num_raw_keys()));
+  metrics.add("classes", static_cast<std::uint64_t>(classes.num_classes()));
+  return 0;
+}
 
 int main(int argc, char* argv[]) {
-  Plan plan(argv[1]);
-  std::ifstream count_file(argv[2]);
+  std::string iso_mode = "automorphism";
+  std::string graph_hash = "wl";
+  unsigned num_threads = 1;
+  bool follow_stream = false;
+  bool edge_labels = false;
+  std::string metrics_file;
+  std::string output_format = "text";
+  std::string output_file = "-";
+  ClassFilter filter;
+  bool emit_partial = false;
+  bool merge = false;
+  std::string label_source;
+  std::string engine = "hash";
+  std::uint64_t mem_limit = 0;
+  const char* tmpdir = std::getenv("TMPDIR");
+  std::string spill_dir = tmpdir != nullptr && *tmpdir != 0 ? tmpdir : "/tmp";
+  std::string class_cache_dir;
+  std::string delta_snapshot;
+  HeavyHitterOptions approx;
+  int arg = 1;
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (std::strcmp(argv[arg], "--iso") == 0 && arg + 1 < argc) {
+      iso_mode = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--graph-hash") == 0 && arg + 1 < argc) {
+      graph_hash = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+      num_threads = std::strtoul(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--follow") == 0) {
+      follow_stream = true;
+    } else if (std::strcmp(argv[arg], "--edge-labels") == 0) {
+      edge_labels = true;
+    } else if (std::strcmp(argv[arg], "--metrics") == 0 && arg + 1 < argc) {
+      metrics_file = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--output-format") == 0 && arg + 1 < argc) {
+      output_format = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--output") == 0 && arg + 1 < argc) {
+      output_file = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--min-count") == 0 && arg + 1 < argc) {
+      filter.min_count = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--top-k") == 0 && arg + 1 < argc) {
+      filter.top_k = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--emit-partial") == 0) {
+      emit_partial = true;
+    } else if (std::strcmp(argv[arg], "--merge") == 0) {
+      merge = true;
+    } else if (std::strcmp(argv[arg], "--labels") == 0 && arg + 1 < argc) {
+      label_source = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--mem-limit") == 0 && arg + 1 < argc) {
+      mem_limit = parse_bytes(argv[++arg]);
+      if (mem_limit == 0) {
+        std::cerr << "--mem-limit expects a positive size such as 512M, got " << argv[arg] << std::endl;
+        return 1;
+      }
+    } else if (std::strcmp(argv[arg], "--engine") == 0 && arg + 1 < argc) {
+      engine = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--spill-dir") == 0 && arg + 1 < argc) {
+      spill_dir = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--class-cache") == 0 && arg + 1 < argc) {
+      class_cache_dir = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--delta") == 0 && arg + 1 < argc) {
+      delta_snapshot = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--approx") == 0 && arg + 1 < argc) {
+      approx.top_k = std::strtoull(argv[++arg], nullptr, 10);
+      if (approx.top_k == 0) {
+        std::cerr << "--approx expects a positive number of classes, got " << argv[arg] << std::endl;
+        return 1;
+      }
+    } else if (std::strcmp(argv[arg], "--approx-counters") == 0 && arg + 1 < argc) {
+      approx.counters = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--sketch-width") == 0 && arg + 1 < argc) {
+      approx.sketch_width = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--sketch-depth") == 0 && arg + 1 < argc) {
+      approx.sketch_depth = std::strtoul(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--approx-dedup") == 0) {
+      approx.dedup = true;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (merge ? argc - arg < 2 : argc - arg != 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (iso_mode != "automorphism" && iso_mode != "canonical" && iso_mode != "vf2") {
+    std::cerr << "unknown --iso " << iso_mode << ", expected automorphism, canonical or vf2" << std::endl;
+    return 1;
+  }
+  if (graph_hash != "wl" && graph_hash != "xor") {
+    std::cerr << "unknown --graph-hash " << graph_hash << ", expected wl or xor" << std::endl;
+    return 1;
+  }
+  if (!is_output_format(output_format) && output_format != "index") {
+    std::cerr << "unknown --output-format " << output_format << ", expected text, csv, binary or index" << std::endl;
+    return 1;
+  }
+  if (engine != "hash" && engine != "sort") {
+    std::cerr << "unknown --engine " << engine << ", expected hash or sort" << std::endl;
+    return 1;
+  }
+  if (num_threads == 0) {
+    std::cerr << "--threads must be at least 1" << std::endl;
+    return 1;
+  }
+  if (approx.sketch_width == 0 || approx.sketch_depth == 0) {
+    std::cerr << "--sketch-width and --sketch-depth must be at least 1" << std::endl;
+    return 1;
+  }
+  const bool vf2 = iso_mode == "vf2";
+  const bool sort_engine = engine == "sort";
+  const bool has_labels = !label_source.empty();
+  const bool exact_output = output_format == "binary" || output_format == "index";
+  // vf2 compares raw keys of one batch without edge labels
+  if (vf2 && conflicts("--iso vf2", {{follow_stream, "--follow"}, {edge_labels, "--edge-labels"}})) {
+    return 1;
+  }
+  // the classes of a stream change at every marker, so its output is text
+  // written as it goes
+  if (follow_stream && conflicts("--follow", {{merge, "--merge"}, {exact_output, "--output-format binary|index"},
+                                              {filter.top_k != 0, "--top-k"}})) {
+    return 1;
+  }
+  // partials are exact, unfiltered canonical-form tables
+  if (emit_partial && conflicts("--emit-partial", {{vf2, "--iso vf2"}, {follow_stream, "--follow"},
+                                                   {output_format != "text", "--output-format other than text"},
+                                                   {filter.min_count != 0, "--min-count"},
+                                                   {filter.top_k != 0, "--top-k"}})) {
+    return 1;
+  }
+  // vf2 views point at labels inside the raw tables, --follow can't scan its
+  // stream ahead and a vertex-label file has no edge labels
+  if (has_labels && conflicts("--labels", {{vf2, "--iso vf2"}, {merge, "--merge"},
+                                       {label_source == "scan" && follow_stream, "--follow"},
+                                       {label_source != "scan" && edge_labels, "--edge-labels"}})) {
+    return 1;
+  }
+  // spilled runs are merged into classes, never held as raw tables, and the
+  // spilling raw table is filled on one thread
+  if (mem_limit != 0 && conflicts("--mem-limit", {{vf2, "--iso vf2"}, {merge, "--merge"}, {follow_stream, "--follow"},
+                                                  {num_threads > 1, "--threads above 1"}})) {
+    return 1;
+  }
+  // the sort engine reads mapped count files in one batch
+  if (sort_engine && conflicts("--engine sort", {{vf2, "--iso vf2"}, {merge, "--merge"}, {follow_stream, "--follow"},
+                                                 {mem_limit != 0, "--mem-limit"}})) {
+    return 1;
+  }
+  // forms are cached for the canonical-form classes of a batch run
+  if (!class_cache_dir.empty() &&
+      conflicts("--class-cache", {{vf2, "--iso vf2"}, {merge, "--merge"}, {follow_stream, "--follow"}})) {
+    return 1;
+  }
+  // a delta is small and folded on one thread, straight into signed class deltas
+  if (!delta_snapshot.empty() &&
+      conflicts("--delta", {{vf2, "--iso vf2"}, {merge, "--merge"}, {follow_stream, "--follow"},
+                            {mem_limit != 0, "--mem-limit"}, {sort_engine, "--engine sort"}, {has_labels, "--labels"},
+                            {num_threads > 1, "--threads above 1"}})) {
+    return 1;
+  }
+  // sketches hold no exact class table to filter, spill, cache or emit
+  if (approx.top_k != 0 &&
+      conflicts("--approx", {{vf2, "--iso vf2"}, {merge, "--merge"}, {follow_stream, "--follow"},
+                             {mem_limit != 0, "--mem-limit"}, {sort_engine, "--engine sort"}, {has_labels, "--labels"},
+                             {!class_cache_dir.empty(), "--class-cache"}, {!delta_snapshot.empty(), "--delta"},
+                             {emit_partial, "--emit-partial"}, {exact_output, "--output-format binary|index"},
+                             {filter.min_count != 0, "--min-count"}, {filter.top_k != 0, "--top-k"}})) {
+    return 1;
+  }
+  if (approx.counters == 0) {
+    approx.counters = std::max<std::size_t>(8 * approx.top_k, 1024);
+  }
+  if (sort_engine && !has_labels) {
+    label_source = "scan";
+  }
+
+  RunMetrics metrics;
+  auto start = RunMetrics::Clock::now();
+  Plan plan(argv[arg]);
+  metrics.add_phase("plan_load", start);
+  start = RunMetrics::Clock::now();
   std::vector<Graph> id_graph_map = get_id_graph_map_from_plan(plan);
+  metrics.add_phase("id_graph_map", start);
 
   std::vector<unsigned> id_vertex_num_map = plan.get_id_vertex_num();
-  std::unordered_map<Graph, unsigned, GraphHash, CmpGraph> labeled_query_count;
-  std::unordered_map<std::pair<unsigned, std::vector<unsigned>>, unsigned, CountKeyHash> raw_count;
+  if (edge_labels) {
+    // records of count_edge_labeled_query_plan.rs: vertex labels, then edge labels by (source, target)
+    id_vertex_num_map = get_key_widths(get_pattern_shapes(plan), true);
+  }
 
-//deduplicate count record
-  unsigned node_id;
-  while (count_file >> node_id) {
-    unsigned node_num = id_vertex_num_map[node_id]; 
-    std::vector<unsigned> labels;
-    labels.resize(node_num);
-    for (unsigned i = 0; i < node_num; i++){
-      unsigned label;
-      count_file >> labels[i];
-    }
-    unsigned count;
-    count_file >> count; 
-    raw_count[std::make_pair(node_id,labels)] = count;
-  }
-  count_file.close();
-  //combine isomorphic labeled queries
-  
-  for (auto iter = raw_count.begin(); iter != raw_count.end(); iter++) {
-    auto& key = iter->first;
-    auto node_id = key.first;
-    auto& labels = key.second;
-    auto count = iter->second;
-    Graph g =  id_graph_map[node_id];
-    auto labelling_vertex = boost::get(boost::vertex_name, g);
-    for (unsigned i = 0; i < labels.size(); i++){
-      labelling_vertex[i] = labels[i];
-    }
-    labeled_query_count[g] = labeled_query_count[g] + count;
+  std::uint64_t plan_hash = plan_file_hash(argv[arg]);
+  // only query nodes are counted, records of intermediate nodes are dropped as they are read
+  std::vector<bool> query_nodes = plan.get_query_nodes();
+  if (!delta_snapshot.empty() && same_file(delta_snapshot, output_file)) {
+    std::cerr << "--delta " << delta_snapshot << ": write the new snapshot to another file" << std::endl;
+    return 1;
   }
-  for (auto iter = labeled_query_count.begin(); iter != labeled_query_count.end(); iter++) {
-    std::cout << "Count:" << iter->second << std::endl;
-    std::cout << iter->first << std::endl;
+  std::unique_ptr<OutputFile> output;
+  try {
+    output.reset(new OutputFile(output_file));
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  std::unique_ptr<ClassWriter> writer;
+  std::unique_ptr<PartialWriter> partial_writer;
+  if (emit_partial) {
+    unsigned max_width = *std::max_element(id_vertex_num_map.begin(), id_vertex_num_map.end());
+    partial_writer.reset(new PartialWriter(output->stream(), plan_hash, max_width, edge_labels));
+  } else if (output_format == "index") {
+    writer.reset(new IndexClassWriter(output->stream(), get_pattern_shapes(plan), edge_labels, plan_hash));
+  } else if (approx.top_k == 0) {
+    writer = make_class_writer(output_format, output->stream(), id_graph_map, get_pattern_shapes(plan), edge_labels,
+                               plan_hash, id_vertex_num_map);
   }
 
-  return 0;
-}
+  // dense label ids, for keys packed into one word
+  std::unique_ptr<LabelDictionary> dictionary;
+  if (!label_source.empty()) {
+    start = RunMetrics::Clock::now();
+    try {
+      if (label_source == "scan") {
+        dictionary.reset(new LabelDictionary(scan_label_dictionary(argv[arg + 1], id_vertex_num_map, plan_hash,
+                                                                   query_nodes, num_threads)));
+      } else {
+        dictionary.reset(new LabelDictionary(read_label_file(label_source)));
+      }
+    } catch (const std::exception& e) {
+      std::cerr << (label_source == "scan" ? argv[arg + 1] : label_source) << ": " << e.what() << std::endl;
+      return 1;
+    }
+    metrics.add_phase("label_dictionary", start);
+    metrics.add("label_dictionary_size", static_cast<std::uint64_t>(dictionary->size()));
+    metrics.add("label_bits", static_cast<std::uint64_t>(dictionary->bits()));
+    if (engine == "sort" && !sort_engine_packs(id_vertex_num_map, *dictionary)) {
+      std::cerr << "keys don't fit 64 bits with " << dictionary->size() << " labels, use --engine hash" << std::endl;
+      return 1;
+    }
+  }
+
+  std::unique_ptr<ClassCache> cache;
+  if (!class_cache_dir.empty()) {
+    start = RunMetrics::Clock::now();
+    try {
+      cache.reset(new ClassCache(class_cache_path(class_cache_dir, plan_hash, edge_labels), id_vertex_num_map,
+                                 plan_hash, edge_labels));
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    metrics.add_phase("class_cache_load", start);
+    metrics.add("class_cache_keys", static_cast<std::uint64_t>(cache->num_loaded()));
+    metrics.add("class_cache_log_keys", static_cast<std::uint64_t>(cache->num_logged()));
+  }
 
-std::vector<Graph> get_id_graph_map_from_plan(Plan plan){
-  std::vector<Graph> ret;
-  ret.resize(plan.nodes.size());
-  unsigned root_node_id = plan.root_node_id;
-  std::queue<unsigned> q; //proccessed node_id
-  q.push(root_node_id);
-  boost::add_vertex(ret[root_node_id]);
-  boost::add_vertex(ret[root_node_id]);
-  boost::add_edge(0, 1, ret[root_node_id]);
-  while (!q.empty()) {
-    auto cur = q.front();
-    auto& cur_node = plan.nodes[cur];
-    q.pop();
-    unsigned start_edge = cur_node.edge_start_idx;
-    unsigned end_edge = cur_node.edge_start_idx + cur_node.num_edges;
-    for (unsigned i = start_edge; i < end_edge; i++) {
-      auto& edge = plan.edges[i];
-      auto child = edge.dst;
-      boost::copy_graph(ret[cur], ret[child->idx]);
-      if (cur_node.subgraph_num_vertices < child->subgraph_num_vertices) {
-        boost::add_vertex(ret[child->idx]);
+  int ret = 0;
+  if (merge) {
+    start = RunMetrics::Clock::now();
+    MergedClassOutput merged(partial_writer.get(), writer.get(), filter);
+    try {
+      std::vector<std::string> partials;
+      for (int i = arg + 1; i < argc; i++) {
+        for (auto& name: list_count_files(argv[i])) {
+          partials.push_back(name);
+        }
+      }
+      merge_partials(partials, plan_hash, edge_labels, [&](const std::string& form, const CanonicalClass& cls) {
+        merged.add(form, cls);
+      });
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    merged.finish();
+    metrics.add_phase("merge", start);
+    metrics.add("classes", merged.num_classes);
+  } else if (!delta_snapshot.empty()) {
+    MergedClassOutput merged(partial_writer.get(), writer.get(), filter);
+    ret = apply_delta(delta_snapshot, argv[arg + 1], plan, id_vertex_num_map, plan_hash, query_nodes,
+                      iso_mode == "automorphism", edge_labels, cache.get(), merged, metrics);
+  } else if (approx.top_k != 0) {
+    ret = approximate(argv[arg + 1], plan, id_graph_map, id_vertex_num_map, plan_hash, query_nodes, num_threads,
+                      iso_mode == "automorphism", edge_labels, approx, output_format, *output, metrics);
+  } else if (follow_stream) {
+    ret = follow(argv[arg + 1], plan, id_vertex_num_map, plan_hash, iso_mode == "automorphism",
+                 edge_labels, query_nodes, dictionary.get(), filter, *writer, *output, metrics);
+  } else {
+//deduplicate count record
+    std::vector<RawCountMap> raw_count;
+    std::uint64_t num_records = 0;
+    // --mem-limit: set while the raw counts are in spilled runs
+    std::unique_ptr<SpillingRawCount> spilled;
+    // --engine sort
+    std::unique_ptr<SortedRawCounts> sorted;
+    start = RunMetrics::Clock::now();
+    try {
+      if (engine == "sort") {
+        sorted.reset(new SortedRawCounts(sort_raw_count(argv[arg + 1], id_vertex_num_map, plan_hash, query_nodes, num_threads,
+                                                        *dictionary, &num_records)));
+      } else if (mem_limit != 0) {
+        spilled.reset(new SpillingRawCount(id_vertex_num_map, mem_limit, spill_dir, dictionary.get()));
+        num_records = read_spilling_raw_count(argv[arg + 1], id_vertex_num_map, plan_hash, query_nodes, *spilled);
+        if (spilled->num_runs() == 0) {
+          raw_count.push_back(std::move(spilled->in_memory()));
+          spilled.reset();
+        }
+      } else {
+        raw_count = parallel_raw_count(argv[arg + 1], id_vertex_num_map, plan_hash, query_nodes, num_threads,
+                                       &num_records, dictionary.get());
       }
-      for (auto& opt: edge.operations) {
-        if (opt.is_forward){
-          boost::add_edge(opt.src_key, opt.dst_key, ret[child->idx]);
-        }else{
-          boost::add_edge(opt.dst_key, opt.src_key, ret[child->idx]);
+    } catch (const std::exception& e) {
+      std::cerr << argv[arg + 1] << ": " << e.what() << std::endl;
+      return 1;
+    }
+    metrics.add_phase("dedup", start);
+    std::size_t num_raw = 0, raw_capacity = 0, raw_bytes = 0;
+    for (auto& shard: raw_count) {
+      num_raw += shard.size();
+      raw_capacity += shard.capacity();
+      raw_bytes += shard.memory_bytes();
+    }
+    if (sorted) {
+      num_raw = raw_capacity = sorted->size();
+      raw_bytes = sorted->memory_bytes();
+    }
+    metrics.add("records_read", num_records);
+    if (spilled) {
+      metrics.add("spill_runs", static_cast<std::uint64_t>(spilled->num_runs()));
+      metrics.add("spill_bytes", spilled->spilled_bytes());
+    } else {
+      metrics.add("raw_keys", static_cast<std::uint64_t>(num_raw));
+    }
+    metrics.add("raw_table_load", raw_capacity == 0 ? 0.0 : static_cast<double>(num_raw) / raw_capacity);
+    metrics.add("raw_table_bytes", static_cast<std::uint64_t>(raw_bytes));
+    //combine isomorphic labeled queries
+
+    if (iso_mode == "automorphism" || iso_mode == "canonical") {
+      start = RunMetrics::Clock::now();
+      Canonicalizer canonicalizer(get_pattern_shapes(plan), iso_mode == "automorphism", edge_labels);
+      canonicalizer.cache = cache.get();
+      ClassMap canonical_count;
+      // set when the classes, too, went through spilled runs and were written as they were merged
+      bool merged_runs = false;
+      if (spilled) {
+        StreamingConsolidation classes(canonicalizer, id_vertex_num_map, mem_limit, spill_dir, plan_hash,
+                                       dictionary.get());
+        num_raw = 0;
+        try {
+          spilled->merge([&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+            classes.add(node_id, labels, count);
+            num_raw++;
+          });
+          spilled.reset();
+          metrics.add("raw_keys", static_cast<std::uint64_t>(num_raw));
+          if (classes.spilled()) {
+            MergedClassOutput merged(partial_writer.get(), writer.get(), filter);
+            classes.merge(edge_labels, [&](const std::string& form, const CanonicalClass& cls) {
+              merged.add(form, cls);
+            });
+            merged.finish();
+            merged_runs = true;
+            metrics.add("class_spill_runs", static_cast<std::uint64_t>(classes.num_runs()));
+            metrics.add("classes", merged.num_classes);
+          } else {
+            canonical_count = classes.take();
+          }
+        } catch (const std::exception& e) {
+          std::cerr << e.what() << std::endl;
+          return 1;
         }
+      } else if (sorted) {
+        canonical_count = consolidate_sorted(*sorted, canonicalizer, num_threads);
+      } else {
+        canonical_count = parallel_consolidate(raw_count, canonicalizer);
       }
-      q.push(child->idx);
+      metrics.add_phase("combine", start);
+      if (!merged_runs) {
+        start = RunMetrics::Clock::now();
+        if (partial_writer) {
+          write_partial(*partial_writer, canonical_count);
+        } else {
+          for (auto cls: filter.select(canonical_count)) {
+            writer->write(*cls);
+          }
+        }
+        metrics.add_phase("output", start);
+        metrics.add("classes", static_cast<std::uint64_t>(canonical_count.size()));
+        metrics.add("class_map_load_factor", static_cast<double>(canonical_count.load_factor()));
+      }
+    } else if (graph_hash == "xor") {
+      consolidate_vf2<XorPatternViewHash>(raw_count, id_graph_map, filter, *writer, metrics);
+    } else {
+      consolidate_vf2<PatternViewHash>(raw_count, id_graph_map, filter, *writer, metrics);
+    }
+  }
+  if (writer && ret == 0) {
+    start = RunMetrics::Clock::now();
+    try {
+      writer->finish();
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    if (output_format == "index") {
+      metrics.add_phase("index", start);
+    }
+  }
+  if (cache && ret == 0) {
+    try {
+      cache->compact();
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    metrics.add("class_cache_added", cache->num_added());
+  }
+  try {
+    output->flush();
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  if (!metrics_file.empty()) {
+    metrics.add("check_iso_calls", static_cast<std::uint64_t>(check_iso_calls()));
+    metrics.add("peak_rss_bytes", peak_rss_bytes());
+    metrics.add("threads", static_cast<std::uint64_t>(num_threads));
+    metrics.add("iso", iso_mode);
+    try {
+      metrics.write_json(metrics_file);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
     }
   }
   return ret;
@@ -0,0 +1,136 @@
+#include "countlabeled.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "plan.hpp"
+#include "canonical_form.hpp"
+#include "consolidate.hpp"
+
+static_assert(sizeof(unsigned) == sizeof(std::uint32_t), "labels are passed as uint32_t");
+
+// one worker's additive raw counts
+struct WorkerSlot {
+  std::mutex lock;
+  RawCountMap raw_count;
+
+  WorkerSlot(const std::vector<unsigned>& widths) : raw_count(widths) {}
+};
+
+struct clq_context {
+  Canonicalizer canonicalizer;
+  std::vector<unsigned> widths;
+  std::vector<bool> query_nodes;
+  unsigned max_width;
+  std::vector<std::unique_ptr<WorkerSlot>> slots;
+
+  clq_context(Plan& plan, unsigned num_workers, unsigned flags)
+      : canonicalizer(get_pattern_shapes(plan), (flags & CLQ_CANONICAL) == 0, (flags & CLQ_EDGE_LABELS) != 0),
+        widths(canonicalizer.key_widths()), query_nodes(plan.get_query_nodes()) {
+    this->max_width = *std::max_element(this->widths.begin(), this->widths.end());
+    for (unsigned w = 0; w < num_workers; w++) {
+      this->slots.emplace_back(new WorkerSlot(this->widths));
+    }
+  }
+};
+
+static thread_local std::string last_error;
+
+// runs f, turning exceptions into -1 and clq_last_error()
+template <typename F>
+static int guarded(F&& f) {
+  try {
+    f();
+    return 0;
+  } catch (const std::exception& e) {
+    last_error = e.what();
+  } catch (...) {
+    last_error = "unknown error";
+  }
+  return -1;
+}
+
+extern "C" {
+
+clq_context* clq_create(const char* plan_file, unsigned num_workers, unsigned flags) {
+  clq_context* ctx = nullptr;
+  guarded([&]() {
+    if (num_workers == 0) {
+      throw std::runtime_error("need at least one worker");
+    }
+    if (!std::ifstream(plan_file)) {
+      throw std::runtime_error(std::string("couldn't open ") + plan_file);
+    }
+    Plan plan(plan_file);
+    if (plan.nodes.empty()) {
+      throw std::runtime_error(std::string(plan_file) + ": empty plan");
+    }
+    ctx = new clq_context(plan, num_workers, flags);
+  });
+  return ctx;
+}
+
+void clq_destroy(clq_context* ctx) {
+  delete ctx;
+}
+
+const char* clq_last_error(void) {
+  return last_error.c_str();
+}
+
+unsigned clq_num_nodes(const clq_context* ctx) {
+  return ctx->widths.size();
+}
+
+unsigned clq_key_width(const clq_context* ctx, unsigned node_id) {
+  return node_id < ctx->widths.size() ? ctx->widths[node_id] : 0;
+}
+
+unsigned clq_max_width(const clq_context* ctx) {
+  return ctx->max_width;
+}
+
+int clq_add_batch(clq_context* ctx, unsigned worker, const uint32_t* node_ids, const uint32_t* labels,
+                  const uint64_t* counts, size_t n) {
+  return guarded([&]() {
+    if (worker >= ctx->slots.size()) {
+      throw std::runtime_error("worker " + std::to_string(worker) + " out of range");
+    }
+    // a rejected batch adds nothing
+    for (std::size_t i = 0; i < n; i++) {
+      if (node_ids[i] >= ctx->widths.size()) {
+        throw std::runtime_error("node " + std::to_string(node_ids[i]) + " not in plan");
+      }
+    }
+    auto& slot = *ctx->slots[worker];
+    std::lock_guard<std::mutex> guard(slot.lock);
+    for (std::size_t i = 0; i < n; i++) {
+      if (ctx->query_nodes[node_ids[i]]) {
+        slot.raw_count(node_ids[i], labels + i * ctx->max_width) += counts[i];
+      }
+    }
+  });
+}
+
+int clq_snapshot(clq_context* ctx, clq_class_callback on_class, void* user_data) {
+  return guarded([&]() {
+    ClassMap canonical_count;
+    for (auto& slot: ctx->slots) {
+      std::lock_guard<std::mutex> guard(slot->lock);
+      ctx->canonicalizer.consolidate(slot->raw_count, canonical_count);
+    }
+    for (auto iter = canonical_count.begin(); iter != canonical_count.end(); iter++) {
+      auto& cls = iter->second;
+      on_class(user_data, cls.node_id, cls.labels.data(), cls.labels.size(), cls.count);
+    }
+  });
+}
+
+}
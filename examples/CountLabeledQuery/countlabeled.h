@@ -0,0 +1,70 @@
+#ifndef COUNTLABELED_H
+#define COUNTLABELED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libcountlabeled: in-process class aggregation for a running dataflow.
+ *
+ * A context loads a plan and keeps one additive raw-count table per worker,
+ * so that workers feeding their own slot never contend with each other. A
+ * snapshot folds all slots into isomorphism classes exactly as
+ * CountLabeledQuery does for a count file.
+ *
+ * Records are (node_id, labels, count) with labels laid out as in a count
+ * file: the vertex labels of the plan node, followed by the edge labels with
+ * CLQ_EDGE_LABELS. Unlike count files, counts passed to clq_add_batch are
+ * increments and are summed.
+ *
+ * Functions that can fail return NULL or -1 and leave a message for
+ * clq_last_error() on the calling thread.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct clq_context clq_context;
+
+/* clq_create flags */
+#define CLQ_EDGE_LABELS 1u   /* keys carry one label per pattern edge */
+#define CLQ_CANONICAL 2u     /* per-key canonical forms instead of automorphism groups */
+
+clq_context* clq_create(const char* plan_file, unsigned num_workers, unsigned flags);
+void clq_destroy(clq_context* ctx);
+
+/* message of the last failed call on this thread, "" if none */
+const char* clq_last_error(void);
+
+unsigned clq_num_nodes(const clq_context* ctx);
+/* number of labels in a key of the plan node, 0 if node_id is out of range */
+unsigned clq_key_width(const clq_context* ctx, unsigned node_id);
+/* widest key of the plan, the label stride of clq_add_batch */
+unsigned clq_max_width(const clq_context* ctx);
+
+/*
+ * Adds n records to the worker's slot. Record i is node_ids[i] with labels
+ * labels[i * clq_max_width(ctx) ...] and increment counts[i]. Records of
+ * plan nodes that are not query nodes are dropped. Only one thread may add to
+ * a given worker slot at a time.
+ */
+int clq_add_batch(clq_context* ctx, unsigned worker, const uint32_t* node_ids, const uint32_t* labels,
+                  const uint64_t* counts, size_t n);
+
+/* called once per class with the labels of the class's representative key */
+typedef void (*clq_class_callback)(void* user_data, uint32_t node_id, const uint32_t* labels, uint32_t width,
+                                   uint64_t count);
+
+/*
+ * Calls on_class for every class of the totals added so far. The snapshot is
+ * consistent per worker slot; batches added concurrently to other slots may or
+ * may not be included.
+ */
+int clq_snapshot(clq_context* ctx, clq_class_callback on_class, void* user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
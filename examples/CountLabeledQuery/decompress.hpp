@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+#ifdef CLQ_ZSTD
+#include <zstd.h>
+#endif
+
+#include "boost/thread/thread.hpp"
+
+// Compressed count inputs, told apart from plain ones by their first bytes:
+// gzip everywhere, zstd in builds with CLQ_ZSTD (set by CMake when libzstd is
+// found). A compressed input is inflated on a thread of its own into two
+// blocks used in turn, so reading and inflating one block overlaps parsing the
+// other and no decompressed copy is ever written to disk.
+
+enum class Compression { none, gzip, zstd };
+
+inline Compression compression_of(const char* begin, const char* end) {
+  static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+  static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+  std::size_t size = end - begin;
+  if (size >= sizeof(gzip_magic) && std::memcmp(begin, gzip_magic, sizeof(gzip_magic)) == 0) {
+    return Compression::gzip;
+  }
+  if (size >= sizeof(zstd_magic) && std::memcmp(begin, zstd_magic, sizeof(zstd_magic)) == 0) {
+    return Compression::zstd;
+  }
+  return Compression::none;
+}
+
+// Two blocks passed between the inflating thread and the parser. The producer
+// fills the block it acquired while the consumer parses the other one.
+class BlockPipeline {
+public:
+  static const std::size_t block_size = 1 << 20;
+
+  BlockPipeline() : blocks(2, std::vector<char>(block_size)) {}
+
+  // a free block to fill, nullptr once the consumer has given up
+  char* acquire() {
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->changed.wait(guard, [&]() {
+      return this->abandoned || this->filled < 2;
+    });
+    return this->abandoned ? nullptr : this->blocks[(this->first + this->filled) % 2].data();
+  }
+
+  // hands the acquired block over with its first size bytes filled
+  void publish(std::size_t size) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->sizes[(this->first + this->filled) % 2] = size;
+    this->filled++;
+    this->changed.notify_all();
+  }
+
+  // no more blocks; error is rethrown to the consumer if set
+  void close(std::exception_ptr error) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->closed = true;
+    this->error = error;
+    this->changed.notify_all();
+  }
+
+  // Waits for the next filled block, handing the one taken before back to the
+  // producer. False at the end of the data.
+  bool take(const char*& begin, const char*& end) {
+    std::unique_lock<std::mutex> guard(this->lock);
+    if (this->taken) {
+      this->first = (this->first + 1) % 2;
+      this->filled--;
+      this->taken = false;
+      this->changed.notify_all();
+    }
+    this->changed.wait(guard, [&]() {
+      return this->closed || this->filled > 0;
+    });
+    if (this->filled == 0) {
+      if (this->error) {
+        std::rethrow_exception(this->error);
+      }
+      return false;
+    }
+    begin = this->blocks[this->first].data();
+    end = begin + this->sizes[this->first];
+    this->taken = true;
+    return true;
+  }
+
+  // stops the producer, which sees nullptr from acquire()
+  void abandon() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->abandoned = true;
+    this->changed.notify_all();
+  }
+
+private:
+  std::vector<std::vector<char>> blocks;
+  std::size_t sizes[2] = {0, 0};
+  std::mutex lock;
+  std::condition_variable changed;
+  // blocks[first] is the oldest of the filled blocks
+  unsigned first = 0;
+  unsigned filled = 0;
+  bool taken = false;
+  bool closed = false;
+  bool abandoned = false;
+  std::exception_ptr error;
+};
+
+// Output block of an inflating loop: acquired from the pipeline when needed,
+// published once full. False from next() once the consumer has given up.
+class PipelineOutput {
+public:
+  PipelineOutput(BlockPipeline& pipeline) : pipeline(pipeline) {}
+
+  bool next(char*& out, std::size_t& size) {
+    if (this->block != nullptr) {
+      this->pipeline.publish(BlockPipeline::block_size);
+    }
+    this->block = this->pipeline.acquire();
+    out = this->block;
+    size = BlockPipeline::block_size;
+    return this->block != nullptr;
+  }
+
+  // publishes the used part of the current block
+  void finish(std::size_t unused) {
+    if (this->block != nullptr && unused < BlockPipeline::block_size) {
+      this->pipeline.publish(BlockPipeline::block_size - unused);
+    }
+    this->block = nullptr;
+  }
+
+private:
+  BlockPipeline& pipeline;
+  char* block = nullptr;
+};
+
+// Inflates the compressed input given by read(begin, end), which yields ranges
+// of it until it returns false, into out. Concatenated gzip members are read
+// as one stream, as by gzip -d.
+template <typename Read>
+void inflate_gzip(Read&& read, PipelineOutput& out) {
+  z_stream z;
+  std::memset(&z, 0, sizeof(z));
+  // 32: gzip header detection
+  if (inflateInit2(&z, 15 + 32) != Z_OK) {
+    throw std::runtime_error("couldn't start inflating");
+  }
+  char* block;
+  std::size_t size;
+  if (!out.next(block, size)) {
+    inflateEnd(&z);
+    return;
+  }
+  z.next_out = reinterpret_cast<Bytef*>(block);
+  z.avail_out = size;
+  int status = Z_OK;
+  const char* begin;
+  const char* end;
+  try {
+    while (read(begin, end)) {
+      z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(begin));
+      z.avail_in = end - begin;
+      while (z.avail_in > 0) {
+        if (status == Z_STREAM_END) {
+          inflateReset(&z);
+        }
+        status = inflate(&z, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+          throw std::runtime_error("corrupt gzip data");
+        }
+        if (z.avail_out == 0) {
+          if (!out.next(block, size)) {
+            inflateEnd(&z);
+            return;
+          }
+          z.next_out = reinterpret_cast<Bytef*>(block);
+          z.avail_out = size;
+        }
+      }
+    }
+    // output still held by zlib once the input ran out
+    while (status != Z_STREAM_END) {
+      status = inflate(&z, Z_NO_FLUSH);
+      if (status == Z_BUF_ERROR && z.avail_out > 0) {
+        throw std::runtime_error("truncated gzip data");
+      }
+      if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+        throw std::runtime_error("corrupt gzip data");
+      }
+      if (z.avail_out == 0) {
+        if (!out.next(block, size)) {
+          inflateEnd(&z);
+          return;
+        }
+        z.next_out = reinterpret_cast<Bytef*>(block);
+        z.avail_out = size;
+      }
+    }
+  } catch (...) {
+    inflateEnd(&z);
+    throw;
+  }
+  out.finish(z.avail_out);
+  inflateEnd(&z);
+}
+
+template <typename Read>
+void inflate_zstd(Read&& read, PipelineOutput& out) {
+#ifdef CLQ_ZSTD
+  ZSTD_DStream* stream = ZSTD_createDStream();
+  if (stream == nullptr || ZSTD_isError(ZSTD_initDStream(stream))) {
+    ZSTD_freeDStream(stream);
+    throw std::runtime_error("couldn't start decompressing zstd data");
+  }
+  ZSTD_outBuffer output = {nullptr, 0, 0};
+  char* block;
+  std::size_t size;
+  // 0 once a frame is complete, as at the end of a whole input
+  std::size_t hint = 0;
+  const char* begin;
+  const char* end;
+  try {
+    if (!out.next(block, size)) {
+      ZSTD_freeDStream(stream);
+      return;
+    }
+    output = {block, size, 0};
+    bool more = true;
+    while (more && read(begin, end)) {
+      ZSTD_inBuffer input = {begin, static_cast<std::size_t>(end - begin), 0};
+      while (input.pos < input.size || output.pos == output.size) {
+        if (output.pos == output.size) {
+          if (!out.next(block, size)) {
+            more = false;
+            break;
+          }
+          output = {block, size, 0};
+        }
+        hint = ZSTD_decompressStream(stream, &output, &input);
+        if (ZSTD_isError(hint)) {
+          throw std::runtime_error("corrupt zstd data");
+        }
+      }
+    }
+    if (more && hint != 0) {
+      throw std::runtime_error("truncated zstd data");
+    }
+    if (more) {
+      out.finish(output.size - output.pos);
+    }
+  } catch (...) {
+    ZSTD_freeDStream(stream);
+    throw;
+  }
+  ZSTD_freeDStream(stream);
+#else
+  (void) read;
+  (void) out;
+  throw std::runtime_error("zstd input needs a build with libzstd");
+#endif
+}
+
+// Decompresses the input given by read(begin, end) on a thread of its own and
+// passes the data to on_block(begin, end) in blocks, on the calling thread.
+template <typename Read, typename F>
+void read_compressed(Compression compression, Read&& read, F&& on_block) {
+  BlockPipeline pipeline;
+  boost::thread producer([&]() {
+    PipelineOutput out(pipeline);
+    try {
+      if (compression == Compression::gzip) {
+        inflate_gzip(read, out);
+      } else {
+        inflate_zstd(read, out);
+      }
+      pipeline.close(nullptr);
+    } catch (...) {
+      pipeline.close(std::current_exception());
+    }
+  });
+  try {
+    const char* begin;
+    const char* end;
+    while (pipeline.take(begin, end)) {
+      on_block(begin, end);
+    }
+  } catch (...) {
+    pipeline.abandon();
+    producer.join();
+    throw;
+  }
+  producer.join();
+}
+
+// Decompresses mapped compressed data, see read_compressed()
+template <typename F>
+void read_mapped_compressed(Compression compression, const char* begin, const char* end, F&& on_block) {
+  // zlib counts its input in 32 bits
+  const std::size_t piece = 1 << 26;
+  read_compressed(compression, [&](const char*& piece_begin, const char*& piece_end) {
+    if (begin == end) {
+      return false;
+    }
+    piece_begin = begin;
+    piece_end = begin + std::min<std::size_t>(end - begin, piece);
+    begin = piece_end;
+    return true;
+  }, on_block);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "consolidate.hpp"
+#include "count_reader.hpp"
+#include "partial.hpp"
+
+// --delta: class totals kept current from signed delta files instead of full
+// recounts. A snapshot is a partial (partial.hpp) holding the totals so far,
+// as written by --emit-partial. A delta is a count input whose records are
+// signed increments; the increments of a raw key are summed rather than
+// replacing each other. The delta's keys are folded into signed class deltas,
+// which are merged by form with the snapshot in one sequential pass. Classes
+// whose total reaches zero are dropped. A run costs the size of the delta plus
+// one read of the snapshot, which holds a record per class, not per raw key.
+
+// Sums the signed records of every delta file of input per raw key and folds
+// the sums into class deltas, negative ones held as two's complement
+inline ClassMap read_class_deltas(const std::string& input, const std::vector<unsigned>& widths,
+                                  std::uint64_t plan_hash, const std::vector<bool>& counted,
+                                  const Canonicalizer& canonicalizer, std::uint64_t* num_records) {
+  RawCountMap raw_count(widths);
+  *num_records = 0;
+  auto filenames = list_count_files(input);
+  for (auto& filename: filenames) {
+    CountRecordParser parser(widths, plan_hash, counted);
+    parser.accept_signed_counts();
+    try {
+      read_count_file(filename, parser, [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+        raw_count(node_id, labels) += count;
+      });
+    } catch (const std::runtime_error& e) {
+      if (filenames.size() == 1) {
+        throw;
+      }
+      throw std::runtime_error(filename + ": " + e.what());
+    }
+    *num_records += parser.records();
+  }
+  ClassMap ret;
+  canonicalizer.consolidate(raw_count, ret);
+  return ret;
+}
+
+struct DeltaStats {
+  std::uint64_t added = 0;
+  std::uint64_t changed = 0;
+  std::uint64_t removed = 0;
+};
+
+// Merges the class deltas into the snapshot: on_class(form, cls) is called in
+// form order for every class whose new total is not zero. A class keeps the
+// representative of the snapshot. Throws if a delta of source takes a total
+// below zero.
+template <typename F>
+DeltaStats apply_class_deltas(const std::string& snapshot, const ClassMap& deltas, const std::string& source,
+                              std::uint64_t plan_hash, bool edge_labels, F&& on_class) {
+  std::vector<ClassMap::const_iterator> sorted;
+  sorted.reserve(deltas.size());
+  for (auto iter = deltas.begin(); iter != deltas.end(); iter++) {
+    sorted.push_back(iter);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](ClassMap::const_iterator a, ClassMap::const_iterator b) {
+    return a->first < b->first;
+  });
+  auto below_zero = [&](const CanonicalClass& cls) {
+    std::string key;
+    for (auto label: cls.labels) {
+      key += " " + std::to_string(label);
+    }
+    return std::runtime_error(source + ": delta takes the class of node " + std::to_string(cls.node_id) + " labels" + key +
+                              " below zero");
+  };
+
+  DeltaStats stats;
+  PartialReader reader(snapshot, plan_hash, edge_labels);
+  bool in_snapshot = reader.next();
+  auto delta = sorted.begin();
+  while (in_snapshot || delta != sorted.end()) {
+    int c = !in_snapshot ? 1 : delta == sorted.end() ? -1 : reader.current_form().compare((*delta)->first);
+    if (c < 0) {
+      on_class(reader.current_form(), reader.current());
+      in_snapshot = reader.next();
+      continue;
+    }
+    auto& change = (*delta)->second;
+    const bool negative = static_cast<std::int64_t>(change.count) < 0;
+    if (c > 0) {
+      if (negative) {
+        throw below_zero(change);
+      }
+      if (change.count != 0) {
+        stats.added++;
+        on_class((*delta)->first, change);
+      }
+    } else {
+      CanonicalClass cls = reader.current();
+      if (negative && 0 - change.count > cls.count) {
+        throw below_zero(cls);
+      }
+      cls.count += change.count;
+      if (cls.count == 0) {
+        stats.removed++;
+      } else {
+        stats.changed += change.count != 0;
+        on_class(reader.current_form(), cls);
+      }
+      in_snapshot = reader.next();
+    }
+    ++delta;
+  }
+  return stats;
+}
@@ -0,0 +1,502 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "label_dictionary.hpp"
+
+// Pattern widths are small and known from the plan, so the per-record key code is
+// instantiated for every width in [min_fixed_width, max_fixed_width]. K == 0 is
+// the runtime-width fallback for unusually large plans.
+const unsigned min_fixed_width = 2;
+const unsigned max_fixed_width = 8;
+
+template <unsigned K>
+using WidthTag = std::integral_constant<unsigned, K>;
+
+// f(WidthTag<K>()) with K == width when it has a specialization, K == 0 otherwise
+template <typename F>
+inline void dispatch_width(unsigned width, F&& f) {
+  switch (width) {
+    case 2: f(WidthTag<2>()); break;
+    case 3: f(WidthTag<3>()); break;
+    case 4: f(WidthTag<4>()); break;
+    case 5: f(WidthTag<5>()); break;
+    case 6: f(WidthTag<6>()); break;
+    case 7: f(WidthTag<7>()); break;
+    case 8: f(WidthTag<8>()); break;
+    default: f(WidthTag<0>()); break;
+  }
+}
+
+template <unsigned K = 0>
+inline std::uint64_t hash_labels(const unsigned* labels, unsigned width) {
+  const unsigned n = K ? K : width;
+  std::uint64_t h = 0x9e3779b97f4a7c15ull;
+  for (unsigned i = 0; i < n; i++) {
+    h = (h ^ labels[i]) * 0xff51afd7ed558ccdull;
+    h ^= h >> 29;
+  }
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 32;
+  return h;
+}
+
+template <unsigned K = 0>
+inline bool equal_labels(const unsigned* a, const unsigned* b, unsigned width) {
+  const unsigned n = K ? K : width;
+  for (unsigned i = 0; i < n; i++) {
+    if (a[i] != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline std::uint64_t hash_packed(std::uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  key ^= key >> 33;
+  return key;
+}
+
+// A key ready for lookup: its labels, its packed word if the node's table packs
+// keys, and its hash (of the packed word if packed, of the labels otherwise)
+struct LabelKey {
+  const unsigned* labels;
+  std::uint64_t packed;
+  std::uint64_t hash;
+};
+
+class NodeCountTableBase {
+public:
+  virtual ~NodeCountTableBase() {}
+  virtual std::uint64_t& find_or_insert(const LabelKey& key) = 0;
+  // the count of the key, nullptr if absent
+  virtual const std::uint64_t* find(const LabelKey& key) const = 0;
+  virtual std::size_t size() const = 0;
+  virtual std::size_t capacity() const = 0;
+  virtual std::size_t memory_bytes() const = 0;
+};
+
+// Open-addressing (linear probing) map from the label vector of one plan node to
+// a 64-bit count. Labels are stored inline in one flat array and a parallel tag
+// array holds the upper hash bits (0 marks an empty slot), so there is no per-key
+// allocation and most mismatches are rejected without touching the labels.
+template <unsigned K>
+class NodeCountTable : public NodeCountTableBase {
+public:
+  static const unsigned fixed_width = K;
+
+  NodeCountTable(unsigned width, std::size_t capacity = 16) : runtime_width(width) {
+    std::size_t c = 16;
+    while (c < capacity) {
+      c <<= 1;
+    }
+    this->tags.assign(c, 0);
+    this->keys.assign(c * this->width(), 0);
+    this->counts.assign(c, 0);
+  }
+
+  unsigned width() const {
+    return K ? K : this->runtime_width;
+  }
+
+  // count of the key, inserted as 0 if absent
+  inline std::uint64_t& operator()(const unsigned* labels) {
+    return insert(labels, hash_labels<K>(labels, this->width()));
+  }
+
+  std::uint64_t& find_or_insert(const LabelKey& key) override {
+    return insert(key.labels, key.hash);
+  }
+
+  const std::uint64_t* find(const LabelKey& key) const override {
+    const unsigned w = this->width();
+    const std::uint32_t tag = static_cast<std::uint32_t>(key.hash >> 32) | 1;
+    const std::size_t mask = capacity() - 1;
+    for (std::size_t slot = key.hash & mask;; slot = (slot + 1) & mask) {
+      if (this->tags[slot] == 0) {
+        return nullptr;
+      }
+      if (this->tags[slot] == tag && equal_labels<K>(this->keys.data() + slot * w, key.labels, w)) {
+        return &this->counts[slot];
+      }
+    }
+  }
+
+  // an empty table of the same width
+  NodeCountTable empty_like() const {
+    return NodeCountTable(this->runtime_width);
+  }
+
+  // as operator(), with h = hash_labels(labels) already computed
+  inline std::uint64_t& insert(const unsigned* labels, std::uint64_t h) {
+    if ((this->num_keys + 1) * 10 > capacity() * 7) {
+      grow();
+    }
+    const unsigned w = this->width();
+    const std::uint32_t tag = static_cast<std::uint32_t>(h >> 32) | 1;
+    const std::size_t mask = capacity() - 1;
+    for (std::size_t slot = h & mask;; slot = (slot + 1) & mask) {
+      unsigned* key = this->keys.data() + slot * w;
+      if (this->tags[slot] == 0) {
+        this->tags[slot] = tag;
+        std::copy(labels, labels + w, key);
+        this->num_keys++;
+        return this->counts[slot];
+      }
+      if (this->tags[slot] == tag && equal_labels<K>(key, labels, w)) {
+        return this->counts[slot];
+      }
+    }
+  }
+
+  // f(labels, count) for every key
+  template <typename F>
+  void for_each(F&& f) const {
+    const unsigned w = this->width();
+    for (std::size_t slot = 0; slot < capacity(); slot++) {
+      if (this->tags[slot] != 0) {
+        f(this->keys.data() + slot * w, this->counts[slot]);
+      }
+    }
+  }
+
+  std::size_t size() const override {
+    return this->num_keys;
+  }
+
+  std::size_t capacity() const override {
+    return this->counts.size();
+  }
+
+  std::size_t memory_bytes() const override {
+    return this->tags.size() * sizeof(std::uint32_t) + this->keys.size() * sizeof(unsigned) +
+           this->counts.size() * sizeof(std::uint64_t);
+  }
+
+  void swap(NodeCountTable& other) {
+    std::swap(this->runtime_width, other.runtime_width);
+    std::swap(this->num_keys, other.num_keys);
+    this->tags.swap(other.tags);
+    this->keys.swap(other.keys);
+    this->counts.swap(other.counts);
+  }
+
+private:
+  unsigned runtime_width;
+  std::size_t num_keys = 0;
+  std::vector<std::uint32_t> tags;
+  std::vector<unsigned> keys;
+  std::vector<std::uint64_t> counts;
+
+  void grow() {
+    NodeCountTable bigger(this->runtime_width, capacity() * 2);
+    for_each([&](const unsigned* labels, std::uint64_t count) {
+      bigger(labels) = count;
+    });
+    swap(bigger);
+  }
+};
+
+// packed keys never set the top bit, see LabelDictionary::packs()
+const std::uint64_t empty_packed_key = ~std::uint64_t(0);
+
+// NodeCountTable for keys packed into one word by a LabelDictionary: hashing
+// and comparing a key are single-word operations and ~0 marks an empty slot.
+// for_each hands out the unpacked labels.
+template <unsigned K>
+class PackedNodeCountTable : public NodeCountTableBase {
+public:
+  static const unsigned fixed_width = K;
+
+  PackedNodeCountTable(unsigned width, const LabelDictionary& dictionary, std::size_t capacity = 16)
+      : runtime_width(width), dictionary(&dictionary) {
+    std::size_t c = 16;
+    while (c < capacity) {
+      c <<= 1;
+    }
+    this->keys.assign(c, empty_packed_key);
+    this->counts.assign(c, 0);
+  }
+
+  unsigned width() const {
+    return K ? K : this->runtime_width;
+  }
+
+  inline std::uint64_t& operator()(const unsigned* labels) {
+    std::uint64_t key = this->dictionary->pack(labels, width());
+    return insert(key, hash_packed(key));
+  }
+
+  std::uint64_t& find_or_insert(const LabelKey& key) override {
+    return insert(key.packed, key.hash);
+  }
+
+  const std::uint64_t* find(const LabelKey& key) const override {
+    const std::size_t mask = capacity() - 1;
+    for (std::size_t slot = key.hash & mask;; slot = (slot + 1) & mask) {
+      if (this->keys[slot] == key.packed) {
+        return &this->counts[slot];
+      }
+      if (this->keys[slot] == empty_packed_key) {
+        return nullptr;
+      }
+    }
+  }
+
+  // h = hash_packed(key)
+  inline std::uint64_t& insert(std::uint64_t key, std::uint64_t h) {
+    if ((this->num_keys + 1) * 10 > capacity() * 7) {
+      grow();
+    }
+    const std::size_t mask = capacity() - 1;
+    for (std::size_t slot = h & mask;; slot = (slot + 1) & mask) {
+      if (this->keys[slot] == key) {
+        return this->counts[slot];
+      }
+      if (this->keys[slot] == empty_packed_key) {
+        this->keys[slot] = key;
+        this->num_keys++;
+        return this->counts[slot];
+      }
+    }
+  }
+
+  // f(labels, count) for every key
+  template <typename F>
+  void for_each(F&& f) const {
+    unsigned labels[K ? K : 64];
+    for (std::size_t slot = 0; slot < capacity(); slot++) {
+      if (this->keys[slot] != empty_packed_key) {
+        this->dictionary->unpack(this->keys[slot], width(), labels);
+        f(static_cast<const unsigned*>(labels), this->counts[slot]);
+      }
+    }
+  }
+
+  // f(key, count) for every packed key
+  template <typename F>
+  void for_each_packed(F&& f) const {
+    for (std::size_t slot = 0; slot < capacity(); slot++) {
+      if (this->keys[slot] != empty_packed_key) {
+        f(this->keys[slot], this->counts[slot]);
+      }
+    }
+  }
+
+  PackedNodeCountTable empty_like() const {
+    return PackedNodeCountTable(this->runtime_width, *this->dictionary);
+  }
+
+  std::size_t size() const override {
+    return this->num_keys;
+  }
+
+  std::size_t capacity() const override {
+    return this->counts.size();
+  }
+
+  std::size_t memory_bytes() const override {
+    return this->keys.size() * sizeof(std::uint64_t) + this->counts.size() * sizeof(std::uint64_t);
+  }
+
+  void swap(PackedNodeCountTable& other) {
+    std::swap(this->runtime_width, other.runtime_width);
+    std::swap(this->dictionary, other.dictionary);
+    std::swap(this->num_keys, other.num_keys);
+    this->keys.swap(other.keys);
+    this->counts.swap(other.counts);
+  }
+
+private:
+  unsigned runtime_width;
+  const LabelDictionary* dictionary;
+  std::size_t num_keys = 0;
+  std::vector<std::uint64_t> keys;
+  std::vector<std::uint64_t> counts;
+
+  void grow() {
+    PackedNodeCountTable bigger(this->runtime_width, *this->dictionary, capacity() * 2);
+    for_each_packed([&](std::uint64_t key, std::uint64_t count) {
+      bigger.insert(key, hash_packed(key)) = count;
+    });
+    swap(bigger);
+  }
+};
+
+// packed when the dictionary is given and packs the width
+inline std::unique_ptr<NodeCountTableBase> make_node_count_table(unsigned width,
+                                                                 const LabelDictionary* dictionary = nullptr) {
+  std::unique_ptr<NodeCountTableBase> ret;
+  dispatch_width(width, [&](auto k) {
+    if (dictionary != nullptr && dictionary->packs(width)) {
+      ret.reset(new PackedNodeCountTable<decltype(k)::value>(width, *dictionary));
+    } else {
+      ret.reset(new NodeCountTable<decltype(k)::value>(width));
+    }
+  });
+  return ret;
+}
+
+// Map from (node_id, labels) to a 64-bit count: one NodeCountTable per plan node,
+// specialized on the node's width and created on its first key.
+// widths[node_id] is the number of labels of a node, as from Plan::get_id_vertex_num().
+// With a dictionary, the nodes whose keys it packs get a PackedNodeCountTable;
+// every label must then be in the dictionary, which must outlive the table.
+class FlatCountTable {
+public:
+  FlatCountTable(std::vector<unsigned> widths = {}, const LabelDictionary* dictionary = nullptr)
+      : widths(std::move(widths)), tables(this->widths.size()), dictionary(dictionary) {
+    for (auto width: this->widths) {
+      this->packed.push_back(dictionary != nullptr && dictionary->packs(width));
+    }
+  }
+
+  FlatCountTable(FlatCountTable&&) = default;
+  FlatCountTable& operator=(FlatCountTable&&) = default;
+
+  // the key of (node_id, labels), its hash being the same in every table with
+  // the same widths and dictionary
+  inline LabelKey key(unsigned node_id, const unsigned* labels) const {
+    const unsigned width = this->widths[node_id];
+    if (this->packed[node_id]) {
+      std::uint64_t packed = this->dictionary->pack(labels, width);
+      return LabelKey{labels, packed, hash_packed(packed)};
+    }
+    return LabelKey{labels, 0, hash_labels<>(labels, width)};
+  }
+
+  // count of the key, inserted as 0 if absent
+  inline std::uint64_t& operator()(unsigned node_id, const unsigned* labels) {
+    return find_or_insert(node_id, key(node_id, labels));
+  }
+
+  // as operator(), with the key already computed
+  inline std::uint64_t& find_or_insert(unsigned node_id, const LabelKey& key) {
+    auto& table = this->tables[node_id];
+    if (!table) {
+      table = make_node_count_table(this->widths[node_id], this->dictionary);
+    }
+    return table->find_or_insert(key);
+  }
+
+  // the count of (node_id, labels), nullptr if absent; every label must be in
+  // the dictionary if the node's keys are packed
+  inline const std::uint64_t* find(unsigned node_id, const unsigned* labels) const {
+    auto& table = this->tables[node_id];
+    return table ? table->find(key(node_id, labels)) : nullptr;
+  }
+
+  // f(node_id, table) for the table of every node with keys, table being a
+  // NodeCountTable<K> or PackedNodeCountTable<K> with the node's width
+  // specialization K
+  template <typename F>
+  void for_each_node(F&& f) const {
+    for (unsigned node_id = 0; node_id < this->tables.size(); node_id++) {
+      if (!this->tables[node_id]) {
+        continue;
+      }
+      dispatch_width(this->widths[node_id], [&](auto k) {
+        const unsigned K = decltype(k)::value;
+        if (this->packed[node_id]) {
+          f(node_id, static_cast<const PackedNodeCountTable<K>&>(*this->tables[node_id]));
+        } else {
+          f(node_id, static_cast<const NodeCountTable<K>&>(*this->tables[node_id]));
+        }
+      });
+    }
+  }
+
+  // f(node_id, labels, count) for every key
+  template <typename F>
+  void for_each(F&& f) const {
+    for_each_node([&](unsigned node_id, const auto& table) {
+      table.for_each([&](const unsigned* labels, std::uint64_t count) {
+        f(node_id, labels, count);
+      });
+    });
+  }
+
+  // overwrites our counts with those of other, which has the same widths and
+  // dictionary and is left empty
+  void assign_from(FlatCountTable& other) {
+    for (unsigned node_id = 0; node_id < other.tables.size(); node_id++) {
+      if (!other.tables[node_id]) {
+        continue;
+      }
+      if (!this->tables[node_id]) {
+        this->tables[node_id].swap(other.tables[node_id]);
+        continue;
+      }
+      dispatch_width(this->widths[node_id], [&](auto k) {
+        const unsigned K = decltype(k)::value;
+        if (this->packed[node_id]) {
+          using Table = PackedNodeCountTable<K>;
+          auto& into = static_cast<Table&>(*this->tables[node_id]);
+          static_cast<const Table&>(*other.tables[node_id]).for_each_packed([&](std::uint64_t key, std::uint64_t count) {
+            into.insert(key, hash_packed(key)) = count;
+          });
+        } else {
+          using Table = NodeCountTable<K>;
+          auto& into = static_cast<Table&>(*this->tables[node_id]);
+          static_cast<const Table&>(*other.tables[node_id]).for_each([&](const unsigned* labels, std::uint64_t count) {
+            into(labels) = count;
+          });
+        }
+      });
+      other.tables[node_id].reset();
+    }
+  }
+
+  const std::vector<unsigned>& node_widths() const {
+    return this->widths;
+  }
+
+  std::size_t size() const {
+    std::size_t ret = 0;
+    for (auto& table: this->tables) {
+      ret += table ? table->size() : 0;
+    }
+    return ret;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  std::size_t capacity() const {
+    std::size_t ret = 0;
+    for (auto& table: this->tables) {
+      ret += table ? table->capacity() : 0;
+    }
+    return ret;
+  }
+
+  std::size_t memory_bytes() const {
+    std::size_t ret = 0;
+    for (auto& table: this->tables) {
+      ret += table ? table->memory_bytes() : 0;
+    }
+    return ret;
+  }
+
+  // load factor over all slot arrays
+  double load() const {
+    return capacity() == 0 ? 0.0 : static_cast<double>(size()) / capacity();
+  }
+
+private:
+  std::vector<unsigned> widths;
+  std::vector<std::unique_ptr<NodeCountTableBase>> tables;
+  const LabelDictionary* dictionary;
+  std::vector<bool> packed;
+};
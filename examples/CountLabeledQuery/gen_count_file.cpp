@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "plan.hpp"
+#include "canonical_form.hpp"
+#include "count_format.hpp"
+
+// Synthetic count files for CountLabeledQueryBench. A pool of --keys random raw
+// keys (a query node of the plan and labels drawn uniformly from --labels
+// values) is sampled --records times with Zipf exponent --skew over the pool,
+// 0 being uniform. Like the dataflow's output, every record of a key carries
+// its cumulative count, so later records of a key supersede earlier ones.
+
+void usage(const char* program) {
+  std::cerr << "usage: " << program << " [--records N] [--keys K] [--labels A] [--skew S] [--seed X]"
+            << " [--edge-labels] [--binary] plan_file > count_file" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  std::uint64_t num_records = 1000000;
+  std::uint64_t num_keys = 0;
+  unsigned num_labels = 16;
+  double skew = 0;
+  std::uint64_t seed = 1;
+  bool edge_labels = false;
+  bool binary = false;
+  int arg = 1;
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (std::strcmp(argv[arg], "--records") == 0 && arg + 1 < argc) {
+      num_records = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--keys") == 0 && arg + 1 < argc) {
+      num_keys = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--labels") == 0 && arg + 1 < argc) {
+      num_labels = std::strtoul(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--skew") == 0 && arg + 1 < argc) {
+      skew = std::strtod(argv[++arg], nullptr);
+    } else if (std::strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc) {
+      seed = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--edge-labels") == 0) {
+      edge_labels = true;
+    } else if (std::strcmp(argv[arg], "--binary") == 0) {
+      binary = true;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - arg != 1 || num_labels == 0 || skew < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (num_keys == 0) {
+    num_keys = std::max<std::uint64_t>(1, num_records / 4);
+  }
+
+  Plan plan(argv[arg]);
+  std::vector<unsigned> widths = plan.get_id_vertex_num();
+  if (edge_labels) {
+    widths = get_key_widths(get_pattern_shapes(plan), true);
+  }
+  std::vector<unsigned> query_nodes;
+  unsigned max_width = 0;
+  for (auto& node: plan.nodes) {
+    if (node.is_query) {
+      query_nodes.push_back(node.idx);
+      max_width = std::max(max_width, widths[node.idx]);
+    }
+  }
+  if (query_nodes.empty()) {
+    std::cerr << argv[arg] << ": plan has no query nodes" << std::endl;
+    return 1;
+  }
+
+  std::mt19937_64 rng(seed);
+  // key k is node key_nodes[k] with labels key_labels[k * max_width ...]
+  std::vector<unsigned> key_nodes(num_keys);
+  std::vector<unsigned> key_labels(num_keys * max_width, 0);
+  std::vector<std::uint64_t> key_counts(num_keys, 0);
+  std::uniform_int_distribution<unsigned> pick_node(0, query_nodes.size() - 1);
+  std::uniform_int_distribution<unsigned> pick_label(0, num_labels - 1);
+  for (std::uint64_t k = 0; k < num_keys; k++) {
+    key_nodes[k] = query_nodes[pick_node(rng)];
+    for (unsigned i = 0; i < widths[key_nodes[k]]; i++) {
+      key_labels[k * max_width + i] = pick_label(rng);
+    }
+  }
+  // cdf[k] is the total weight of keys 0..k, key k weighing 1 / (k + 1)^skew
+  std::vector<double> cdf(num_keys);
+  double total = 0;
+  for (std::uint64_t k = 0; k < num_keys; k++) {
+    total += 1 / std::pow(static_cast<double>(k + 1), skew);
+    cdf[k] = total;
+  }
+  std::uniform_real_distribution<double> pick_key(0, total);
+  std::uniform_int_distribution<unsigned> pick_increment(1, 5);
+
+  std::ios::sync_with_stdio(false);
+  std::unique_ptr<CountRecordWriter> writer;
+  if (binary) {
+    writer.reset(new CountRecordWriter(std::cout, plan_file_hash(argv[arg]), max_width));
+  }
+  for (std::uint64_t r = 0; r < num_records; r++) {
+    std::uint64_t k = std::lower_bound(cdf.begin(), cdf.end(), pick_key(rng)) - cdf.begin();
+    k = std::min(k, num_keys - 1);
+    key_counts[k] += pick_increment(rng);
+    const unsigned* labels = &key_labels[k * max_width];
+    if (writer) {
+      writer->write(key_nodes[k], labels, widths[key_nodes[k]], key_counts[k]);
+      continue;
+    }
+    std::cout << key_nodes[k];
+    for (unsigned i = 0; i < widths[key_nodes[k]]; i++) {
+      std::cout << ' ' << labels[i];
+    }
+    std::cout << ' ' << key_counts[k] << '\n';
+  }
+  std::cout.flush();
+  return 0;
+}
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "consolidate.hpp"
+#include "parallel_count.hpp"
+
+// --approx: the heaviest classes of an input in memory fixed in advance. Records
+// are canonicalized as they are parsed, in one pass, and their counts added to
+// a Count-Min sketch and a Space-Saving summary of the class, one of each per
+// worker, so there is no table with an entry per raw key or class and no
+// canonical form is kept. The input is taken to hold one record per raw key,
+// as a final count file does; on inputs that repeat keys the bounds below are
+// those of the summed records. Cumulative inputs, where the last record of a
+// raw key gives its count, need dedup (--approx-dedup): raw keys are then first
+// deduplicated as in the exact mode, at a table entry per distinct raw key.
+//
+// A reported count never undercounts. It is the least of the Count-Min
+// estimate, which exceeds the true total by at most epsilon * N with
+// probability 1 - exp(-depth) (epsilon = e / width, N the sum of all counts),
+// and of the Space-Saving bound. The lower bound is a certain one: the sum of
+// what the Space-Saving summaries counted for the class after taking out their
+// evictions.
+
+// A class key: the canonical form without automorphisms; with them the group
+// representative followed by the canonical labels, or by the canonical form
+// when the group's automorphisms are incomplete. Returns the node whose layout
+// canonical is in.
+inline unsigned approx_class_key(const Canonicalizer& canonicalizer, unsigned node_id, const unsigned* labels,
+                                 unsigned width, std::vector<unsigned>& canonical, std::string& key) {
+  if (!canonicalizer.use_automorphisms) {
+    key = canonicalizer.class_form(node_id, labels);
+    std::memcpy(canonical.data(), labels, width * sizeof(unsigned));
+    return node_id;
+  }
+  const unsigned r = canonicalizer.representative[node_id];
+  key.assign(reinterpret_cast<const char*>(&r), sizeof(r));
+  if (!canonicalizer.automorphisms[node_id].complete) {
+    key += canonicalizer.class_form(node_id, labels);
+    std::memcpy(canonical.data(), labels, width * sizeof(unsigned));
+    return node_id;
+  }
+  canonical_labels(canonicalizer.automorphisms[node_id], labels, canonical.data());
+  key.append(reinterpret_cast<const char*>(canonical.data()), width * sizeof(unsigned));
+  return r;
+}
+
+// Count-Min sketch of depth rows of width counters, rows hashed by double hashing
+class CountMinSketch {
+public:
+  CountMinSketch(std::size_t width, unsigned depth) : width(width), depth(depth), cells(width * depth, 0) {}
+
+  void add(std::uint64_t hash, std::uint64_t count) {
+    std::uint64_t h2 = step(hash);
+    for (unsigned row = 0; row < this->depth; row++, hash += h2) {
+      this->cells[row * this->width + hash % this->width] += count;
+    }
+  }
+
+  std::uint64_t estimate(std::uint64_t hash) const {
+    std::uint64_t h2 = step(hash);
+    std::uint64_t ret = ~std::uint64_t(0);
+    for (unsigned row = 0; row < this->depth; row++, hash += h2) {
+      ret = std::min(ret, this->cells[row * this->width + hash % this->width]);
+    }
+    return ret;
+  }
+
+  // adds a sketch of the same shape
+  void merge(const CountMinSketch& other) {
+    for (std::size_t i = 0; i < this->cells.size(); i++) {
+      this->cells[i] += other.cells[i];
+    }
+  }
+
+  std::size_t memory_bytes() const {
+    return this->cells.size() * sizeof(std::uint64_t);
+  }
+
+private:
+  std::size_t width;
+  unsigned depth;
+  std::vector<std::uint64_t> cells;
+
+  static std::uint64_t step(std::uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash | 1;
+  }
+};
+
+// Weighted Space-Saving over capacity counters kept in a min-heap by count. A
+// key not tracked takes over the smallest counter, inheriting its count as the
+// counter's error.
+class SpaceSaving {
+public:
+  struct Counter {
+    const std::string* key;
+    std::uint64_t count;
+    std::uint64_t error;
+    CanonicalClass cls;
+  };
+
+  SpaceSaving(std::size_t capacity) : capacity(std::max<std::size_t>(capacity, 1)) {
+    this->heap.reserve(this->capacity);
+    this->slots.reserve(this->capacity);
+  }
+
+  // labels are the width labels the class is printed with
+  void add(const std::string& key, std::uint64_t count, unsigned node_id, const unsigned* labels, unsigned width) {
+    auto found = this->slots.find(key);
+    if (found != this->slots.end()) {
+      this->heap[found->second].count += count;
+      sift_down(found->second);
+      return;
+    }
+    std::size_t i;
+    std::uint64_t floor = 0;
+    if (this->heap.size() < this->capacity) {
+      i = this->heap.size();
+      this->heap.emplace_back();
+    } else {
+      i = 0;
+      floor = this->heap[0].count;
+      this->slots.erase(*this->heap[0].key);
+    }
+    auto slot = this->slots.emplace(key, i).first;
+    auto& counter = this->heap[i];
+    counter.key = &slot->first;
+    counter.count = floor + count;
+    counter.error = floor;
+    counter.cls.node_id = node_id;
+    counter.cls.labels.assign(labels, labels + width);
+    if (i == 0) {
+      sift_down(0);
+    } else {
+      sift_up(i);
+    }
+  }
+
+  // what an untracked key may have counted: the smallest count once full
+  std::uint64_t floor() const {
+    return this->heap.size() < this->capacity ? 0 : this->heap[0].count;
+  }
+
+  const std::vector<Counter>& counters() const {
+    return this->heap;
+  }
+
+  // the counters, their labels and the key index, nodes and buckets included
+  std::size_t memory_bytes() const {
+    std::size_t ret = this->heap.capacity() * sizeof(Counter) +
+                      this->slots.bucket_count() * sizeof(void*);
+    for (auto& counter: this->heap) {
+      ret += counter.cls.labels.capacity() * sizeof(unsigned);
+      // slot node: next pointer, key, index, cached hash
+      ret += sizeof(void*) + sizeof(std::string) + sizeof(std::size_t) + sizeof(std::size_t);
+      // keys longer than the small-string buffer live on the heap
+      const char* data = counter.key->data();
+      if (data < reinterpret_cast<const char*>(counter.key) || data >= reinterpret_cast<const char*>(counter.key + 1)) {
+        ret += counter.key->capacity() + 1;
+      }
+    }
+    return ret;
+  }
+
+private:
+  std::size_t capacity;
+  std::vector<Counter> heap;
+  std::unordered_map<std::string, std::size_t> slots;
+
+  void swap_counters(std::size_t a, std::size_t b) {
+    std::swap(this->heap[a], this->heap[b]);
+    this->slots.find(*this->heap[a].key)->second = a;
+    this->slots.find(*this->heap[b].key)->second = b;
+  }
+
+  void sift_up(std::size_t i) {
+    while (i > 0 && this->heap[(i - 1) / 2].count > this->heap[i].count) {
+      swap_counters(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  }
+
+  void sift_down(std::size_t i) {
+    while (true) {
+      std::size_t least = i;
+      for (std::size_t child = 2 * i + 1; child <= 2 * i + 2 && child < this->heap.size(); child++) {
+        if (this->heap[child].count < this->heap[least].count) {
+          least = child;
+        }
+      }
+      if (least == i) {
+        return;
+      }
+      swap_counters(i, least);
+      i = least;
+    }
+  }
+};
+
+struct HeavyHitter {
+  CanonicalClass cls;
+  // cls.count is the upper bound
+  std::uint64_t lower;
+};
+
+struct HeavyHitterResult {
+  std::vector<HeavyHitter> classes;
+  // sum of the counts of every record, or raw key with dedup
+  std::uint64_t total = 0;
+  // Count-Min overestimate bound epsilon * total, holding with probability confidence
+  std::uint64_t sketch_error = 0;
+  double confidence = 0;
+  // memory of the sketches, of the Space-Saving summaries and of dedup's raw tables
+  std::size_t sketch_bytes = 0;
+  std::size_t summary_bytes = 0;
+  std::size_t raw_bytes = 0;
+};
+
+struct HeavyHitterOptions {
+  std::size_t top_k = 0;
+  // Space-Saving counters per worker
+  std::size_t counters = 0;
+  std::size_t sketch_width = 1 << 16;
+  unsigned sketch_depth = 4;
+  // deduplicate cumulative raw keys first, see above
+  bool dedup = false;
+};
+
+// The count input read with num_threads workers, each with its own sketch and
+// summary; the top_k classes by upper bound, heaviest first, of those the
+// summaries tracked.
+inline HeavyHitterResult approximate_heavy_hitters(const std::string& filename, const std::vector<unsigned>& widths,
+                                                   std::uint64_t plan_hash, const std::vector<bool>& counted,
+                                                   unsigned num_threads, const Canonicalizer& canonicalizer,
+                                                   const HeavyHitterOptions& options,
+                                                   std::uint64_t* num_records = nullptr) {
+  struct Worker {
+    CountMinSketch sketch;
+    SpaceSaving summary;
+    std::uint64_t total = 0;
+    std::vector<unsigned> canonical;
+    std::string key;
+  };
+  const unsigned max_width = *std::max_element(widths.begin(), widths.end());
+  std::vector<Worker> workers;
+  for (unsigned w = 0; w < num_threads; w++) {
+    workers.push_back(Worker{CountMinSketch(options.sketch_width, options.sketch_depth),
+                             SpaceSaving(options.counters), 0, std::vector<unsigned>(max_width), std::string()});
+  }
+  std::hash<std::string> hash;
+  auto add = [&](unsigned w, unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    auto& worker = workers[w];
+    const unsigned width = widths[node_id];
+    unsigned key_node = approx_class_key(canonicalizer, node_id, labels, width, worker.canonical, worker.key);
+    worker.sketch.add(hash(worker.key), count);
+    worker.summary.add(worker.key, count, key_node, worker.canonical.data(), width);
+    worker.total += count;
+  };
+  std::uint64_t records = 0;
+  std::size_t raw_bytes = 0;
+  if (options.dedup) {
+    // shard s of the deduplicated raw counts goes to worker s
+    std::vector<RawCountMap> shards = parallel_raw_count(filename, widths, plan_hash, counted, num_threads, &records);
+    for (auto& shard: shards) {
+      raw_bytes += shard.memory_bytes();
+    }
+    run_workers(shards.size(), [&](unsigned s) {
+      shards[s].for_each([&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+        add(s, node_id, labels, count);
+      });
+    });
+  } else {
+    CountChunks chunks(filename, num_threads);
+    if (!chunks.mapped()) {
+      CountRecordParser parser(widths, plan_hash, counted);
+      read_count_file(filename, parser, [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+        add(0, node_id, labels, count);
+      });
+      records = parser.records();
+    } else {
+      for (auto n: chunks.parse_by_worker(widths, plan_hash, counted, num_threads, add)) {
+        records += n;
+      }
+    }
+  }
+  if (num_records != nullptr) {
+    *num_records = records;
+  }
+
+  HeavyHitterResult ret;
+  ret.raw_bytes = raw_bytes;
+  // the summaries' upper bound of a key is floors plus, for each summary
+  // tracking it, its count less that summary's floor
+  std::uint64_t floors = 0;
+  for (auto& worker: workers) {
+    floors += worker.summary.floor();
+    ret.total += worker.total;
+    ret.sketch_bytes += worker.sketch.memory_bytes();
+    ret.summary_bytes += worker.summary.memory_bytes();
+    if (&worker != &workers[0]) {
+      workers[0].sketch.merge(worker.sketch);
+    }
+  }
+  std::unordered_map<std::string, HeavyHitter> candidates;
+  for (auto& worker: workers) {
+    const std::uint64_t floor = worker.summary.floor();
+    for (auto& counter: worker.summary.counters()) {
+      auto found = candidates.find(*counter.key);
+      if (found == candidates.end()) {
+        found = candidates.emplace(*counter.key, HeavyHitter{counter.cls, 0}).first;
+        found->second.cls.count = floors;
+      }
+      found->second.cls.count += counter.count - floor;
+      found->second.lower += counter.count - counter.error;
+    }
+  }
+  for (auto& candidate: candidates) {
+    auto& cls = candidate.second.cls;
+    cls.count = std::min(cls.count, workers[0].sketch.estimate(hash(candidate.first)));
+    ret.classes.push_back(std::move(candidate.second));
+  }
+  auto heavier = [](const HeavyHitter& a, const HeavyHitter& b) {
+    return a.cls.count > b.cls.count || (a.cls.count == b.cls.count && (a.lower > b.lower ||
+           (a.lower == b.lower && (a.cls.node_id < b.cls.node_id ||
+                                   (a.cls.node_id == b.cls.node_id && a.cls.labels < b.cls.labels)))));
+  };
+  std::size_t k = std::min(options.top_k, ret.classes.size());
+  std::partial_sort(ret.classes.begin(), ret.classes.begin() + k, ret.classes.end(), heavier);
+  ret.classes.resize(k);
+  ret.sketch_error = static_cast<std::uint64_t>(std::ceil(std::exp(1.0) / options.sketch_width * ret.total));
+  ret.confidence = 1 - std::exp(-static_cast<double>(options.sketch_depth));
+  return ret;
+}
+
+// Text output prints each class as in the exact mode followed by
+// "Lower:L"; csv is that of CsvClassWriter with a count_lower column.
+inline void write_heavy_hitters(std::ostream& out, const std::string& format, const HeavyHitterResult& result,
+                                const std::vector<Graph>& id_graph_map, const std::vector<PatternShape>& shapes,
+                                bool edge_labels) {
+  if (format == "csv") {
+    out << "class_id,form,count,count_lower\n";
+  }
+  std::uint64_t class_id = 0;
+  for (auto& hitter: result.classes) {
+    auto& cls = hitter.cls;
+    if (format == "csv") {
+      out << class_id++ << ',' << canonical_form_hex(shapes[cls.node_id], cls.labels.data(), edge_labels) << ','
+          << cls.count << ',' << hitter.lower << '\n';
+    } else {
+      write_class(out, cls, id_graph_map, edge_labels);
+      out << "Lower:" << hitter.lower << "\n";
+    }
+  }
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Order-preserving map from the distinct labels of a run to dense ids
+// 0..size()-1, so that a key of k labels fits in k * bits() bits. Dense ids
+// compare like the labels they stand for, and packed keys come out of the
+// count tables as the original labels again.
+class LabelDictionary {
+public:
+  LabelDictionary(std::vector<unsigned> labels) : values(std::move(labels)) {
+    std::sort(this->values.begin(), this->values.end());
+    this->values.erase(std::unique(this->values.begin(), this->values.end()), this->values.end());
+    this->identity = this->values.empty() || this->values.back() == this->values.size() - 1;
+    while ((std::uint64_t(1) << this->num_bits) < this->values.size()) {
+      this->num_bits++;
+    }
+    // direct lookup for alphabets of moderate values, binary search beyond
+    if (!this->identity && !this->values.empty() && this->values.back() < direct_limit) {
+      this->index.assign(this->values.back() + 1, 0);
+      for (unsigned id = 0; id < this->values.size(); id++) {
+        this->index[this->values[id]] = id + 1;
+      }
+    }
+  }
+
+  std::size_t size() const {
+    return this->values.size();
+  }
+
+  unsigned bits() const {
+    return this->num_bits;
+  }
+
+  // whether a key of width labels packs into one word; the top bit stays
+  // clear so that ~0 can mark empty slots
+  bool packs(unsigned width) const {
+    return width * this->num_bits < 64;
+  }
+
+  inline std::uint64_t pack(const unsigned* labels, unsigned width) const {
+    std::uint64_t key = 0;
+    for (unsigned i = 0; i < width; i++) {
+      key |= static_cast<std::uint64_t>(encode(labels[i])) << (i * this->num_bits);
+    }
+    return key;
+  }
+
+  inline void unpack(std::uint64_t key, unsigned width, unsigned* labels) const {
+    const std::uint64_t mask = (std::uint64_t(1) << this->num_bits) - 1;
+    for (unsigned i = 0; i < width; i++) {
+      labels[i] = this->values[(key >> (i * this->num_bits)) & mask];
+    }
+  }
+
+  inline unsigned encode(unsigned label) const {
+    if (this->identity) {
+      if (label >= this->values.size()) {
+        unknown(label);
+      }
+      return label;
+    }
+    if (!this->index.empty()) {
+      if (label >= this->index.size() || this->index[label] == 0) {
+        unknown(label);
+      }
+      return this->index[label] - 1;
+    }
+    auto found = std::lower_bound(this->values.begin(), this->values.end(), label);
+    if (found == this->values.end() || *found != label) {
+      unknown(label);
+    }
+    return found - this->values.begin();
+  }
+
+private:
+  static const unsigned direct_limit = 1 << 22;
+
+  std::vector<unsigned> values;
+  std::vector<unsigned> index;
+  bool identity;
+  unsigned num_bits = 0;
+
+  [[noreturn]] static void unknown(unsigned label) {
+    throw std::runtime_error("label " + std::to_string(label) + " is not in the label dictionary");
+  }
+};
+
+// Distinct labels seen by one worker of a dictionary pass: a bitmap for small
+// labels, a hash set for the rest.
+class LabelSet {
+public:
+  inline void insert(unsigned label) {
+    if (label < bitmap_limit) {
+      if (label / 64 >= this->bitmap.size()) {
+        this->bitmap.resize(label / 64 + 1, 0);
+      }
+      this->bitmap[label / 64] |= std::uint64_t(1) << (label % 64);
+    } else {
+      this->large.insert(label);
+    }
+  }
+
+  void merge(const LabelSet& other) {
+    if (other.bitmap.size() > this->bitmap.size()) {
+      this->bitmap.resize(other.bitmap.size(), 0);
+    }
+    for (std::size_t i = 0; i < other.bitmap.size(); i++) {
+      this->bitmap[i] |= other.bitmap[i];
+    }
+    this->large.insert(other.large.begin(), other.large.end());
+  }
+
+  std::vector<unsigned> labels() const {
+    std::vector<unsigned> ret;
+    for (std::size_t i = 0; i < this->bitmap.size(); i++) {
+      for (unsigned b = 0; b < 64; b++) {
+        if ((this->bitmap[i] >> b) & 1) {
+          ret.push_back(i * 64 + b);
+        }
+      }
+    }
+    ret.insert(ret.end(), this->large.begin(), this->large.end());
+    return ret;
+  }
+
+private:
+  static const unsigned bitmap_limit = 1 << 24;
+
+  std::vector<std::uint64_t> bitmap;
+  std::unordered_set<unsigned> large;
+};
+
+// The distinct labels of a vertex-label file, "vertex_id label" per line as
+// read by the dataflow (wings_plan_labeled_vertex_from_file.rs)
+inline LabelDictionary read_label_file(const std::string& filename) {
+  std::ifstream file(filename);
+  if (!file) {
+    throw std::runtime_error("couldn't open " + filename);
+  }
+  LabelSet labels;
+  unsigned vertex, label;
+  while (file >> vertex >> label) {
+    labels.insert(label);
+  }
+  if (!file.eof()) {
+    throw std::runtime_error(filename + ": malformed vertex label line");
+  }
+  return LabelDictionary(labels.labels());
+}
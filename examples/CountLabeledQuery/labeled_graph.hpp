@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "boost/functional/hash.hpp"
+#include "boost/graph/adjacency_list.hpp"
+#include "boost/graph/vf2_sub_graph_iso.hpp"
+#include "boost/property_map/property_map.hpp"
+
+using EdgeProperty = boost::property<boost::edge_name_t, unsigned int>;
+using VertexProperty = boost::property<boost::vertex_name_t, unsigned int, boost::property<boost::vertex_index_t, int> >;
+using Graph = boost::adjacency_list<boost::vecS, boost::vecS, boost::bidirectionalS, VertexProperty, EdgeProperty>;
+
+inline std::ostream& operator<<(std::ostream& out, const Graph& g) {
+    //out<<"---Print Graph Start ----"<< std::endl;
+    auto labelling_vertex = boost::get(boost::vertex_name, g);
+    out << boost::num_vertices(g)<< " " << boost::num_edges(g) << "\n";
+    for (unsigned i = 0; i < boost::num_vertices(g); i++) {
+      out << labelling_vertex[i] << " ";
+    }
+    out << "\n";
+    for (auto ep = boost::edges(g); ep.first != ep.second; ++ep.first) {
+      unsigned int source_ = boost::source(*ep.first, g);
+      unsigned int target_ = boost::target(*ep.first, g);
+      out << source_ << " " << target_ << "\n";
+    }
+    //out<<"---Print Graph End----"<< std::endl;
+    return out;
+}
+
+// Original hash: XOR of vertex and edge labels plus the vertex and edge counts.
+// Any labeling where the XORs cancel lands in the same bucket.
+// vertex_label(v) gives the label of vertex v.
+template <typename VertexLabel>
+std::size_t xor_hash(const Graph& Graph, VertexLabel&& vertex_label) {
+  std::size_t res = 0;
+  auto labelling_edge = boost::get(boost::edge_name, Graph);
+  unsigned int edge_xor = 1;
+  unsigned int vertex_xor = 1;
+  for (auto ep = boost::edges(Graph); ep.first != ep.second; ++ep.first) {
+    unsigned int source = boost::source(*ep.first, Graph);
+    unsigned int target = boost::target(*ep.first, Graph);
+    edge_xor = edge_xor ^ labelling_edge[*ep.first];
+    vertex_xor = vertex_xor ^ vertex_label(source) ^ vertex_label(target);
+  }
+  unsigned int multi = edge_xor + vertex_xor;
+  boost::hash_combine(res, multi);
+  boost::hash_combine(res, boost::num_vertices(Graph));
+  boost::hash_combine(res, boost::num_edges(Graph));
+  return res;
+}
+
+// Isomorphism-invariant hash: every vertex starts from (label, in-degree, out-degree)
+// and is refined by Weisfeiler-Lehman rounds over its labeled in- and out-edges.
+// The hash is taken over the sorted multiset of final colors.
+template <typename VertexLabel>
+std::size_t wl_hash(const Graph& Graph, VertexLabel&& vertex_label, unsigned rounds = 2) {
+  auto labelling_edge = boost::get(boost::edge_name, Graph);
+  const unsigned n = boost::num_vertices(Graph);
+  std::vector<std::size_t> color(n), next(n), neighbors;
+  for (unsigned v = 0; v < n; v++) {
+    std::size_t c = 0;
+    boost::hash_combine(c, vertex_label(v));
+    boost::hash_combine(c, boost::in_degree(v, Graph));
+    boost::hash_combine(c, boost::out_degree(v, Graph));
+    color[v] = c;
+  }
+  for (unsigned r = 0; r < rounds; r++) {
+    for (unsigned v = 0; v < n; v++) {
+      std::size_t c = color[v];
+      neighbors.clear();
+      for (auto ep = boost::out_edges(v, Graph); ep.first != ep.second; ++ep.first) {
+        std::size_t e = color[boost::target(*ep.first, Graph)];
+        boost::hash_combine(e, labelling_edge[*ep.first]);
+        neighbors.push_back(e);
+      }
+      std::sort(neighbors.begin(), neighbors.end());
+      boost::hash_combine(c, boost::hash_range(neighbors.begin(), neighbors.end()));
+      neighbors.clear();
+      for (auto ep = boost::in_edges(v, Graph); ep.first != ep.second; ++ep.first) {
+        std::size_t e = color[boost::source(*ep.first, Graph)];
+        boost::hash_combine(e, labelling_edge[*ep.first]);
+        neighbors.push_back(e);
+      }
+      std::sort(neighbors.begin(), neighbors.end());
+      boost::hash_combine(c, boost::hash_range(neighbors.begin(), neighbors.end()));
+      next[v] = c;
+    }
+    color.swap(next);
+  }
+  std::sort(color.begin(), color.end());
+  std::size_t res = boost::hash_range(color.begin(), color.end());
+  boost::hash_combine(res, n);
+  boost::hash_combine(res, boost::num_edges(Graph));
+  return res;
+}
+
+struct XorGraphHash {
+  std::size_t operator()(Graph const &Graph) const {
+    auto labelling_vertex = boost::get(boost::vertex_name, Graph);
+    return xor_hash(Graph, [&](unsigned v) { return labelling_vertex[v]; });
+  }
+};
+
+struct GraphHash {
+  std::size_t operator()(Graph const &Graph) const {
+    auto labelling_vertex = boost::get(boost::vertex_name, Graph);
+    return wl_hash(Graph, [&](unsigned v) { return labelling_vertex[v]; });
+  }
+};
+
+// number of check_iso calls so far, i.e. VF2 comparisons made by the fallback path
+inline std::size_t& check_iso_calls() {
+  static std::size_t calls = 0;
+  return calls;
+}
+
+using VertexOrder = std::vector<boost::graph_traits<Graph>::vertex_descriptor>;
+
+// vertices_equivalent(v1, v2) compares the vertex labels of the two graphs;
+// order is the VF2 matching order of small_graph's vertices
+template <typename VertexEquivalent>
+bool check_iso(const Graph& small_graph, const Graph& large_graph, VertexEquivalent vertices_equivalent,
+               const VertexOrder& order) {
+  check_iso_calls()++;
+  // fast check at beginning
+  if (boost::num_vertices(small_graph) != boost::num_vertices(large_graph) || boost::num_edges(small_graph) != boost::num_edges(large_graph)) {
+    return false;
+  }
+
+  auto edge_name_map1 = boost::get(boost::edge_name, small_graph);
+  auto edge_name_map2 = boost::get(boost::edge_name, large_graph);
+  auto edge_comp = boost::make_property_map_equivalent(edge_name_map1, edge_name_map2);
+  // callback that do nothing
+  auto cb = [&](auto &&f, auto &&) {
+    // do nothing
+    return true;
+  };
+  // boost::vf2_print_callback <Graph, Graph> callback(small_graph, large_graph);
+  return boost::vf2_subgraph_iso(small_graph, large_graph, cb, order,
+                                 boost::edges_equivalent(edge_comp).vertices_equivalent(vertices_equivalent));
+}
+
+template <typename VertexEquivalent>
+bool check_iso(const Graph& small_graph, const Graph& large_graph, VertexEquivalent vertices_equivalent) {
+  return check_iso(small_graph, large_graph, vertices_equivalent, boost::vertex_order_by_mult(small_graph));
+}
+
+inline bool check_iso(const Graph& small_graph, const Graph& large_graph) {
+  auto vertex_name_map1 = boost::get(boost::vertex_name, small_graph);
+  auto vertex_name_map2 = boost::get(boost::vertex_name, large_graph);
+  return check_iso(small_graph, large_graph, boost::make_property_map_equivalent(vertex_name_map1, vertex_name_map2));
+}
+
+struct CmpGraph {
+  inline bool operator()(const Graph &a, const Graph &b) const {
+    return check_iso(a, b);
+  }
+};
+
+// A labeled instance of a plan-node pattern without copying the pattern: the
+// unlabeled plan-node graph plus the label of each of its vertices. The labels
+// must outlive the view. to_graph() materializes a real Graph for printing.
+struct LabeledPatternView {
+  const Graph* pattern;
+  const unsigned* labels;
+
+  Graph to_graph() const;
+};
+
+struct XorPatternViewHash {
+  std::size_t operator()(const LabeledPatternView& p) const {
+    return xor_hash(*p.pattern, [&](unsigned v) { return p.labels[v]; });
+  }
+};
+
+struct PatternViewHash {
+  std::size_t operator()(const LabeledPatternView& p) const {
+    return wl_hash(*p.pattern, [&](unsigned v) { return p.labels[v]; });
+  }
+};
+
+// VF2 matching orders of the plan-node patterns, computed once per plan: the
+// order only depends on the unlabeled pattern, not on the labels compared.
+struct PatternMatchOrders {
+  const Graph* patterns;
+  std::vector<VertexOrder> orders;
+
+  explicit PatternMatchOrders(const std::vector<Graph>& patterns) : patterns(patterns.data()) {
+    for (auto& pattern: patterns) {
+      this->orders.push_back(boost::vertex_order_by_mult(pattern));
+    }
+  }
+
+  const VertexOrder& of(const Graph* pattern) const {
+    return this->orders[pattern - this->patterns];
+  }
+};
+
+// With orders, views must point into the patterns the orders were computed
+// for; without, every comparison computes its matching order again.
+struct CmpPatternView {
+  const PatternMatchOrders* orders = nullptr;
+
+  inline bool operator()(const LabeledPatternView& a, const LabeledPatternView& b) const {
+    auto vertices_equivalent = [&](unsigned v1, unsigned v2) {
+      return a.labels[v1] == b.labels[v2];
+    };
+    if (this->orders == nullptr) {
+      return check_iso(*a.pattern, *b.pattern, vertices_equivalent);
+    }
+    return check_iso(*a.pattern, *b.pattern, vertices_equivalent, this->orders->of(a.pattern));
+  }
+};
+
+// copy of the plan-node pattern carrying the given vertex labels and, if given,
+// edge labels, edge_labels[e] being the label of the e-th edge in (source, target) order
+inline Graph make_labeled_graph(const Graph& pattern, const unsigned* labels, const unsigned* edge_labels = nullptr) {
+  Graph g = pattern;
+  auto labelling_vertex = boost::get(boost::vertex_name, g);
+  for (unsigned i = 0; i < boost::num_vertices(g); i++) {
+    labelling_vertex[i] = labels[i];
+  }
+  if (edge_labels != nullptr) {
+    std::vector<std::pair<unsigned, unsigned>> sorted;
+    for (auto ep = boost::edges(g); ep.first != ep.second; ++ep.first) {
+      sorted.emplace_back(boost::source(*ep.first, g), boost::target(*ep.first, g));
+    }
+    std::sort(sorted.begin(), sorted.end());
+    auto labelling_edge = boost::get(boost::edge_name, g);
+    for (auto ep = boost::edges(g); ep.first != ep.second; ++ep.first) {
+      auto e = std::make_pair<unsigned, unsigned>(boost::source(*ep.first, g), boost::target(*ep.first, g));
+      labelling_edge[*ep.first] = edge_labels[std::lower_bound(sorted.begin(), sorted.end(), e) - sorted.begin()];
+    }
+  }
+  return g;
+}
+
+// as operator<<, with the label of every edge after its endpoints
+inline void write_edge_labeled_graph(std::ostream& out, const Graph& g) {
+  auto labelling_vertex = boost::get(boost::vertex_name, g);
+  auto labelling_edge = boost::get(boost::edge_name, g);
+  out << boost::num_vertices(g) << " " << boost::num_edges(g) << "\n";
+  for (unsigned i = 0; i < boost::num_vertices(g); i++) {
+    out << labelling_vertex[i] << " ";
+  }
+  out << "\n";
+  for (auto ep = boost::edges(g); ep.first != ep.second; ++ep.first) {
+    out << boost::source(*ep.first, g) << " " << boost::target(*ep.first, g) << " " << labelling_edge[*ep.first] << "\n";
+  }
+}
+
+inline Graph LabeledPatternView::to_graph() const {
+  return make_labeled_graph(*this->pattern, this->labels);
+}
@@ -0,0 +1,140 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "plan.hpp"
+#include "automorphism.hpp"
+#include "canonical_form.hpp"
+#include "count_format.hpp"
+#include "results_index.hpp"
+
+// Queries on a results index written with --output-format index, answered
+// from the mapping without consolidating anything again:
+//
+//   count node_id labels...    the count of the class of the raw key, labels
+//                              in the record layout of the node
+//   classes node_id labels...  the classes of the node, or of a node
+//                              isomorphic to it, holding every one of the
+//                              vertex labels, as the csv of --output-format csv
+//
+// Queries are taken from the command line, or one per line from stdin.
+
+void usage(const char* program) {
+  std::cerr << "usage: " << program << " [--timing] index_file plan_file [count|classes node_id label...]"
+            << std::endl;
+}
+
+struct Lookup {
+  const ResultsIndex& index;
+  std::vector<PatternShape> shapes;
+  std::vector<unsigned> widths;
+  std::vector<unsigned> representative;
+
+  Lookup(const ResultsIndex& index, const Plan& plan)
+      : index(index), shapes(get_pattern_shapes(plan)), widths(get_key_widths(this->shapes, index.edge_labels())),
+        representative(get_node_groups(this->shapes, index.edge_labels()).representative) {}
+
+  // answers one query on out, false with a message on err if it is malformed
+  bool run(const std::vector<std::string>& query, std::ostream& out, std::ostream& err) const {
+    if (query.size() < 2 || (query[0] != "count" && query[0] != "classes")) {
+      err << "queries are count|classes node_id label..." << std::endl;
+      return false;
+    }
+    unsigned node_id = std::strtoul(query[1].c_str(), nullptr, 10);
+    std::vector<unsigned> labels;
+    for (std::size_t i = 2; i < query.size(); i++) {
+      labels.push_back(std::strtoul(query[i].c_str(), nullptr, 10));
+    }
+    if (node_id >= this->shapes.size()) {
+      err << "no plan node " << node_id << std::endl;
+      return false;
+    }
+    auto& shape = this->shapes[node_id];
+    if (query[0] == "count") {
+      if (labels.size() != this->widths[node_id]) {
+        err << "node " << node_id << " keys have " << this->widths[node_id] << " labels" << std::endl;
+        return false;
+      }
+      std::string form = canonical_form(shape, labels.data(),
+                                        this->index.edge_labels() ? labels.data() + shape.num_vertices : nullptr);
+      std::size_t c = this->index.find(form);
+      out << (c == this->index.size() ? 0 : this->index.count(c)) << "\n";
+      return true;
+    }
+    if (labels.empty() || labels.size() > shape.num_vertices) {
+      err << "node " << node_id << " classes hold 1 to " << shape.num_vertices << " vertex labels" << std::endl;
+      return false;
+    }
+    out << "class_id,form,count\n";
+    for (auto c: this->index.classes_with(this->representative[node_id], labels)) {
+      out << c << ',' << form_hex(this->index.form(c)) << ',' << this->index.count(c) << '\n';
+    }
+    return true;
+  }
+};
+
+int main(int argc, char* argv[]) {
+  bool timing = false;
+  int arg = 1;
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (std::strcmp(argv[arg], "--timing") == 0) {
+      timing = true;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - arg < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  std::unique_ptr<ResultsIndex> index;
+  try {
+    index.reset(new ResultsIndex(argv[arg]));
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (index->plan_hash() != plan_file_hash(argv[arg + 1])) {
+    std::cerr << argv[arg] << ": index was built for a different plan" << std::endl;
+    return 1;
+  }
+  Plan plan(argv[arg + 1]);
+  Lookup lookup(*index, plan);
+
+  auto run = [&](const std::vector<std::string>& query) {
+    auto start = std::chrono::steady_clock::now();
+    bool ok = lookup.run(query, std::cout, std::cerr);
+    if (timing) {
+      std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+      std::cerr << "# " << elapsed.count() << " us" << std::endl;
+    }
+    return ok;
+  };
+  if (argc - arg > 2) {
+    return run(std::vector<std::string>(argv + arg + 2, argv + argc)) ? 0 : 1;
+  }
+  int ret = 0;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    std::istringstream words(line);
+    std::vector<std::string> query;
+    for (std::string word; words >> word;) {
+      query.push_back(word);
+    }
+    if (query.empty()) {
+      continue;
+    }
+    if (!run(query)) {
+      ret = 1;
+    }
+    std::cout.flush();
+  }
+  return ret;
+}
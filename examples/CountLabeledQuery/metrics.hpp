@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+
+// Peak resident set size of the process so far
+inline std::uint64_t peak_rss_bytes() {
+  struct rusage usage;
+  if (::getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  // ru_maxrss is in kilobytes on Linux
+  return static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+// Phase timings and counters of one run, written as a flat JSON object for
+// --metrics:
+//
+//   {"phases_ms": {"plan_load": 0.1, ...}, "records_read": 42, ...}
+//
+// Fields keep the order they were added in.
+class RunMetrics {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // wall time since start, in milliseconds, as phases_ms.name
+  void add_phase(const std::string& name, Clock::time_point start) {
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    this->phases.emplace_back(name, number(ms));
+  }
+
+  void add(const std::string& name, std::uint64_t value) {
+    this->fields.emplace_back(name, std::to_string(value));
+  }
+
+  void add(const std::string& name, double value) {
+    this->fields.emplace_back(name, number(value));
+  }
+
+  void add(const std::string& name, const std::string& value) {
+    this->fields.emplace_back(name, "\"" + value + "\"");
+  }
+
+  void write_json(const std::string& filename) const {
+    std::ofstream out(filename);
+    if (!out) {
+      throw std::runtime_error("couldn't open " + filename);
+    }
+    out << "{\n  \"phases_ms\": {";
+    for (unsigned i = 0; i < this->phases.size(); i++) {
+      out << (i ? ", " : "") << "\"" << this->phases[i].first << "\": " << this->phases[i].second;
+    }
+    out << "}";
+    for (auto& field: this->fields) {
+      out << ",\n  \"" << field.first << "\": " << field.second;
+    }
+    out << "\n}\n";
+    if (!out) {
+      throw std::runtime_error("couldn't write " + filename);
+    }
+  }
+
+private:
+  std::vector<std::pair<std::string, std::string>> phases;
+  std::vector<std::pair<std::string, std::string>> fields;
+
+  static std::string number(double value) {
+    std::ostringstream out;
+    out.precision(6);
+    out << std::fixed << value;
+    return out.str();
+  }
+};
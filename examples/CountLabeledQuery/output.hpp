@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "consolidate.hpp"
+#include "count_format.hpp"
+
+// Stream buffer that writes to a file descriptor in large blocks and only on
+// overflow or an explicit flush.
+class FdOutputBuffer : public std::streambuf {
+public:
+  FdOutputBuffer(int fd, std::size_t size = 1 << 20) : fd(fd), buffer(size) {
+    setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+  }
+
+  ~FdOutputBuffer() {
+    flush_buffer();
+  }
+
+protected:
+  int_type overflow(int_type c) override {
+    if (!flush_buffer()) {
+      return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override {
+    return flush_buffer() ? 0 : -1;
+  }
+
+private:
+  int fd;
+  std::vector<char> buffer;
+
+  bool flush_buffer() {
+    const char* p = pbase();
+    while (p < pptr()) {
+      ssize_t n = ::write(this->fd, p, pptr() - p);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        return false;
+      }
+      p += n;
+    }
+    setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    return true;
+  }
+};
+
+// whether the output file, "-" being stdout, is the existing file filename
+inline bool same_file(const std::string& filename, const std::string& output_file) {
+  struct stat a, b;
+  if (::stat(filename.c_str(), &a) != 0) {
+    return false;
+  }
+  int found = output_file == "-" ? ::fstat(1, &b) : ::stat(output_file.c_str(), &b);
+  return found == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Buffered output file, "-" being stdout
+class OutputFile {
+public:
+  OutputFile(const std::string& filename) : filename(filename) {
+    this->fd = filename == "-" ? 1 : ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (this->fd < 0) {
+      throw std::runtime_error("couldn't open " + filename);
+    }
+    this->buffer.reset(new FdOutputBuffer(this->fd));
+    this->out.reset(new std::ostream(this->buffer.get()));
+  }
+
+  ~OutputFile() {
+    this->out.reset();
+    this->buffer.reset();
+    if (this->fd > 1) {
+      ::close(this->fd);
+    }
+  }
+
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+
+  std::ostream& stream() {
+    return *this->out;
+  }
+
+  // writes out everything buffered so far
+  void flush() {
+    if (!this->out->flush()) {
+      throw std::runtime_error("couldn't write " + this->filename);
+    }
+  }
+
+private:
+  std::string filename;
+  int fd = -1;
+  std::unique_ptr<FdOutputBuffer> buffer;
+  std::unique_ptr<std::ostream> out;
+};
+
+// Output stage for consolidated classes. The writers never flush by
+// themselves; the caller flushes at the end or at stream epochs.
+class ClassWriter {
+public:
+  virtual ~ClassWriter() {}
+  virtual void write(const CanonicalClass& cls) = 0;
+  // as write(), with the class numbered by the caller instead of in output
+  // order, as --follow does so that a class keeps its id across epochs
+  virtual void write_numbered(const CanonicalClass& cls, std::uint64_t) {
+    write(cls);
+  }
+  // epoch marker of --follow, "#..." without the newline
+  virtual void marker(const std::string& text) = 0;
+  // after the last class, for writers that hold classes back
+  virtual void finish() {}
+};
+
+// "Count:N" followed by the labeled pattern graph, as printed originally
+class TextClassWriter : public ClassWriter {
+public:
+  TextClassWriter(std::ostream& out, const std::vector<Graph>& id_graph_map, bool edge_labels)
+      : out(out), id_graph_map(id_graph_map), edge_labels(edge_labels) {}
+
+  void write(const CanonicalClass& cls) override {
+    write_class(this->out, cls, this->id_graph_map, this->edge_labels);
+  }
+
+  void marker(const std::string& text) override {
+    this->out << text << "\n";
+  }
+
+private:
+  std::ostream& out;
+  const std::vector<Graph>& id_graph_map;
+  bool edge_labels;
+};
+
+// One line per class: class_id,form,count. form is the class's canonical form
+// in hex, which names the class whichever raw key, engine or mode found it, so
+// that runs can be joined on it. class_id numbers the classes in output order,
+// or by first appearance in the stream with --follow.
+class CsvClassWriter : public ClassWriter {
+public:
+  CsvClassWriter(std::ostream& out, std::vector<PatternShape> shapes, bool edge_labels)
+      : out(out), shapes(std::move(shapes)), edge_labels(edge_labels) {
+    this->out << "class_id,form,count\n";
+  }
+
+  void write(const CanonicalClass& cls) override {
+    write_numbered(cls, this->next_id++);
+  }
+
+  void write_numbered(const CanonicalClass& cls, std::uint64_t class_id) override {
+    this->out << class_id << ',' << canonical_form_hex(this->shapes[cls.node_id], cls.labels.data(), this->edge_labels)
+              << ',' << cls.count << '\n';
+  }
+
+  void marker(const std::string& text) override {
+    this->out << text << '\n';
+  }
+
+private:
+  std::ostream& out;
+  std::vector<PatternShape> shapes;
+  bool edge_labels;
+  std::uint64_t next_id = 0;
+};
+
+// The binary count-record format of count_format.hpp, one record per class,
+// with count_file_flag_classes set. Such a file is itself a valid count file
+// of the plan.
+class BinaryClassWriter : public ClassWriter {
+public:
+  BinaryClassWriter(std::ostream& out, std::uint64_t plan_hash, const std::vector<unsigned>& widths)
+      : writer(out, plan_hash, *std::max_element(widths.begin(), widths.end()), count_file_flag_classes) {}
+
+  void write(const CanonicalClass& cls) override {
+    this->writer.write(cls.node_id, cls.labels.data(), cls.labels.size(), cls.count);
+  }
+
+  void marker(const std::string&) override {
+    throw std::runtime_error("binary output has no epoch markers");
+  }
+
+private:
+  CountRecordWriter writer;
+};
+
+inline bool is_output_format(const std::string& format) {
+  return format == "text" || format == "csv" || format == "binary";
+}
+
+// widths are the record widths of the plan nodes, as given to the parser
+inline std::unique_ptr<ClassWriter> make_class_writer(const std::string& format, std::ostream& out,
+                                                      const std::vector<Graph>& id_graph_map,
+                                                      const std::vector<PatternShape>& shapes, bool edge_labels,
+                                                      std::uint64_t plan_hash, const std::vector<unsigned>& widths) {
+  std::unique_ptr<ClassWriter> ret;
+  if (format == "csv") {
+    ret.reset(new CsvClassWriter(out, shapes, edge_labels));
+  } else if (format == "binary") {
+    ret.reset(new BinaryClassWriter(out, plan_hash, widths));
+  } else {
+    ret.reset(new TextClassWriter(out, id_graph_map, edge_labels));
+  }
+  return ret;
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "boost/thread/thread.hpp"
+
+#include "consolidate.hpp"
+#include "count_reader.hpp"
+
+// Runs work(i) for i in [0, num_threads) on their own threads and rethrows the
+// first exception any of them raised.
+template <typename F>
+void run_workers(unsigned num_threads, F&& work) {
+  std::vector<std::exception_ptr> errors(num_threads);
+  boost::thread_group workers;
+  for (unsigned i = 0; i < num_threads; i++) {
+    workers.create_thread([&, i]() {
+      try {
+        work(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  workers.join_all();
+  for (auto& error: errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+// A mapped count input cut into chunks at record boundaries, about num_chunks
+// chunks over all files weighted by size, kept in input order. The files are
+// those of list_count_files(input); an unmapped input (a pipe) is left for the
+// caller to read sequentially. A compressed file is one chunk, decompressed by
+// the worker parsing it.
+class CountChunks {
+public:
+  // header is the binary header for chunks after a file's first
+  struct Chunk {
+    const char* begin;
+    const char* end;
+    const char* header;
+    const std::string* filename;
+    Compression compression;
+  };
+
+  CountChunks(const std::string& input, unsigned num_chunks) : filenames(list_count_files(input)) {
+    std::size_t total_size = 0;
+    for (auto& name: this->filenames) {
+      this->files.emplace_back(new MappedFile(name));
+      total_size += this->files.back()->end() - this->files.back()->begin();
+    }
+    if (this->files.size() == 1 && !this->files[0]->mapped()) {
+      this->files.clear();
+      return;
+    }
+    for (unsigned f = 0; f < this->files.size(); f++) {
+      auto& file = this->files[f];
+      if (!file->mapped()) {
+        // an empty shard
+        continue;
+      }
+      file->will_need();
+      Compression compression = compression_of(file->begin(), file->end());
+      if (compression != Compression::none) {
+        this->chunks.push_back(Chunk{file->begin(), file->end(), nullptr, &this->filenames[f], compression});
+        continue;
+      }
+      std::size_t size = file->end() - file->begin();
+      unsigned file_chunks = std::max<std::size_t>(1, (size * num_chunks + total_size - 1) / total_size);
+      bool binary = *file->begin() == count_file_magic[0];
+      auto ranges = split_count_data(file->begin(), file->end(), file_chunks);
+      for (unsigned i = 0; i < ranges.size(); i++) {
+        this->chunks.push_back(Chunk{ranges[i].first, ranges[i].second, binary && i > 0 ? file->begin() : nullptr,
+                                     &this->filenames[f], Compression::none});
+      }
+    }
+  }
+
+  // false for a single unmapped input
+  bool mapped() const {
+    return !this->files.empty();
+  }
+
+  std::size_t size() const {
+    return this->chunks.size();
+  }
+
+  // Parses every chunk with up to num_threads workers taking chunks in input
+  // order; on_record(c, node_id, labels, count) gets the counted records of
+  // chunk c, see CountRecordParser. Returns the number of records of each chunk.
+  template <typename F>
+  std::vector<std::uint64_t> parse(const std::vector<unsigned>& widths, std::uint64_t plan_hash,
+                                   const std::vector<bool>& counted, unsigned num_threads, F&& on_record) const {
+    return parse_chunks(widths, plan_hash, counted, num_threads,
+                        [&](unsigned, std::size_t c, unsigned node_id, const unsigned* labels, std::uint64_t count) {
+      on_record(c, node_id, labels, count);
+    });
+  }
+
+  // as parse(), on_record(worker, node_id, labels, count) getting the index of
+  // the worker below num_threads instead of the chunk, for per-thread state
+  template <typename F>
+  std::vector<std::uint64_t> parse_by_worker(const std::vector<unsigned>& widths, std::uint64_t plan_hash,
+                                             const std::vector<bool>& counted, unsigned num_threads,
+                                             F&& on_record) const {
+    return parse_chunks(widths, plan_hash, counted, num_threads,
+                        [&](unsigned worker, std::size_t, unsigned node_id, const unsigned* labels,
+                            std::uint64_t count) {
+      on_record(worker, node_id, labels, count);
+    });
+  }
+
+private:
+  std::vector<std::string> filenames;
+  std::vector<std::unique_ptr<MappedFile>> files;
+  std::vector<Chunk> chunks;
+
+  template <typename F>
+  std::vector<std::uint64_t> parse_chunks(const std::vector<unsigned>& widths, std::uint64_t plan_hash,
+                                          const std::vector<bool>& counted, unsigned num_threads,
+                                          F&& on_record) const {
+    std::vector<std::uint64_t> chunk_records(this->chunks.size(), 0);
+    std::atomic<std::size_t> next_chunk(0);
+    run_workers(std::min<std::size_t>(num_threads, this->chunks.size()), [&](unsigned worker) {
+      for (std::size_t c; (c = next_chunk++) < this->chunks.size();) {
+        auto& chunk = this->chunks[c];
+        CountRecordParser parser(widths, plan_hash, counted);
+        if (chunk.header != nullptr) {
+          parser.expect_binary(chunk.header);
+        }
+        auto on_chunk_record = [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+          on_record(worker, c, node_id, labels, count);
+        };
+        try {
+          if (chunk.compression == Compression::none) {
+            parser.feed(chunk.begin, chunk.end, on_chunk_record);
+          } else {
+            read_mapped_compressed(chunk.compression, chunk.begin, chunk.end, [&](const char* begin, const char* end) {
+              parser.feed(begin, end, on_chunk_record);
+            });
+          }
+          parser.finish(on_chunk_record);
+        } catch (const std::runtime_error& e) {
+          if (this->filenames.size() == 1) {
+            throw;
+          }
+          throw std::runtime_error(*chunk.filename + ": " + e.what());
+        }
+        chunk_records[c] = parser.records();
+      }
+    });
+    return chunk_records;
+  }
+};
+
+// Parses the count input with num_threads workers and returns the deduplicated
+// raw counts split into num_threads shards by key hash. The input is a count
+// file or a directory or glob of per-worker shard files, read as if they were
+// concatenated in list_count_files order.
+//
+// The workers parse the CountChunks of the input into per-shard maps. Shard s
+// then replays the chunks' maps for s in input order, so a key seen in several
+// chunks keeps the count of its last record, exactly as with the sequential
+// reader. A single unmapped input (a pipe) is parsed on one thread. Records of
+// nodes not counted are dropped, see CountRecordParser. The number of records
+// read is stored in num_records if given. With a dictionary the tables pack
+// keys, see FlatCountTable.
+inline std::vector<RawCountMap> parallel_raw_count(const std::string& filename, const std::vector<unsigned>& widths,
+                                                   std::uint64_t plan_hash, const std::vector<bool>& counted,
+                                                   unsigned num_threads,
+                                                   std::uint64_t* num_records = nullptr,
+                                                   const LabelDictionary* dictionary = nullptr) {
+  // the high hash bits pick the shard, the low ones the slot inside it
+  auto shard_of = [num_threads](std::uint64_t h) {
+    return static_cast<unsigned>((h >> 32) % num_threads);
+  };
+  std::vector<RawCountMap> shards;
+  for (unsigned s = 0; s < num_threads; s++) {
+    shards.emplace_back(widths, dictionary);
+  }
+  CountChunks chunks(filename, num_threads);
+  if (!chunks.mapped()) {
+    CountRecordParser parser(widths, plan_hash, counted);
+    read_count_file(filename, parser, [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+      LabelKey key = shards[0].key(node_id, labels);
+      shards[shard_of(key.hash)].find_or_insert(node_id, key) = count;
+    });
+    if (num_records != nullptr) {
+      *num_records = parser.records();
+    }
+    return shards;
+  }
+
+  // parts[c][s] holds the keys of chunk c that belong to shard s
+  std::vector<std::vector<RawCountMap>> parts(chunks.size());
+  for (auto& part: parts) {
+    for (unsigned s = 0; s < num_threads; s++) {
+      part.emplace_back(widths, dictionary);
+    }
+  }
+  auto chunk_records = chunks.parse(widths, plan_hash, counted, num_threads,
+                                    [&](std::size_t c, unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    LabelKey key = shards[0].key(node_id, labels);
+    parts[c][shard_of(key.hash)].find_or_insert(node_id, key) = count;
+  });
+  run_workers(num_threads, [&](unsigned s) {
+    for (auto& part: parts) {
+      shards[s].assign_from(part[s]);
+    }
+  });
+  if (num_records != nullptr) {
+    *num_records = 0;
+    for (auto n: chunk_records) {
+      *num_records += n;
+    }
+  }
+  return shards;
+}
+
+// The dictionary pass of --labels scan: the distinct labels of every counted
+// record of a mapped count input, collected with num_threads workers
+inline LabelDictionary scan_label_dictionary(const std::string& filename, const std::vector<unsigned>& widths,
+                                             std::uint64_t plan_hash, const std::vector<bool>& counted,
+                                             unsigned num_threads) {
+  CountChunks chunks(filename, num_threads);
+  if (!chunks.mapped()) {
+    throw std::runtime_error("the label dictionary pass needs regular count files");
+  }
+  std::vector<LabelSet> chunk_labels(chunks.size());
+  chunks.parse(widths, plan_hash, counted, num_threads,
+               [&](std::size_t c, unsigned node_id, const unsigned* labels, std::uint64_t) {
+    for (unsigned i = 0; i < widths[node_id]; i++) {
+      chunk_labels[c].insert(labels[i]);
+    }
+  });
+  LabelSet all;
+  for (auto& labels: chunk_labels) {
+    all.merge(labels);
+  }
+  return LabelDictionary(all.labels());
+}
+
+// Every worker folds its raw shard into a thread-local class map, the partial
+// maps are merged at the end.
+inline ClassMap parallel_consolidate(const std::vector<RawCountMap>& shards, const Canonicalizer& canonicalizer) {
+  std::vector<ClassMap> partial(shards.size());
+  run_workers(shards.size(), [&](unsigned s) {
+    canonicalizer.consolidate(shards[s], partial[s]);
+  });
+  ClassMap ret;
+  for (auto& classes: partial) {
+    if (ret.empty()) {
+      ret.swap(classes);
+    } else {
+      merge_classes(ret, classes);
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "consolidate.hpp"
+#include "count_format.hpp"
+#include "count_reader.hpp"
+
+// Partial results for distributed consolidation: the classes of one run keyed
+// by canonical form, sorted by form so that any number of partials merge in
+// one streaming pass. Merging adds the counts of equal forms, which is
+// associative, so partials can be merged in a tree. The raw inputs of the
+// partials must be disjoint: a raw key counted in two partials is counted twice.
+//
+//   header:  CountFileHeader with magic "CLQPARTL", flags as below
+//   records: u32 form_size, char form[form_size], u32 node_id, u32 width,
+//            u32 labels[width], u64 count
+//
+// form is Canonicalizer::class_form() and node_id and labels a representative
+// key for printing. Forms are strictly increasing within a partial.
+
+const char partial_file_magic[8] = {'C', 'L', 'Q', 'P', 'A', 'R', 'T', 'L'};
+// 2: forms of shapes beyond max_bitmask_vertices from refined_adjacency()
+const std::uint32_t partial_file_version = 2;
+
+// header flag: class keys carry edge labels
+const std::uint32_t partial_flag_edge_labels = 1;
+
+class PartialWriter {
+public:
+  PartialWriter(std::ostream& out, std::uint64_t plan_hash, unsigned max_width, bool edge_labels) : out(out) {
+    CountFileHeader header;
+    std::memcpy(header.magic, partial_file_magic, sizeof(header.magic));
+    header.version = partial_file_version;
+    header.max_width = max_width;
+    header.plan_hash = plan_hash;
+    header.flags = edge_labels ? partial_flag_edge_labels : 0;
+    header.reserved = 0;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+
+  // forms must be written in increasing order
+  void write(const std::string& form, const CanonicalClass& cls) {
+    put(static_cast<std::uint32_t>(form.size()));
+    this->out.write(form.data(), form.size());
+    put(static_cast<std::uint32_t>(cls.node_id));
+    put(static_cast<std::uint32_t>(cls.labels.size()));
+    for (auto label: cls.labels) {
+      put(static_cast<std::uint32_t>(label));
+    }
+    put(static_cast<std::uint64_t>(cls.count));
+  }
+
+private:
+  std::ostream& out;
+
+  template <typename T>
+  void put(T value) {
+    this->out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+};
+
+// writes the classes of canonical_count sorted by form
+inline void write_partial(PartialWriter& writer, const ClassMap& canonical_count) {
+  std::vector<ClassMap::const_iterator> sorted;
+  sorted.reserve(canonical_count.size());
+  for (auto iter = canonical_count.begin(); iter != canonical_count.end(); iter++) {
+    sorted.push_back(iter);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](ClassMap::const_iterator a, ClassMap::const_iterator b) {
+    return a->first < b->first;
+  });
+  for (auto iter: sorted) {
+    writer.write(iter->first, iter->second);
+  }
+}
+
+// Sequential reader of one mapped partial file
+class PartialReader {
+public:
+  PartialReader(const std::string& filename, std::uint64_t plan_hash, bool edge_labels)
+      : filename(filename), file(filename) {
+    read_header(plan_hash, edge_labels);
+  }
+
+  // an open partial, such as an unlinked spill run; name is for messages
+  PartialReader(int fd, const std::string& name, std::uint64_t plan_hash, bool edge_labels)
+      : filename(name), file(fd) {
+    read_header(plan_hash, edge_labels);
+  }
+
+  PartialReader(const PartialReader&) = delete;
+  PartialReader& operator=(const PartialReader&) = delete;
+
+  // reads the next class into form and cls, false at the end of the file
+  bool next() {
+    if (this->pos == this->file.end()) {
+      return false;
+    }
+    std::uint32_t form_size, node_id, width;
+    take(&form_size, sizeof(form_size));
+    std::string form(form_size, 0);
+    take(&form[0], form_size);
+    if (this->has_form && !(this->form < form)) {
+      throw std::runtime_error(this->filename + ": partial is not sorted");
+    }
+    take(&node_id, sizeof(node_id));
+    take(&width, sizeof(width));
+    if (width > this->max_width) {
+      throw std::runtime_error(this->filename + ": partial record wider than the header's max_width");
+    }
+    this->cls.node_id = node_id;
+    this->cls.labels.resize(width);
+    take(this->cls.labels.data(), width * sizeof(unsigned));
+    take(&this->cls.count, sizeof(this->cls.count));
+    this->form.swap(form);
+    this->has_form = true;
+    // a merge streams through its partials once, what was read need not stay resident
+    if (static_cast<std::size_t>(this->pos - this->released) > release_interval) {
+      this->file.release(this->pos);
+      this->released = this->pos;
+    }
+    return true;
+  }
+
+  const std::string& current_form() const {
+    return this->form;
+  }
+
+  const CanonicalClass& current() const {
+    return this->cls;
+  }
+
+private:
+  static const std::size_t release_interval = 1 << 16;
+
+  std::string filename;
+  MappedFile file;
+  const char* pos;
+  const char* released;
+  unsigned max_width;
+  bool has_form = false;
+  std::string form;
+  CanonicalClass cls;
+
+  void take(void* into, std::size_t size) {
+    if (static_cast<std::size_t>(this->file.end() - this->pos) < size) {
+      throw std::runtime_error(this->filename + ": truncated partial");
+    }
+    std::memcpy(into, this->pos, size);
+    this->pos += size;
+  }
+
+  void read_header(std::uint64_t plan_hash, bool edge_labels) {
+    if (!this->file.mapped()) {
+      throw std::runtime_error(this->filename + ": partials must be regular, non-empty files");
+    }
+    this->pos = this->file.begin();
+    this->released = this->pos;
+    CountFileHeader header;
+    take(&header, sizeof(header));
+    if (std::memcmp(header.magic, partial_file_magic, sizeof(header.magic)) != 0) {
+      throw std::runtime_error(this->filename + ": not a partial result file");
+    }
+    if (header.version != partial_file_version) {
+      throw std::runtime_error(this->filename + ": unsupported partial version " + std::to_string(header.version));
+    }
+    if (plan_hash != 0 && header.plan_hash != plan_hash) {
+      throw std::runtime_error(this->filename + ": partial was produced for a different plan");
+    }
+    if (((header.flags & partial_flag_edge_labels) != 0) != edge_labels) {
+      throw std::runtime_error(this->filename + ": partial and --edge-labels disagree");
+    }
+    this->max_width = header.max_width;
+  }
+};
+
+// k-way merge of sorted partials: on_class(form, cls) is called once per
+// distinct form, in increasing form order, with the counts summed and the
+// representative of the first partial holding the form.
+template <typename F>
+void merge_partial_readers(std::vector<std::unique_ptr<PartialReader>>& readers, F&& on_class) {
+  // min-heap of readers by current form, ties by reader index
+  auto later = [&](unsigned a, unsigned b) {
+    int c = readers[a]->current_form().compare(readers[b]->current_form());
+    return c > 0 || (c == 0 && a > b);
+  };
+  std::priority_queue<unsigned, std::vector<unsigned>, decltype(later)> heap(later);
+  for (unsigned r = 0; r < readers.size(); r++) {
+    if (readers[r]->next()) {
+      heap.push(r);
+    }
+  }
+  std::string form;
+  CanonicalClass merged;
+  while (!heap.empty()) {
+    unsigned r = heap.top();
+    heap.pop();
+    form = readers[r]->current_form();
+    merged = readers[r]->current();
+    if (readers[r]->next()) {
+      heap.push(r);
+    }
+    while (!heap.empty() && readers[heap.top()]->current_form() == form) {
+      r = heap.top();
+      heap.pop();
+      merged.count += readers[r]->current().count;
+      if (readers[r]->next()) {
+        heap.push(r);
+      }
+    }
+    on_class(form, merged);
+  }
+}
+
+// merge_partial_readers() over the partial files named by filenames
+template <typename F>
+void merge_partials(const std::vector<std::string>& filenames, std::uint64_t plan_hash, bool edge_labels,
+                    F&& on_class) {
+  std::vector<std::unique_ptr<PartialReader>> readers;
+  for (auto& name: filenames) {
+    readers.emplace_back(new PartialReader(name, plan_hash, edge_labels));
+  }
+  merge_partial_readers(readers, on_class);
+}
@@ -1,5 +1,13 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
 
 struct PlanNode {
 	unsigned edge_start_idx;
@@ -15,6 +23,35 @@ struct PlanOperation{
     bool is_forward;
 };
 
+// Unlabeled pattern of a plan node, built while the plan is parsed. Patterns of
+// up to max_bitmask_vertices vertices also keep their adjacency as one word.
+const unsigned max_bitmask_vertices = 8;
+
+struct PlanPattern {
+  unsigned num_vertices = 0;
+  // bit src * max_bitmask_vertices + dst is set for every edge, while num_vertices <= max_bitmask_vertices
+  std::uint64_t adjacency = 0;
+  // edges in the order the plan adds them
+  std::vector<std::pair<unsigned, unsigned>> edges;
+
+  bool has_edge(unsigned src, unsigned dst) const {
+    if (this->num_vertices <= max_bitmask_vertices) {
+      return (this->adjacency >> (src * max_bitmask_vertices + dst)) & 1;
+    }
+    return std::find(this->edges.begin(), this->edges.end(), std::make_pair(src, dst)) != this->edges.end();
+  }
+
+  void add_edge(unsigned src, unsigned dst) {
+    if (has_edge(src, dst)) {
+      return;
+    }
+    this->edges.emplace_back(src, dst);
+    if (src < max_bitmask_vertices && dst < max_bitmask_vertices) {
+      this->adjacency |= std::uint64_t(1) << (src * max_bitmask_vertices + dst);
+    }
+  }
+};
+
 struct PlanEdge {
     unsigned id;
     const PlanNode* src;
@@ -27,6 +64,8 @@ public:
     unsigned root_node_id;
     std::vector<PlanEdge> edges;
     std::vector<PlanNode> nodes;
+    // patterns[i] is the pattern matched by nodes[i]
+    std::vector<PlanPattern> patterns;
 
 	Plan(std::string filename){
 	  std::ifstream file(filename);
@@ -65,6 +104,7 @@ public:
 		    }
 		    file.close();
 		}
+		build_patterns();
 	}
 
 	std::vector<unsigned> get_id_vertex_num() {
@@ -76,4 +116,48 @@ public:
 		}
 		return ret;
 	}
+
+	// whether each node is a query node; the others are intermediate steps of the plan
+	std::vector<bool> get_query_nodes() const {
+		std::vector<bool> ret;
+		for (auto& node: this->nodes) {
+			ret.push_back(node.is_query != 0);
+		}
+		return ret;
+	}
+
+private:
+	// the root matches one edge; every plan edge copies the pattern of its source
+	// node, adds a vertex if the child is larger and adds the edges of its operations
+	void build_patterns() {
+		this->patterns.assign(this->nodes.size(), PlanPattern());
+		if (this->root_node_id >= this->nodes.size()) {
+			return;
+		}
+		auto& root = this->patterns[this->root_node_id];
+		root.num_vertices = 2;
+		root.add_edge(0, 1);
+		std::queue<unsigned> q;
+		q.push(this->root_node_id);
+		while (!q.empty()) {
+			auto& cur_node = this->nodes[q.front()];
+			q.pop();
+			for (unsigned i = cur_node.edge_start_idx; i < cur_node.edge_start_idx + cur_node.num_edges; i++) {
+				auto& edge = this->edges[i];
+				auto& child = this->patterns[edge.dst->idx];
+				child = this->patterns[cur_node.idx];
+				if (cur_node.subgraph_num_vertices < edge.dst->subgraph_num_vertices) {
+					child.num_vertices++;
+				}
+				for (auto& opt: edge.operations) {
+					if (opt.is_forward) {
+						child.add_edge(opt.src_key, opt.dst_key);
+					} else {
+						child.add_edge(opt.dst_key, opt.src_key);
+					}
+				}
+				q.push(edge.dst->idx);
+			}
+		}
+	}
 };
\ No newline at end of file
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+
+#include "plan.hpp"
+#include "labeled_graph.hpp"
+
+// boost graph of every plan node's pattern, for printing and the VF2 path.
+// Edges are added in plan order, so they print as they always have.
+inline std::vector<Graph> get_id_graph_map_from_plan(const Plan& plan) {
+  std::vector<Graph> ret(plan.patterns.size());
+  for (unsigned i = 0; i < plan.patterns.size(); i++) {
+    auto& pattern = plan.patterns[i];
+    ret[i] = Graph(pattern.num_vertices);
+    for (auto& e: pattern.edges) {
+      boost::add_edge(e.first, e.second, ret[i]);
+    }
+  }
+  return ret;
+}
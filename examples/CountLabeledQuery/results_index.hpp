@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "automorphism.hpp"
+#include "canonical_form.hpp"
+#include "count_format.hpp"
+#include "count_reader.hpp"
+#include "output.hpp"
+
+// --output-format index: the classes of a run as a file that is mapped and
+// queried in place, see CountLabeledQueryLookup. Classes are sorted by
+// canonical form, so the count of a labeled pattern is one binary search on
+// the form of any of its raw keys. Posting lists give the classes of a plan
+// node holding a vertex label; they are keyed by the node group (see
+// get_node_groups()) so that a node finds the classes of all nodes isomorphic
+// to it.
+//
+//   header:   CountFileHeader with magic "CLQINDEX", flags as for partials
+//   sizes:    u64 num_classes, u64 num_terms, u64 num_postings, u64 forms_size
+//   classes:  IndexClass[num_classes], increasing by form
+//   labels:   u32[num_classes * max_width], a class's labels at
+//             class * max_width, padded to 8 bytes
+//   terms:    IndexTerm[num_terms + 1], increasing by (node, label); the
+//             postings of term t are [terms[t].begin, terms[t + 1].begin)
+//   postings: u32 class[num_postings], increasing within a term, padded to 8 bytes
+//   forms:    char[forms_size]
+
+const char results_index_magic[8] = {'C', 'L', 'Q', 'I', 'N', 'D', 'E', 'X'};
+// 2: forms of shapes beyond max_bitmask_vertices from refined_adjacency()
+const std::uint32_t results_index_version = 2;
+
+const std::uint32_t results_index_flag_edge_labels = 1;
+
+struct IndexClass {
+  std::uint64_t count;
+  std::uint64_t form_offset;
+  std::uint32_t form_size;
+  std::uint32_t node_id;
+};
+
+struct IndexTerm {
+  std::uint32_t node;
+  std::uint32_t label;
+  std::uint64_t begin;
+};
+
+// Collects the classes written to it and writes the index at finish(). Forms
+// are computed again from each class's representative key, which gives
+// Canonicalizer::class_form() whichever mode consolidated the classes.
+class IndexClassWriter : public ClassWriter {
+public:
+  IndexClassWriter(std::ostream& out, std::vector<PatternShape> shapes, bool edge_labels, std::uint64_t plan_hash)
+      : out(out), shapes(std::move(shapes)), edge_labels(edge_labels), plan_hash(plan_hash) {}
+
+  void write(const CanonicalClass& cls) override {
+    auto& shape = this->shapes[cls.node_id];
+    std::string form = canonical_form(shape, cls.labels.data(),
+                                      this->edge_labels ? cls.labels.data() + shape.num_vertices : nullptr);
+    auto found = this->classes.find(form);
+    if (found == this->classes.end()) {
+      this->classes.emplace(std::move(form), cls);
+    } else {
+      found->second.count += cls.count;
+    }
+  }
+
+  void marker(const std::string&) override {
+    throw std::runtime_error("index output has no epoch markers");
+  }
+
+  void finish() override {
+    unsigned max_width = 1;
+    for (auto& cls: this->classes) {
+      max_width = std::max<unsigned>(max_width, cls.second.labels.size());
+    }
+    std::vector<unsigned> representative = get_node_groups(this->shapes, this->edge_labels).representative;
+    std::vector<IndexClass> records;
+    std::vector<std::uint32_t> labels;
+    std::map<std::pair<std::uint32_t, std::uint32_t>, std::vector<std::uint32_t>> postings;
+    std::string forms;
+    for (auto& entry: this->classes) {
+      auto& cls = entry.second;
+      const std::uint32_t id = records.size();
+      records.push_back(IndexClass{cls.count, forms.size(), static_cast<std::uint32_t>(entry.first.size()),
+                                   cls.node_id});
+      forms += entry.first;
+      labels.insert(labels.end(), cls.labels.begin(), cls.labels.end());
+      labels.resize(labels.size() + max_width - cls.labels.size(), 0);
+      for (unsigned i = 0; i < this->shapes[cls.node_id].num_vertices; i++) {
+        auto& list = postings[std::make_pair(representative[cls.node_id], cls.labels[i])];
+        if (list.empty() || list.back() != id) {
+          list.push_back(id);
+        }
+      }
+    }
+    std::vector<IndexTerm> terms;
+    std::vector<std::uint32_t> posting_ids;
+    for (auto& term: postings) {
+      terms.push_back(IndexTerm{term.first.first, term.first.second, posting_ids.size()});
+      posting_ids.insert(posting_ids.end(), term.second.begin(), term.second.end());
+    }
+    terms.push_back(IndexTerm{~std::uint32_t(0), ~std::uint32_t(0), posting_ids.size()});
+
+    CountFileHeader header;
+    std::memcpy(header.magic, results_index_magic, sizeof(header.magic));
+    header.version = results_index_version;
+    header.max_width = max_width;
+    header.plan_hash = this->plan_hash;
+    header.flags = this->edge_labels ? results_index_flag_edge_labels : 0;
+    header.reserved = 0;
+    put(&header, sizeof(header));
+    const std::uint64_t sizes[4] = {records.size(), terms.size() - 1, posting_ids.size(), forms.size()};
+    put(sizes, sizeof(sizes));
+    put(records.data(), records.size() * sizeof(IndexClass));
+    put_padded(labels.data(), labels.size() * sizeof(std::uint32_t));
+    put(terms.data(), terms.size() * sizeof(IndexTerm));
+    put_padded(posting_ids.data(), posting_ids.size() * sizeof(std::uint32_t));
+    put(forms.data(), forms.size());
+  }
+
+private:
+  std::ostream& out;
+  std::vector<PatternShape> shapes;
+  bool edge_labels;
+  std::uint64_t plan_hash;
+  // ordered by form, the order of the index
+  std::map<std::string, CanonicalClass> classes;
+
+  void put(const void* data, std::size_t size) {
+    this->out.write(static_cast<const char*>(data), size);
+  }
+
+  void put_padded(const void* data, std::size_t size) {
+    static const char zeros[8] = {0};
+    put(data, size);
+    put(zeros, (8 - size % 8) % 8);
+  }
+};
+
+// A mapped results index. Lookups read the mapping in place and allocate
+// nothing but their results.
+class ResultsIndex {
+public:
+  ResultsIndex(const std::string& filename) : file(filename) {
+    if (!this->file.mapped()) {
+      throw std::runtime_error(filename + ": indexes must be regular, non-empty files");
+    }
+    const char* p = this->file.begin();
+    const char* end = this->file.end();
+    auto corrupt = [&]() {
+      return std::runtime_error(filename + ": corrupt results index");
+    };
+    CountFileHeader header;
+    std::uint64_t sizes[4];
+    if (static_cast<std::size_t>(end - p) < sizeof(header) + sizeof(sizes)) {
+      throw corrupt();
+    }
+    std::memcpy(&header, p, sizeof(header));
+    if (std::memcmp(header.magic, results_index_magic, sizeof(header.magic)) != 0) {
+      throw std::runtime_error(filename + ": not a results index");
+    }
+    if (header.version != results_index_version) {
+      throw std::runtime_error(filename + ": unsupported results index version " + std::to_string(header.version));
+    }
+    std::memcpy(sizes, p + sizeof(header), sizeof(sizes));
+    p += sizeof(header) + sizeof(sizes);
+    this->header = header;
+    this->num_classes = sizes[0];
+    this->num_terms = sizes[1];
+    auto padded = [](std::uint64_t size) {
+      return (size + 7) / 8 * 8;
+    };
+    const std::uint64_t lengths[5] = {sizes[0] * sizeof(IndexClass),
+                                      padded(sizes[0] * header.max_width * sizeof(std::uint32_t)),
+                                      (sizes[1] + 1) * sizeof(IndexTerm),
+                                      padded(sizes[2] * sizeof(std::uint32_t)), sizes[3]};
+    std::uint64_t total = 0;
+    for (auto length: lengths) {
+      total += length;
+    }
+    if (header.max_width == 0 || total != static_cast<std::uint64_t>(end - p)) {
+      throw corrupt();
+    }
+    this->classes = reinterpret_cast<const IndexClass*>(p);
+    this->labels = reinterpret_cast<const std::uint32_t*>(p += lengths[0]);
+    this->terms = reinterpret_cast<const IndexTerm*>(p += lengths[1]);
+    this->postings = reinterpret_cast<const std::uint32_t*>(p += lengths[2]);
+    this->forms = p + lengths[3];
+    for (std::size_t i = 0; i < this->num_classes; i++) {
+      if (this->classes[i].form_offset + this->classes[i].form_size > sizes[3]) {
+        throw corrupt();
+      }
+    }
+    for (std::size_t t = 0; t < this->num_terms; t++) {
+      if (this->terms[t].begin > this->terms[t + 1].begin || this->terms[t + 1].begin > sizes[2]) {
+        throw corrupt();
+      }
+    }
+  }
+
+  ResultsIndex(const ResultsIndex&) = delete;
+  ResultsIndex& operator=(const ResultsIndex&) = delete;
+
+  std::uint64_t plan_hash() const {
+    return this->header.plan_hash;
+  }
+
+  bool edge_labels() const {
+    return (this->header.flags & results_index_flag_edge_labels) != 0;
+  }
+
+  std::size_t size() const {
+    return this->num_classes;
+  }
+
+  std::uint64_t count(std::size_t c) const {
+    return this->classes[c].count;
+  }
+
+  // the representative key of class c: its node and width labels
+  unsigned node_id(std::size_t c) const {
+    return this->classes[c].node_id;
+  }
+
+  const std::uint32_t* class_labels(std::size_t c) const {
+    return this->labels + c * this->header.max_width;
+  }
+
+  std::string form(std::size_t c) const {
+    return std::string(this->forms + this->classes[c].form_offset, this->classes[c].form_size);
+  }
+
+  // the class of a canonical form, size() if there is none
+  std::size_t find(const std::string& form) const {
+    std::size_t lo = 0, hi = this->num_classes;
+    while (lo < hi) {
+      std::size_t mid = lo + (hi - lo) / 2;
+      if (compare(mid, form) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo < this->num_classes && compare(lo, form) == 0 ? lo : this->num_classes;
+  }
+
+  // The classes of node group node holding every one of the vertex labels, in
+  // form order. node is a group representative, see get_node_groups().
+  std::vector<std::uint32_t> classes_with(unsigned node, const std::vector<unsigned>& labels) const {
+    std::vector<std::uint32_t> ret;
+    for (unsigned i = 0; i < labels.size(); i++) {
+      const IndexTerm* begin = this->terms;
+      const IndexTerm* end = this->terms + this->num_terms;
+      const IndexTerm* term = std::lower_bound(begin, end, std::make_pair(node, labels[i]),
+                                               [](const IndexTerm& t, std::pair<unsigned, unsigned> key) {
+        return t.node < key.first || (t.node == key.first && t.label < key.second);
+      });
+      if (term == end || term->node != node || term->label != labels[i]) {
+        return {};
+      }
+      const std::uint32_t* list = this->postings + term->begin;
+      const std::uint32_t* list_end = this->postings + (term + 1)->begin;
+      if (i == 0) {
+        ret.assign(list, list_end);
+      } else {
+        std::vector<std::uint32_t> both;
+        std::set_intersection(ret.begin(), ret.end(), list, list_end, std::back_inserter(both));
+        ret.swap(both);
+      }
+    }
+    return ret;
+  }
+
+private:
+  MappedFile file;
+  CountFileHeader header;
+  std::size_t num_classes;
+  std::size_t num_terms;
+  const IndexClass* classes;
+  const std::uint32_t* labels;
+  const IndexTerm* terms;
+  const std::uint32_t* postings;
+  const char* forms;
+
+  int compare(std::size_t c, const std::string& form) const {
+    auto& cls = this->classes[c];
+    int ret = std::memcmp(this->forms + cls.form_offset, form.data(), std::min<std::size_t>(cls.form_size, form.size()));
+    if (ret != 0) {
+      return ret;
+    }
+    return cls.form_size < form.size() ? -1 : cls.form_size > form.size() ? 1 : 0;
+  }
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "consolidate.hpp"
+#include "label_dictionary.hpp"
+#include "parallel_count.hpp"
+
+// --engine sort: aggregation by sorting instead of hashing. Records are parsed
+// into flat per-node arrays of packed keys and counts in input order, each
+// array is radix-sorted by key and run-length reduced: the last record of a
+// key wins since the sort is stable. Consolidation maps the distinct keys to
+// their canonical labels per node group, sorts again and sums the runs, so
+// hashing is left only for the classes themselves. Memory is 16 bytes per record rather than
+// per distinct key.
+
+struct KeyCount {
+  std::uint64_t key;
+  std::uint64_t count;
+};
+
+// Stable LSD radix sort by key over the low key_bits bits, 8 bits a pass;
+// passes whose digit is the same for every key are skipped.
+inline void radix_sort_keys(std::vector<KeyCount>& items, unsigned key_bits) {
+  std::vector<KeyCount> buffer(items.size());
+  for (unsigned shift = 0; shift < key_bits; shift += 8) {
+    std::size_t counts[256] = {0};
+    for (auto& item: items) {
+      counts[(item.key >> shift) & 0xff]++;
+    }
+    if (std::count(std::begin(counts), std::end(counts), items.size()) == 1) {
+      continue;
+    }
+    std::size_t offset = 0;
+    for (auto& count: counts) {
+      std::size_t n = count;
+      count = offset;
+      offset += n;
+    }
+    for (auto& item: items) {
+      buffer[counts[(item.key >> shift) & 0xff]++] = item;
+    }
+    items.swap(buffer);
+  }
+}
+
+// equal keys of sorted items reduced to one: the last count with take_last,
+// the sum otherwise
+inline void reduce_sorted_keys(std::vector<KeyCount>& items, bool take_last) {
+  std::size_t out = 0;
+  for (std::size_t i = 0; i < items.size(); i++) {
+    if (out > 0 && items[out - 1].key == items[i].key) {
+      items[out - 1].count = take_last ? items[i].count : items[out - 1].count + items[i].count;
+    } else {
+      items[out++] = items[i];
+    }
+  }
+  items.resize(out);
+  items.shrink_to_fit();
+}
+
+// Deduplicated raw counts of --engine sort: per plan node, the distinct packed
+// keys in increasing order with the count of their last record
+struct SortedRawCounts {
+  std::vector<unsigned> widths;
+  const LabelDictionary* dictionary;
+  std::vector<std::vector<KeyCount>> nodes;
+
+  std::size_t size() const {
+    std::size_t ret = 0;
+    for (auto& node: this->nodes) {
+      ret += node.size();
+    }
+    return ret;
+  }
+
+  std::size_t memory_bytes() const {
+    std::size_t ret = 0;
+    for (auto& node: this->nodes) {
+      ret += node.capacity() * sizeof(KeyCount);
+    }
+    return ret;
+  }
+};
+
+// whether every node's keys pack with the dictionary
+inline bool sort_engine_packs(const std::vector<unsigned>& widths, const LabelDictionary& dictionary) {
+  for (auto width: widths) {
+    if (!dictionary.packs(width)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses a mapped count input with num_threads workers into sorted, reduced
+// per-node arrays. Every node's keys must pack, see sort_engine_packs().
+inline SortedRawCounts sort_raw_count(const std::string& filename, const std::vector<unsigned>& widths,
+                                      std::uint64_t plan_hash, const std::vector<bool>& counted, unsigned num_threads,
+                                      const LabelDictionary& dictionary, std::uint64_t* num_records = nullptr) {
+  CountChunks chunks(filename, num_threads);
+  if (!chunks.mapped()) {
+    throw std::runtime_error("the sort engine needs regular count files");
+  }
+  // parts[c][node_id] holds the records of chunk c for the node, in input order
+  std::vector<std::vector<std::vector<KeyCount>>> parts(chunks.size(),
+                                                        std::vector<std::vector<KeyCount>>(widths.size()));
+  auto chunk_records = chunks.parse(widths, plan_hash, counted, num_threads,
+                                    [&](std::size_t c, unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    parts[c][node_id].push_back(KeyCount{dictionary.pack(labels, widths[node_id]), count});
+  });
+  if (num_records != nullptr) {
+    *num_records = 0;
+    for (auto n: chunk_records) {
+      *num_records += n;
+    }
+  }
+  SortedRawCounts ret{widths, &dictionary, std::vector<std::vector<KeyCount>>(widths.size())};
+  run_workers(num_threads, [&](unsigned worker) {
+    for (unsigned node_id = worker; node_id < widths.size(); node_id += num_threads) {
+      auto& items = ret.nodes[node_id];
+      std::size_t total = 0;
+      for (auto& part: parts) {
+        total += part[node_id].size();
+      }
+      items.reserve(total);
+      for (auto& part: parts) {
+        items.insert(items.end(), part[node_id].begin(), part[node_id].end());
+        std::vector<KeyCount>().swap(part[node_id]);
+      }
+      radix_sort_keys(items, widths[node_id] * dictionary.bits());
+      reduce_sorted_keys(items, true);
+    }
+  });
+  return ret;
+}
+
+// Classes of sorted raw counts: with automorphisms the keys of every node of a
+// node group are replaced by their canonical labels in the group's layout,
+// sorted and summed, and each group class then adds to the class of its
+// canonical form.
+inline ClassMap consolidate_sorted(const SortedRawCounts& raw, const Canonicalizer& canonicalizer,
+                                   unsigned num_threads) {
+  auto& dictionary = *raw.dictionary;
+  std::vector<ClassMap> partial(num_threads);
+  run_workers(num_threads, [&](unsigned worker) {
+    for (unsigned r = worker; r < raw.nodes.size(); r += num_threads) {
+      if (canonicalizer.representative[r] != r) {
+        continue;
+      }
+      const unsigned width = raw.widths[r];
+      std::vector<unsigned> labels(width);
+      const std::vector<KeyCount>* keys = &raw.nodes[r];
+      std::vector<KeyCount> group_classes;
+      if (canonicalizer.use_automorphisms) {
+        for (unsigned node_id = r; node_id < raw.nodes.size(); node_id++) {
+          if (canonicalizer.representative[node_id] != r) {
+            continue;
+          }
+          CanonicalBatch<> batch(canonicalizer.automorphisms[node_id]);
+          auto add = [&](const unsigned* labels, std::uint64_t count) {
+            group_classes.push_back(KeyCount{dictionary.pack(labels, width), count});
+          };
+          for (auto& item: raw.nodes[node_id]) {
+            dictionary.unpack(item.key, width, labels.data());
+            batch.add(labels.data(), item.count, add);
+          }
+          batch.flush(add);
+        }
+        radix_sort_keys(group_classes, width * dictionary.bits());
+        reduce_sorted_keys(group_classes, false);
+        keys = &group_classes;
+      }
+      for (auto& item: *keys) {
+        dictionary.unpack(item.key, width, labels.data());
+        add_canonical_class(partial[worker], canonicalizer.class_form(r, labels.data()), r, labels.data(), width,
+                            item.count);
+      }
+    }
+  });
+  ClassMap ret;
+  for (auto& classes: partial) {
+    if (ret.empty()) {
+      ret.swap(classes);
+    } else {
+      merge_classes(ret, classes);
+    }
+  }
+  return ret;
+}
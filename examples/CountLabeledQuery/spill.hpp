@@ -0,0 +1,434 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <ostream>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "consolidate.hpp"
+#include "count_reader.hpp"
+#include "output.hpp"
+#include "partial.hpp"
+
+// --mem-limit: last-write-wins raw counts in bounded memory. The raw table is
+// sorted by key and spilled to a run file whenever it passes its budget, and
+// the runs are merged at the end, the latest run winning for a key that is in
+// several. Run files are unlinked as soon as they are created and vanish with
+// their descriptors.
+//
+//   run record: u32 node_id, u32 labels[widths[node_id]], u64 count
+//
+// Records are sorted by node_id, then labels.
+
+// reads one run back in large blocks
+class SpillRunReader {
+public:
+  SpillRunReader(int fd, const std::vector<unsigned>& widths, std::size_t buffer_size)
+      : fd(fd), widths(widths), buffer(buffer_size) {
+    unsigned max_width = *std::max_element(widths.begin(), widths.end());
+    this->labels.resize(max_width);
+  }
+
+  // the next record into node_id, labels and count, false at the end of the run
+  bool next() {
+    if (!take(&this->node_id, sizeof(this->node_id))) {
+      return false;
+    }
+    if (this->node_id >= this->widths.size() || !take(this->labels.data(), this->widths[this->node_id] * sizeof(unsigned)) ||
+        !take(&this->count, sizeof(this->count))) {
+      throw std::runtime_error("corrupt spill run");
+    }
+    return true;
+  }
+
+  // orders the current records of two readers by key
+  bool key_less(const SpillRunReader& other) const {
+    if (this->node_id != other.node_id) {
+      return this->node_id < other.node_id;
+    }
+    const unsigned width = this->widths[this->node_id];
+    return std::lexicographical_compare(this->labels.begin(), this->labels.begin() + width, other.labels.begin(),
+                                        other.labels.begin() + width);
+  }
+
+  bool key_equal(const SpillRunReader& other) const {
+    return this->node_id == other.node_id &&
+           std::equal(this->labels.begin(), this->labels.begin() + this->widths[this->node_id], other.labels.begin());
+  }
+
+  std::uint32_t node_id;
+  std::vector<unsigned> labels;
+  std::uint64_t count;
+
+private:
+  int fd;
+  const std::vector<unsigned>& widths;
+  std::vector<char> buffer;
+  std::size_t pos = 0;
+  std::size_t end = 0;
+  off_t offset = 0;
+
+  // false at a clean end of the run
+  bool take(void* into, std::size_t size) {
+    char* out = static_cast<char*>(into);
+    while (size > 0) {
+      if (this->pos == this->end) {
+        ssize_t n = ::pread(this->fd, this->buffer.data(), this->buffer.size(), this->offset);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0) {
+          throw std::runtime_error("couldn't read spill run");
+        }
+        if (n == 0) {
+          if (out != into) {
+            throw std::runtime_error("truncated spill run");
+          }
+          return false;
+        }
+        this->offset += n;
+        this->pos = 0;
+        this->end = n;
+      }
+      std::size_t n = std::min(size, this->end - this->pos);
+      std::memcpy(out, this->buffer.data() + this->pos, n);
+      this->pos += n;
+      out += n;
+      size -= n;
+    }
+    return true;
+  }
+};
+
+class SpillingRawCount {
+public:
+  // mem_limit bounds the raw table and the sort buffer of a spill together
+  SpillingRawCount(const std::vector<unsigned>& widths, std::size_t mem_limit, const std::string& spill_dir,
+                   const LabelDictionary* dictionary = nullptr)
+      : widths(widths), mem_limit(mem_limit), spill_dir(spill_dir), dictionary(dictionary),
+        table(widths, dictionary) {}
+
+  ~SpillingRawCount() {
+    for (int fd: this->runs) {
+      ::close(fd);
+    }
+  }
+
+  SpillingRawCount(const SpillingRawCount&) = delete;
+  SpillingRawCount& operator=(const SpillingRawCount&) = delete;
+
+  void set(unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    this->table(node_id, labels) = count;
+    if (--this->until_check == 0) {
+      this->until_check = check_interval;
+      // the table keeps about half the budget, the rest is for sorting it
+      if (this->table.memory_bytes() > this->mem_limit / 2) {
+        spill();
+      }
+    }
+  }
+
+  std::size_t num_runs() const {
+    return this->runs.size();
+  }
+
+  std::uint64_t spilled_bytes() const {
+    return this->num_spilled_bytes;
+  }
+
+  // the in-memory table when nothing was spilled
+  RawCountMap& in_memory() {
+    return this->table;
+  }
+
+  // Calls f(node_id, labels, count) once per distinct key, in key order, with
+  // the count of the key's last record. Spills what is still in memory first.
+  template <typename F>
+  void merge(F&& f) {
+    if (!this->table.empty()) {
+      spill();
+    }
+    if (this->runs.empty()) {
+      return;
+    }
+    // the read buffers share the budget
+    std::size_t buffer_size = this->mem_limit / 2 / this->runs.size();
+    buffer_size = std::max<std::size_t>(1 << 14, std::min<std::size_t>(1 << 20, buffer_size));
+    std::vector<std::unique_ptr<SpillRunReader>> readers;
+    for (int fd: this->runs) {
+      readers.emplace_back(new SpillRunReader(fd, this->widths, buffer_size));
+    }
+    // min-heap by key, the latest run first among equal keys
+    auto later = [&](unsigned a, unsigned b) {
+      if (readers[b]->key_less(*readers[a])) {
+        return true;
+      }
+      return !readers[a]->key_less(*readers[b]) && a < b;
+    };
+    std::priority_queue<unsigned, std::vector<unsigned>, decltype(later)> heap(later);
+    for (unsigned r = 0; r < readers.size(); r++) {
+      if (readers[r]->next()) {
+        heap.push(r);
+      }
+    }
+    while (!heap.empty()) {
+      unsigned r = heap.top();
+      heap.pop();
+      auto& latest = *readers[r];
+      f(static_cast<unsigned>(latest.node_id), static_cast<const unsigned*>(latest.labels.data()), latest.count);
+      // older records of the key
+      while (!heap.empty() && readers[heap.top()]->key_equal(latest)) {
+        unsigned older = heap.top();
+        heap.pop();
+        if (readers[older]->next()) {
+          heap.push(older);
+        }
+      }
+      if (latest.next()) {
+        heap.push(r);
+      }
+    }
+  }
+
+private:
+  static const unsigned check_interval = 4096;
+
+  const std::vector<unsigned>& widths;
+  std::size_t mem_limit;
+  std::string spill_dir;
+  const LabelDictionary* dictionary;
+  RawCountMap table;
+  unsigned until_check = check_interval;
+  std::vector<int> runs;
+  std::uint64_t num_spilled_bytes = 0;
+
+  // writes the table as a sorted run and empties it
+  void spill() {
+    std::string path = this->spill_dir + "/clq-spill-XXXXXX";
+    int fd = ::mkstemp(&path[0]);
+    if (fd < 0) {
+      throw std::runtime_error("couldn't create a spill run in " + this->spill_dir);
+    }
+    ::unlink(path.c_str());
+    this->runs.push_back(fd);
+    {
+      FdOutputBuffer buffer(fd);
+      std::ostream out(&buffer);
+      this->table.for_each_node([&](unsigned node_id, const auto& node_table) {
+        const unsigned width = node_table.width();
+        std::vector<unsigned> labels;
+        std::vector<std::uint64_t> counts;
+        labels.reserve(node_table.size() * width);
+        counts.reserve(node_table.size());
+        node_table.for_each([&](const unsigned* key, std::uint64_t count) {
+          labels.insert(labels.end(), key, key + width);
+          counts.push_back(count);
+        });
+        std::vector<std::uint32_t> order(counts.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+          const unsigned* key_a = &labels[std::size_t(a) * width];
+          const unsigned* key_b = &labels[std::size_t(b) * width];
+          return std::lexicographical_compare(key_a, key_a + width, key_b, key_b + width);
+        });
+        std::uint32_t id = node_id;
+        for (auto i: order) {
+          out.write(reinterpret_cast<const char*>(&id), sizeof(id));
+          out.write(reinterpret_cast<const char*>(&labels[std::size_t(i) * width]), width * sizeof(unsigned));
+          out.write(reinterpret_cast<const char*>(&counts[i]), sizeof(counts[i]));
+        }
+      });
+      if (!out.flush()) {
+        throw std::runtime_error("couldn't write a spill run in " + this->spill_dir);
+      }
+    }
+    this->num_spilled_bytes += ::lseek(fd, 0, SEEK_END);
+    this->table = RawCountMap(this->widths, this->dictionary);
+  }
+};
+
+// Classes of a stream of deduplicated raw keys in bounded memory. With
+// automorphisms the keys are first summed per class of their plan node group,
+// and those per-group totals are folded into the class map whenever they pass
+// the budget. The class map in turn is written out as a sorted partial run (see
+// partial.hpp) when it passes the budget, and the runs are merged by form at
+// the end. Runs are unlinked on creation, as the raw runs are.
+class StreamingConsolidation {
+public:
+  StreamingConsolidation(const Canonicalizer& canonicalizer, const std::vector<unsigned>& widths,
+                         std::size_t mem_limit, const std::string& spill_dir, std::uint64_t plan_hash,
+                         const LabelDictionary* dictionary = nullptr)
+      : canonicalizer(canonicalizer), widths(widths), mem_limit(mem_limit), spill_dir(spill_dir),
+        plan_hash(plan_hash), dictionary(dictionary), node_classes(widths, dictionary), node_labels(widths.size()) {
+    for (unsigned node_id = 0; node_id < widths.size(); node_id++) {
+      this->node_labels[node_id].resize(widths[node_id]);
+    }
+    // a class map entry: the node, its form and its representative labels
+    unsigned max_width = *std::max_element(widths.begin(), widths.end());
+    this->class_bytes = sizeof(ClassMap::value_type) + 4 * sizeof(void*) + 16 + 8 * max_width;
+  }
+
+  ~StreamingConsolidation() {
+    for (int fd: this->runs) {
+      ::close(fd);
+    }
+  }
+
+  StreamingConsolidation(const StreamingConsolidation&) = delete;
+  StreamingConsolidation& operator=(const StreamingConsolidation&) = delete;
+
+  void add(unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    if (this->canonicalizer.use_automorphisms) {
+      unsigned* key = this->node_labels[node_id].data();
+      canonical_labels(this->canonicalizer.automorphisms[node_id], labels, key);
+      this->node_classes(this->canonicalizer.representative[node_id], key) += count;
+      if (--this->until_check == 0) {
+        this->until_check = check_interval;
+        if (this->node_classes.memory_bytes() > this->mem_limit / 2) {
+          fold();
+        }
+      }
+    } else {
+      add_class(node_id, labels, count);
+    }
+  }
+
+  // false if every class is still in memory
+  bool spilled() {
+    fold();
+    return !this->runs.empty();
+  }
+
+  std::size_t num_runs() const {
+    return this->runs.size();
+  }
+
+  // the classes when nothing was spilled
+  ClassMap take() {
+    fold();
+    return std::move(this->classes);
+  }
+
+  // on_class(form, cls) once per class in form order, as merge_partials
+  template <typename F>
+  void merge(bool edge_labels, F&& on_class) {
+    fold();
+    if (!this->classes.empty()) {
+      spill();
+    }
+    std::vector<std::unique_ptr<PartialReader>> readers;
+    for (int fd: this->runs) {
+      readers.emplace_back(new PartialReader(fd, this->spill_dir + "/clq-classes run", this->plan_hash, edge_labels));
+    }
+    merge_partial_readers(readers, on_class);
+  }
+
+private:
+  static const unsigned check_interval = 4096;
+
+  const Canonicalizer& canonicalizer;
+  const std::vector<unsigned>& widths;
+  std::size_t mem_limit;
+  std::string spill_dir;
+  std::uint64_t plan_hash;
+  const LabelDictionary* dictionary;
+  RawCountMap node_classes;
+  std::vector<std::vector<unsigned>> node_labels;
+  ClassMap classes;
+  std::size_t class_bytes;
+  unsigned until_check = check_interval;
+  unsigned until_class_check = check_interval;
+  std::vector<int> runs;
+
+  void add_class(unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    add_canonical_class(this->classes, this->canonicalizer.class_form(node_id, labels), node_id, labels,
+                        this->widths[node_id], count);
+    if (--this->until_class_check == 0) {
+      this->until_class_check = check_interval;
+      if (this->classes.size() * this->class_bytes > this->mem_limit / 2) {
+        spill();
+      }
+    }
+  }
+
+  // moves the per-group totals, keyed by canonical labels already, to the class map
+  void fold() {
+    if (this->node_classes.empty()) {
+      return;
+    }
+    this->node_classes.for_each([&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+      add_class(node_id, labels, count);
+    });
+    this->node_classes = RawCountMap(this->widths, this->dictionary);
+  }
+
+  void spill() {
+    std::string path = this->spill_dir + "/clq-classes-XXXXXX";
+    int fd = ::mkstemp(&path[0]);
+    if (fd < 0) {
+      throw std::runtime_error("couldn't create a spill run in " + this->spill_dir);
+    }
+    ::unlink(path.c_str());
+    this->runs.push_back(fd);
+    {
+      FdOutputBuffer buffer(fd);
+      std::ostream out(&buffer);
+      unsigned max_width = *std::max_element(this->widths.begin(), this->widths.end());
+      PartialWriter writer(out, this->plan_hash, max_width, this->canonicalizer.edge_labels);
+      write_partial(writer, this->classes);
+      if (!out.flush()) {
+        throw std::runtime_error("couldn't write a spill run in " + this->spill_dir);
+      }
+    }
+    ClassMap().swap(this->classes);
+  }
+};
+
+// Reads the count files of input in order into raw, in blocks rather than
+// mapped so that the input does not add to the resident set
+inline std::uint64_t read_spilling_raw_count(const std::string& input, const std::vector<unsigned>& widths,
+                                             std::uint64_t plan_hash, const std::vector<bool>& counted,
+                                             SpillingRawCount& raw) {
+  std::vector<std::string> filenames = list_count_files(input);
+  std::uint64_t num_records = 0;
+  for (auto& filename: filenames) {
+    CountRecordParser parser(widths, plan_hash, counted);
+    auto on_record = [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+      raw.set(node_id, labels, count);
+    };
+    int fd = filename == "-" ? 0 : ::open(filename.c_str(), O_RDONLY);
+    try {
+      if (fd < 0) {
+        throw std::runtime_error("couldn't open " + filename);
+      }
+      read_count_descriptor(fd, filename, [&](const char* begin, const char* end) {
+        parser.feed(begin, end, on_record);
+      });
+      parser.finish(on_record);
+    } catch (const std::runtime_error& e) {
+      if (fd > 0) {
+        ::close(fd);
+      }
+      if (filenames.size() == 1) {
+        throw;
+      }
+      throw std::runtime_error(filename + ": " + e.what());
+    }
+    if (fd > 0) {
+      ::close(fd);
+    }
+    num_records += parser.records();
+  }
+  return num_records;
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "consolidate.hpp"
+#include "count_reader.hpp"
+
+// Opens a live count stream for reading: "-" is stdin, "tcp:HOST:PORT" connects
+// to a producer listening on HOST:PORT, anything else is opened as a path (a
+// FIFO or a file that is still being written).
+inline int open_count_stream(const std::string& name) {
+  if (name == "-") {
+    return 0;
+  }
+  if (name.compare(0, 4, "tcp:") != 0) {
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("couldn't open " + name);
+    }
+    return fd;
+  }
+  std::size_t colon = name.rfind(':');
+  if (colon <= 4) {
+    throw std::runtime_error("expected tcp:HOST:PORT");
+  }
+  std::string host = name.substr(4, colon - 4);
+  std::string port = name.substr(colon + 1);
+  struct addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addrs = nullptr;
+  if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+    throw std::runtime_error("couldn't resolve " + host);
+  }
+  int fd = -1;
+  for (struct addrinfo* addr = addrs; addr != nullptr && fd < 0; addr = addr->ai_next) {
+    fd = ::socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd >= 0 && ::connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+  ::freeaddrinfo(addrs);
+  if (fd < 0) {
+    throw std::runtime_error("couldn't connect to " + host + ":" + port);
+  }
+  return fd;
+}
+
+// Running per-class totals over a stream of cumulative count records.
+//
+// Each record replaces the previous count of its raw key, as in the batch path,
+// and the difference is added to the key's class. The class of a raw key is
+// resolved once and cached, so later records of the key only cost two table
+// lookups. Counts are unsigned; a count that goes down wraps around in the
+// delta and the class total still comes out right.
+class IncrementalClassCounts {
+public:
+  // with a dictionary the raw and class tables pack keys, see FlatCountTable
+  IncrementalClassCounts(const Canonicalizer& canonicalizer, const std::vector<unsigned>& widths,
+                         const LabelDictionary* dictionary = nullptr)
+      : canonicalizer(canonicalizer), raw_count(widths, dictionary), class_of(widths, dictionary),
+        node_labels(widths.size()) {
+    for (unsigned node_id = 0; node_id < widths.size(); node_id++) {
+      this->node_labels[node_id].resize(widths[node_id]);
+    }
+  }
+
+  void add(unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    std::uint64_t& last = this->raw_count(node_id, labels);
+    std::uint64_t delta = count - last;
+    last = count;
+    if (delta == 0) {
+      return;
+    }
+    // within a node group, keys with the same canonical labels share a class
+    const unsigned* key = labels;
+    const unsigned r = this->canonicalizer.representative[node_id];
+    if (this->canonicalizer.use_automorphisms) {
+      canonical_labels(this->canonicalizer.automorphisms[node_id], labels, this->node_labels[node_id].data());
+      key = this->node_labels[node_id].data();
+    }
+    // class index + 1, 0 until the key's class is known
+    std::uint64_t& index = this->class_of(r, key);
+    if (index == 0) {
+      index = find_or_add_class(r, key) + 1;
+    }
+    auto& cls = this->classes[index - 1];
+    cls.count += delta;
+    if (!this->changed[index - 1]) {
+      this->changed[index - 1] = true;
+      this->changed_classes.push_back(index - 1);
+    }
+  }
+
+  // f(cls, class_id) for every class whose total differs from when it was
+  // last reported; class_id numbers the classes by first appearance
+  template <typename F>
+  void for_each_changed(F&& f) {
+    for (auto index: this->changed_classes) {
+      this->changed[index] = false;
+      if (this->classes[index].count != this->reported[index]) {
+        this->reported[index] = this->classes[index].count;
+        f(this->classes[index], static_cast<std::uint64_t>(index));
+      }
+    }
+    this->changed_classes.clear();
+  }
+
+  std::size_t num_classes() const {
+    return this->classes.size();
+  }
+
+  std::size_t num_raw_keys() const {
+    return this->raw_count.size();
+  }
+
+private:
+  const Canonicalizer& canonicalizer;
+  RawCountMap raw_count;
+  FlatCountTable class_of;
+  std::vector<std::vector<unsigned>> node_labels;
+  std::unordered_map<std::string, std::size_t> class_index;
+  std::vector<CanonicalClass> classes;
+  std::vector<std::uint64_t> reported;
+  std::vector<bool> changed;
+  std::vector<std::size_t> changed_classes;
+
+  std::size_t find_or_add_class(unsigned node_id, const unsigned* labels) {
+    auto found = this->class_index.emplace(this->canonicalizer.class_form(node_id, labels), this->classes.size());
+    if (found.second) {
+      std::vector<unsigned> representative(labels, labels + this->node_labels[node_id].size());
+      this->classes.push_back(CanonicalClass{node_id, std::move(representative), 0});
+      this->reported.push_back(0);
+      this->changed.push_back(false);
+    }
+    return found.first->second;
+  }
+};
+
+// Reads count records from stream as they arrive and keeps the class totals
+// up to date. on_epoch(marker) is called at every marker line so that the
+// caller can report classes.for_each_changed(), and once more with an empty
+// marker at the end of the stream.
+//
+// The producer sends text count records, "node_id label... count\n" with
+// cumulative counts, and a "#..." marker line whenever its totals are
+// consistent, e.g. "#epoch 3\n" after its fourth batch. Only records whose count
+// changed since the last marker need to be sent. The dataflow examples write
+// this with epochs=PATH or epochs=tcp:PORT (src/wings_plan/count_stream.rs).
+template <typename F>
+void follow_count_stream(const std::string& stream, CountRecordParser& parser, IncrementalClassCounts& classes,
+                         F&& on_epoch) {
+  int fd = open_count_stream(stream);
+  auto on_record = [&](unsigned node_id, const unsigned* labels, std::uint64_t count) {
+    classes.add(node_id, labels, count);
+  };
+  std::vector<char> block(1 << 16);
+  ssize_t n;
+  // a follower runs for as long as its producer, signals must not end it
+  while ((n = ::read(fd, block.data(), block.size())) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      break;
+    }
+    parser.feed(block.data(), block.data() + n, on_record, on_epoch);
+  }
+  if (fd > 0) {
+    ::close(fd);
+  }
+  if (n < 0) {
+    throw std::runtime_error("couldn't read " + stream);
+  }
+  parser.finish(on_record, on_epoch);
+  on_epoch(std::string());
+}
@@ -27,18 +27,41 @@ fn main () {
     let send = Arc::new(Mutex::new(0));
     let send2 = send.clone();
     let labeled_query_count = Arc::new(RwLock::new(HashMap::new()));
+    #[cfg(not(feature = "countlabeled"))]
+    let labeled_query_count2 = labeled_query_count.clone();
 
     let inspect = ::std::env::args().find(|x| x == "inspect").is_some();
+    // binary=<path> writes the final labeled counts for CountLabeledQuery
+    let binary_output = ::std::env::args().find(|x| x.starts_with("binary=")).map(|x| x["binary=".len()..].to_string());
+    // epochs=PATH|tcp:PORT streams the counts after every batch to CountLabeledQuery --follow
+    let epochs_target = ::std::env::args().find(|x| x.starts_with("epochs=")).map(|x| x["epochs=".len()..].to_string());
+    #[cfg(feature = "countlabeled")]
+    assert!(epochs_target.is_none(), "epochs= streams raw counters, which the countlabeled feature doesn't keep");
 
     //read vertex label
     let vertex_label_filename = std::env::args().nth(6).unwrap();
     let vertex_id_label_map = Arc::new(read_vertex_id_label_mapping(&vertex_label_filename));
 
+    // with the countlabeled feature the workers fold their matches into classes in-process
+    #[cfg(feature = "countlabeled")]
+    let classes = {
+        let plan_filename = std::env::args().nth(5).unwrap();
+        let num_threads = match Configuration::from_args(std::env::args()).unwrap() {
+            Configuration::Thread => 1,
+            Configuration::Process(threads) => threads,
+            Configuration::Cluster(threads, _, _, _, _) => threads,
+        };
+        Arc::new(countlabeled::ClassCounts::new(&plan_filename, num_threads, 0).expect("couldn't load plan"))
+    };
+    #[cfg(feature = "countlabeled")]
+    let classes2 = classes.clone();
+
     timely::execute_from_args(std::env::args(), move |root| {
         
         let start_dataflow = ::std::time::Instant::now();
         let send = send.clone();
         let counters = labeled_query_count.clone();
+        let epoch_counters = labeled_query_count.clone();
         let vertex_id_label_map = vertex_id_label_map.clone();
 
         // used to partition graph loading
@@ -53,8 +76,21 @@ fn main () {
         };
         let local_index = index % num_threads as u32;
 
+        // one stream per process, of the counters its workers share
+        let mut epochs = match epochs_target {
+            Some(ref target) if local_index == 0 =>
+                Some(EpochWriter::new(count_stream::open_count_stream(target).expect("couldn't open epochs stream"))),
+            _ => None,
+        };
+
         let plan_filename = std::env::args().nth(5).unwrap();
         let plan = count_vertex_labeled_query_plan::read_plan(&plan_filename);
+        #[cfg(feature = "countlabeled")]
+        let plan = {
+            let mut plan = plan;
+            plan.count_classes(classes.clone(), local_index as usize);
+            plan
+        };
 
         // handles to input and probe, but also both indices so we can compact them.
         let (mut inputG, mut inputQ, forward_probe, reverse_probe, probe, handles) = root.dataflow::<u32,_,_>(|builder| {
@@ -195,6 +231,9 @@ fn main () {
             // merge all of the indices we maintain.
             handles.merge_to(&prev);
             batch_end = ::std::time::Instant::now();
+            if let Some(ref mut epochs) = epochs {
+                epochs.write_counters(&epoch_counters).expect("couldn't write epoch");
+            }
 
             if local_index == 0{
                 println!("Batch {} read edge time: {:?}", batch_index, batch_start.duration_since(read_start));
@@ -227,6 +266,9 @@ fn main () {
         inputG.close();
         inputQ.close();
         while root.step() { }
+        if let Some(ref mut epochs) = epochs {
+            epochs.write_counters(&epoch_counters).expect("couldn't write epoch");
+        }
 
         if inspect {
             println!("worker {} elapsed: {:?}", index, start.elapsed());
@@ -242,6 +284,29 @@ fn main () {
     if inspect {
         println!("elapsed: {:?}\ttotal matchings at this process: {:?}", start_main.elapsed(), total);
     }
+
+    if let Some(path) = binary_output {
+        let plan_filename = std::env::args().nth(5).unwrap();
+        let plan = count_vertex_labeled_query_plan::read_plan(&plan_filename);
+        let plan_hash = count_record::plan_hash(&plan_filename).expect("couldn't hash plan file");
+        let file = File::create(&path).expect("couldn't create binary output");
+        let mut writer = CountRecordWriter::new(file, plan_hash, plan.max_subgraph_num_vertices()).expect("write failed");
+        // one record per class, itself a count file of the plan
+        #[cfg(feature = "countlabeled")]
+        {
+            classes2.snapshot(|node_id, labels, count| writer.write(node_id, labels, count).expect("write failed"))
+                .expect("snapshot failed");
+        }
+        #[cfg(not(feature = "countlabeled"))]
+        {
+            let counters = labeled_query_count2.read().expect("RwLock poisoned");
+            for (&(node_id, ref labels), count) in counters.iter() {
+                let count = *count.lock().expect("Mutex poisoned");
+                writer.write(node_id, labels, count).expect("write failed");
+            }
+        }
+        writer.flush().expect("write failed");
+    }
 }
 
 fn read_batch_edges(reader: &mut BufReader<File>, batch: usize, index: u32) -> Vec<((u32, u32), i32)>{
@@ -21,6 +21,8 @@ fn main () {
     let labeled_query_count = Arc::new(RwLock::new(HashMap::new()));
 
     let inspect = ::std::env::args().find(|x| x == "inspect").is_some();
+    // epochs=PATH|tcp:PORT streams the counts after every batch to CountLabeledQuery --follow
+    let epochs_target = ::std::env::args().find(|x| x.starts_with("epochs=")).map(|x| x["epochs=".len()..].to_string());
 
     //read vertex label
     let vertex_label_dirname = std::env::args().nth(6).unwrap();
@@ -32,6 +34,7 @@ fn main () {
         let start_dataflow = ::std::time::Instant::now();
         let send = send.clone();
         let counters = labeled_query_count.clone();
+        let epoch_counters = labeled_query_count.clone();
         let vertex_id_label_map = vertex_id_label_map.clone();
 
         // used to partition graph loading
@@ -46,6 +49,13 @@ fn main () {
         };
         let local_index = index % num_threads as u32;
 
+        // one stream per process, of the counters its workers share
+        let mut epochs = match epochs_target {
+            Some(ref target) if local_index == 0 =>
+                Some(EpochWriter::new(count_stream::open_count_stream(target).expect("couldn't open epochs stream"))),
+            _ => None,
+        };
+
         let plan_filename = std::env::args().nth(5).unwrap();
         let plan = count_vertex_labeled_query_plan::read_plan(&plan_filename);
 
@@ -165,6 +175,9 @@ fn main () {
             // merge all of the indices we maintain.
             handles.merge_to(&prev);
             batch_end = ::std::time::Instant::now();
+            if let Some(ref mut epochs) = epochs {
+                epochs.write_counters(&epoch_counters).expect("couldn't write epoch");
+            }
 
             if local_index == 0{
                 println!("Batch {} read edge time: {:?}", batch_index, batch_start.duration_since(read_start));
@@ -197,6 +210,9 @@ fn main () {
         inputG.close();
         inputQ.close();
         while root.step() { }
+        if let Some(ref mut epochs) = epochs {
+            epochs.write_counters(&epoch_counters).expect("couldn't write epoch");
+        }
 
         if inspect {
             println!("worker {} elapsed: {:?}", index, start.elapsed());
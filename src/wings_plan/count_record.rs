@@ -0,0 +1,59 @@
+//! Binary labeled-count records, read natively by `examples/CountLabeledQuery`.
+//!
+//! The layout matches `count_format.hpp` on the C++ side. All fields are little-endian:
+//! a 32 byte header `"CLQCOUNT", u32 version, u32 max_width, u64 plan_hash, u32 flags, u32 reserved`,
+//! then fixed-width records `u32 node_id, u32 labels[max_width], u64 count`.
+//! Labels past the width of the record's plan node are written as zero.
+
+use std::fs::File;
+use std::io::prelude::*;
+use std::io::{self, BufWriter};
+
+pub const MAGIC: &'static [u8; 8] = b"CLQCOUNT";
+pub const VERSION: u32 = 1;
+
+/// FNV-1a over the plan file bytes, the `plan_hash` stored in the header.
+pub fn plan_hash(filename: &str) -> io::Result<u64> {
+    let mut bytes = Vec::new();
+    File::open(filename)?.read_to_end(&mut bytes)?;
+    let mut hash: u64 = 14695981039346656037;
+    for byte in bytes {
+        hash ^= byte as u64;
+        hash = hash.wrapping_mul(1099511628211);
+    }
+    Ok(hash)
+}
+
+pub struct CountRecordWriter<W: Write> {
+    writer: BufWriter<W>,
+    max_width: usize,
+}
+
+impl<W: Write> CountRecordWriter<W> {
+    pub fn new(writer: W, plan_hash: u64, max_width: usize) -> io::Result<CountRecordWriter<W>> {
+        let mut writer = BufWriter::with_capacity(1 << 20, writer);
+        writer.write_all(MAGIC)?;
+        writer.write_all(&VERSION.to_le_bytes())?;
+        writer.write_all(&(max_width as u32).to_le_bytes())?;
+        writer.write_all(&plan_hash.to_le_bytes())?;
+        writer.write_all(&0u32.to_le_bytes())?;
+        writer.write_all(&0u32.to_le_bytes())?;
+        Ok(CountRecordWriter { writer, max_width })
+    }
+
+    pub fn write(&mut self, node_id: usize, labels: &[u32], count: u64) -> io::Result<()> {
+        assert!(labels.len() <= self.max_width, "record wider than max_width");
+        self.writer.write_all(&(node_id as u32).to_le_bytes())?;
+        for label in labels {
+            self.writer.write_all(&label.to_le_bytes())?;
+        }
+        for _ in labels.len() .. self.max_width {
+            self.writer.write_all(&0u32.to_le_bytes())?;
+        }
+        self.writer.write_all(&count.to_le_bytes())
+    }
+
+    pub fn flush(&mut self) -> io::Result<()> {
+        self.writer.flush()
+    }
+}
@@ -0,0 +1,74 @@
+//! Live text count stream, followed by `examples/CountLabeledQuery` with `--follow`.
+//!
+//! After every batch the producer writes the records whose count changed since the previous
+//! epoch, one per line as `node_id label... count`, then the marker line `#epoch N`. Counts are
+//! cumulative, a record replaces the previous count of its raw key, so the follower's class
+//! totals are those of the producer at every marker. The stream goes to a path (a FIFO or a
+//! file) or, with `tcp:PORT`, to the first follower connecting to that port.
+
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::prelude::*;
+use std::io::{self, BufWriter};
+use std::net::TcpListener;
+use std::sync::{Mutex, RwLock};
+
+/// Opens `target`, `PATH` or `tcp:PORT`; the latter blocks until a follower connects.
+pub fn open_count_stream(target: &str) -> io::Result<Box<Write + Send>> {
+    if target.starts_with("tcp:") {
+        let port: u16 = target["tcp:".len()..].parse()
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "expected tcp:PORT"))?;
+        let listener = TcpListener::bind(("0.0.0.0", port))?;
+        let (stream, _) = listener.accept()?;
+        Ok(Box::new(stream))
+    } else {
+        Ok(Box::new(File::create(target)?))
+    }
+}
+
+pub struct EpochWriter<W: Write> {
+    writer: BufWriter<W>,
+    // count of every raw key as last sent
+    reported: HashMap<(usize, Vec<u32>), u64>,
+    epoch: usize,
+}
+
+impl<W: Write> EpochWriter<W> {
+    pub fn new(writer: W) -> EpochWriter<W> {
+        EpochWriter { writer: BufWriter::with_capacity(1 << 20, writer), reported: HashMap::new(), epoch: 0 }
+    }
+
+    /// Sends the record unless the key's count is the one sent last.
+    pub fn record(&mut self, node_id: usize, labels: &[u32], count: u64) -> io::Result<()> {
+        let key = (node_id, labels.to_vec());
+        if self.reported.get(&key) == Some(&count) {
+            return Ok(());
+        }
+        write!(self.writer, "{}", node_id)?;
+        for label in labels {
+            write!(self.writer, " {}", label)?;
+        }
+        writeln!(self.writer, " {}", count)?;
+        self.reported.insert(key, count);
+        Ok(())
+    }
+
+    /// Ends the epoch with its marker and hands it to the follower.
+    pub fn end_epoch(&mut self) -> io::Result<()> {
+        writeln!(self.writer, "#epoch {}", self.epoch)?;
+        self.epoch += 1;
+        self.writer.flush()
+    }
+
+    /// One epoch of the labeled counters kept by `track_motif`. Costs a pass over the counters.
+    pub fn write_counters(&mut self, counters: &RwLock<HashMap<(usize, Vec<u32>), Mutex<u64>>>) -> io::Result<()> {
+        {
+            let counters = counters.read().expect("RwLock poisoned");
+            for (&(node_id, ref labels), count) in counters.iter() {
+                let count = *count.lock().expect("Mutex poisoned");
+                self.record(node_id, labels, count)?;
+            }
+        }
+        self.end_epoch()
+    }
+}
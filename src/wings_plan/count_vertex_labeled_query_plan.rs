@@ -19,6 +19,8 @@ use super::Indexable;
 
 use super::graph_stream::GraphStreamIndex;
 use wings_plan::ExtendEdges;
+#[cfg(feature = "countlabeled")]
+use wings_plan::countlabeled::ClassCounts;
 
 pub type Node = u32;
 pub type Edge = (Node, Node);
@@ -60,10 +62,25 @@ pub struct VertexLabeledPlan{
     edges: Vec<PlanEdge>,
     nodes: Vec<Rc<PlanNode>>,
     root_node_id: usize,
-    node_graph_map:  Vec<Graph>
+    node_graph_map:  Vec<Graph>,
+    // class totals and this worker's slot in them, see count_classes
+    #[cfg(feature = "countlabeled")]
+    class_counts: Option<(Arc<ClassCounts>, usize)>,
 }
 
 impl VertexLabeledPlan{
+    /// Width of the widest labeled record, i.e. the `max_width` of a binary count file.
+    pub fn max_subgraph_num_vertices(&self) -> usize {
+        self.nodes.iter().map(|node| node.subgraph_num_vertices).max().unwrap_or(0)
+    }
+
+    /// Folds the labeled matches of this worker into `classes`, adding to slot `worker`, instead of
+    /// counting them per raw key in `track_motif`'s `labeled_counters`.
+    #[cfg(feature = "countlabeled")]
+    pub fn count_classes(&mut self, classes: Arc<ClassCounts>, worker: usize) {
+        self.class_counts = Some((classes, worker));
+    }
+
     pub fn track_motif<H1, H2, G: Scope>(&self, graph: &GraphStreamIndex<G, H1, H2>, probe: &mut ProbeHandle<G::Timestamp>, counter: Arc<Mutex<u64>>, labeled_counters: Arc<RwLock<HashMap<(usize,Vec<u32>),Mutex<u64>>>>, vertex_id_label_map: Arc<HashMap<u32, u32>>)
         where H1: Fn(Node)->u64 + 'static,
               H2: Fn(Node)->u64 + 'static
@@ -118,9 +135,23 @@ impl VertexLabeledPlan{
             };
             let child_counters = labeled_counters.clone();
             if child.is_query{
+                #[cfg(feature = "countlabeled")]
+                let class_counts = self.class_counts.clone();
                 output.probe_with(probe);
                 output.exchange(|x| (x.0).index(0) as u64)
                     .inspect_batch(move |_,xs| {
+                        #[cfg(feature = "countlabeled")]
+                        {
+                            if let Some((ref classes, ref worker)) = class_counts {
+                                let mut batch = classes.batch();
+                                for x in xs.iter(){
+                                    batch.push(child.idx, &label_matching(&x.0, vertex_id_label_map2.clone()), 1);
+                                }
+                                classes.add_batch(*worker, &batch).expect("add_batch failed");
+                                return;
+                            }
+                        }
+
                         let mut batch_query_count = HashMap::new();
                         for x in xs.iter(){
                             let labeled_query = label_matching(&x.0, vertex_id_label_map2.clone());
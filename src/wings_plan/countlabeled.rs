@@ -0,0 +1,121 @@
+//! Bindings to `libcountlabeled` (`examples/CountLabeledQuery/countlabeled.h`), which folds
+//! labeled counts into isomorphism classes inside the dataflow process.
+//!
+//! Built with the `countlabeled` feature; the library is found on the linker path, e.g.
+//! `RUSTFLAGS="-L examples/CountLabeledQuery/build"`. Each timely worker adds its batches to its
+//! own slot, in place of the shared `RwLock<HashMap<..>>`; see
+//! `VertexLabeledPlan::count_classes`.
+
+use std::ffi::{CStr, CString};
+use std::fmt;
+use std::io;
+use std::os::raw::{c_char, c_uint, c_void};
+use std::ptr::NonNull;
+
+pub const EDGE_LABELS: u32 = 1;
+pub const CANONICAL: u32 = 2;
+
+#[allow(non_camel_case_types)]
+enum clq_context {}
+
+type ClassCallback = extern "C" fn(*mut c_void, u32, *const u32, u32, u64);
+
+#[link(name = "countlabeled")]
+extern "C" {
+    fn clq_create(plan_file: *const c_char, num_workers: c_uint, flags: c_uint) -> *mut clq_context;
+    fn clq_destroy(ctx: *mut clq_context);
+    fn clq_last_error() -> *const c_char;
+    fn clq_max_width(ctx: *const clq_context) -> c_uint;
+    fn clq_add_batch(ctx: *mut clq_context, worker: c_uint, node_ids: *const u32, labels: *const u32,
+                     counts: *const u64, n: usize) -> i32;
+    fn clq_snapshot(ctx: *mut clq_context, on_class: ClassCallback, user_data: *mut c_void) -> i32;
+}
+
+fn last_error() -> io::Error {
+    let message = unsafe { CStr::from_ptr(clq_last_error()) };
+    io::Error::new(io::ErrorKind::Other, message.to_string_lossy().into_owned())
+}
+
+/// Records of one batch, labels padded to the plan's widest key.
+pub struct Batch {
+    max_width: usize,
+    node_ids: Vec<u32>,
+    labels: Vec<u32>,
+    counts: Vec<u64>,
+}
+
+impl Batch {
+    /// `labels` are the vertex labels of the match, followed by the edge labels with `EDGE_LABELS`.
+    pub fn push(&mut self, node_id: usize, labels: &[u32], count: u64) {
+        assert!(labels.len() <= self.max_width, "record wider than the plan");
+        self.node_ids.push(node_id as u32);
+        self.labels.extend_from_slice(labels);
+        for _ in labels.len() .. self.max_width {
+            self.labels.push(0);
+        }
+        self.counts.push(count);
+    }
+
+    pub fn len(&self) -> usize {
+        self.counts.len()
+    }
+}
+
+/// Class totals of one plan, shared by all workers of the process.
+pub struct ClassCounts {
+    ctx: NonNull<clq_context>,
+    max_width: usize,
+}
+
+// The library locks each worker slot; distinct workers never share one.
+unsafe impl Send for ClassCounts {}
+unsafe impl Sync for ClassCounts {}
+
+impl ClassCounts {
+    pub fn new(plan_file: &str, num_workers: usize, flags: u32) -> io::Result<ClassCounts> {
+        let plan_file = CString::new(plan_file).map_err(|e| io::Error::new(io::ErrorKind::InvalidInput, e))?;
+        let ctx = unsafe { clq_create(plan_file.as_ptr(), num_workers as c_uint, flags) };
+        let ctx = NonNull::new(ctx).ok_or_else(last_error)?;
+        let max_width = unsafe { clq_max_width(ctx.as_ptr()) } as usize;
+        Ok(ClassCounts { ctx, max_width })
+    }
+
+    pub fn batch(&self) -> Batch {
+        Batch { max_width: self.max_width, node_ids: Vec::new(), labels: Vec::new(), counts: Vec::new() }
+    }
+
+    /// Adds the batch's counts to the totals of `worker`.
+    pub fn add_batch(&self, worker: usize, batch: &Batch) -> io::Result<()> {
+        let status = unsafe {
+            clq_add_batch(self.ctx.as_ptr(), worker as c_uint, batch.node_ids.as_ptr(), batch.labels.as_ptr(),
+                          batch.counts.as_ptr(), batch.len())
+        };
+        if status == 0 { Ok(()) } else { Err(last_error()) }
+    }
+
+    /// Calls `on_class(node_id, labels, count)` for every class, `labels` being a representative key.
+    pub fn snapshot<F: FnMut(usize, &[u32], u64)>(&self, mut on_class: F) -> io::Result<()> {
+        extern "C" fn trampoline<F: FnMut(usize, &[u32], u64)>(user_data: *mut c_void, node_id: u32,
+                                                                labels: *const u32, width: u32, count: u64) {
+            let on_class = unsafe { &mut *(user_data as *mut F) };
+            let labels = unsafe { ::std::slice::from_raw_parts(labels, width as usize) };
+            on_class(node_id as usize, labels, count);
+        }
+        let status = unsafe {
+            clq_snapshot(self.ctx.as_ptr(), trampoline::<F>, &mut on_class as *mut F as *mut c_void)
+        };
+        if status == 0 { Ok(()) } else { Err(last_error()) }
+    }
+}
+
+impl fmt::Debug for ClassCounts {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "ClassCounts {{ max_width: {} }}", self.max_width)
+    }
+}
+
+impl Drop for ClassCounts {
+    fn drop(&mut self) {
+        unsafe { clq_destroy(self.ctx.as_ptr()) }
+    }
+}
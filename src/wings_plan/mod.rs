@@ -2,6 +2,10 @@ pub mod count_vertex_labeled_query_plan;
 pub mod count_edge_labeled_query_plan;
 pub mod graph_stream;
 pub mod dir_reader;
+pub mod count_record;
+pub mod count_stream;
+#[cfg(feature = "countlabeled")]
+pub mod countlabeled;
 
 use timely::dataflow::*;
 
@@ -15,6 +19,8 @@ pub use self::graph_stream::GraphStreamIndex;
 pub use self::count_vertex_labeled_query_plan::{VertexLabeledPlan};
 pub use self::count_edge_labeled_query_plan::{EdgeLabeledPlan};
 pub use self::dir_reader::DirReader;
+pub use self::count_record::CountRecordWriter;
+pub use self::count_stream::EpochWriter;
 pub use super::wings_rule::{Index, IndexStream, advance, StreamPrefixExtender, StreamPrefixIntersector, Intersection, GenericJoin, IntersectOnly};
 
 pub type Node = u32;